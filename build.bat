@@ -1,13 +1,6 @@
 @echo off
 
-DEL *.obj 2>NUL
-DEL *.pdb 2>NUL
-DEL *.ilk 2>NUL
-
-SET MSVC_FLAGS=/std:c++17 /MTd /nologo /GR- /Oi /Zi /EHa-
-SET WARNINGS=/W4 /WX /wd4201 /wd4100 /wd4189 /wd4505 /wd4702 /D_CRT_SECURE_NO_WARNINGS
-SET DEFINES=/DDEBUG=1 /DARCH_64BIT=1 /DBYTE_ORDER=1234
-
-SET INCLUDES=/I../code
-
-cl %MSVC_FLAGS% %WARNINGS% %DEFINES% %INCLUDES% /Fee8086 ../code/main.c
+REM The simulator needs POSIX threads, mmap, dirent and unistd, so it does
+REM not build with MSVC. Use build.sh on a POSIX system (or under WSL).
+echo Windows builds are not supported, run build.sh instead
+exit /b 1
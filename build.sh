@@ -1,9 +1,13 @@
 #!/bin/bash
 
-C_FLAGS="-std=c11 -g"
+C_FLAGS="-std=c11 -g -pthread"
 WARNINGS="-Wall -Werror"
 DEFINES=""
 
 INCLUDES="-I../code"
 
-gcc $C_FLAGS $WARNINGS $DEFINES $INCLUDES -o e8086 ../code/main.c
+gcc $C_FLAGS $WARNINGS $DEFINES $INCLUDES -c -o e8086.o ../code/e8086.c
+ar rcs libe8086.a e8086.o
+
+gcc $C_FLAGS $WARNINGS $DEFINES $INCLUDES -o e8086 ../code/main.c libe8086.a
+gcc $C_FLAGS $WARNINGS $DEFINES $INCLUDES -o e8086-trace ../code/e8086_trace.c libe8086.a
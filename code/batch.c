@@ -0,0 +1,422 @@
+/*
+    Batch runs (--batch).
+
+    Runs many binaries in one process and writes one JSON line per binary,
+    in the order they were given:
+
+        {"file":"a.bin","status":"halted","cycles":66000,
+         "registers":{"ax":0,...,"ip":25,"flags":64,"es":0,...,"ds":0},
+         "memory_hash":"cbf29ce484222325"}
+
+    memory_hash is FNV-1a over the first 64 KiB and any page above it that
+    is not all zero, see hash_memory. A run that fails adds "error" with
+    the message e8086 would print. Files that cannot be read get the
+    status "unreadable". With --profile a line also has the hottest IPs
+    of the run, see profile.c:
+
+        "hotspots":[{"ip":6,"count":1000,"cycles":20000,"ea_cycles":6000},...]
+
+    --stats-out counts instructions in every worker for all of its runs,
+    see instruction_stats.c. The counts are added up when the batch is
+    done and written once.
+
+    Every worker thread owns a simulator and a read buffer for the whole
+    batch and only resets them between binaries, so a run allocates nothing
+    but its result line. Workers start with an equal share of the jobs and
+    take from the front of their own range. One that runs out steals the
+    back half of another worker's range, so a few slow binaries do not
+    leave the other cores idle.
+*/
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+typedef struct
+{
+    char const *path;
+    char *line; // set when the job is done, until it is written
+} batch_job;
+
+typedef struct
+{
+    alignas(64) pthread_mutex_t lock;
+    uint32 begin; // jobs [begin, end) are not started yet
+    uint32 end;
+} batch_queue;
+
+struct batch_runner;
+
+typedef struct
+{
+    batch_queue queue;
+    struct batch_runner *runner;
+    uint32 index;
+    pthread_t thread;
+
+    sim8086 *sim;
+    uint8 *image; // one byte more than fits, to notice images that are too large
+    uint16 *hotspots; // profile_rows IPs, 0 if not profiling
+
+    uint64 runs;
+    uint64 steals;
+} batch_worker;
+
+typedef struct batch_runner
+{
+    batch_job *jobs;
+    uint32 job_count;
+    batch_worker *workers;
+    uint32 worker_count;
+    uint64 max_cycles; // 0 for no limit
+    uint32 profile_rows; // hotspots per line, 0 if not profiling
+
+    pthread_mutex_t output_lock;
+    uint32 next_output; // first job whose line is not written yet
+} batch_runner;
+
+// FNV-1a over little-endian 64-bit words rather than bytes, a byte at a
+// time the multiplies alone cost more than most runs. Size is a multiple of 8.
+uint64 hash_words(uint64 hash, uint8 const *memory, uint32 size)
+{
+    for (uint32 offset = 0; offset < size; offset += 8)
+    {
+        uint64 word;
+        memcpy(&word, memory + offset, 8);
+        hash = (hash ^ word) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// The first 64 KiB as a whole, so programs that stay in it hash the same
+// as before there were segments. Pages above it, up to 1 MiB, only count
+// when they hold something, with their index so moving data changes the
+// hash.
+uint64 hash_memory(sim8086 *sim)
+{
+    uint8 const *memory = e8086_memory(sim);
+    uint64 hash = hash_words(0xcbf29ce484222325ull, memory, SEGMENT_SIZE);
+    for (uint32 page = SEGMENT_SIZE >> MEMORY_PAGE_SHIFT; page < MEMORY_PAGE_COUNT; page++)
+    {
+        if (e8086_page_is_zero(sim, page)) continue;
+        hash = (hash ^ page) * 0x100000001b3ull;
+        hash = hash_words(hash, memory + (page << MEMORY_PAGE_SHIFT), MEMORY_PAGE_SIZE);
+    }
+    return hash;
+}
+
+char *append_json_string(char *out, char const *string)
+{
+    *out++ = '"';
+    for (uint8 const *c = (uint8 const *) string; *c; c++)
+    {
+        if (*c == '"' || *c == '\\') { *out++ = '\\'; *out++ = *c; }
+        else if (*c < 0x20) out += sprintf(out, "\\u%04x", *c);
+        else *out++ = *c;
+    }
+    *out++ = '"';
+    *out = 0;
+    return out;
+}
+
+char *run_batch_job(batch_worker *worker, char const *path)
+{
+    uint32 max_size = SEGMENT_SIZE;
+    uint32 profile_rows = worker->runner->profile_rows;
+    char *line = malloc(6 * strlen(path) + 512 + profile_rows * 96);
+    char *out = line;
+    out += sprintf(out, "{\"file\":");
+    out = append_json_string(out, path);
+
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        sprintf(out, ",\"status\":\"unreadable\",\"error\":\"Could not open file\"}\n");
+        return line;
+    }
+    uint32 size = (uint32) fread(worker->image, 1, max_size + 1, f);
+    fclose(f);
+
+    sim8086 *sim = worker->sim;
+    e8086_reset(sim);
+    e8086_status status = e8086_load(sim, worker->image, size);
+    if (status == E8086_OK)
+    {
+        e8086_run_limits limits = { .max_cycles = worker->runner->max_cycles, .stop_ip = -1 };
+        status = e8086_run_until(sim, limits);
+    }
+
+    e8086_state state = e8086_get_state(sim);
+    out += sprintf(out, ",\"status\":\"%s\",\"cycles\":%llu,"
+        "\"registers\":{\"ax\":%u,\"bx\":%u,\"cx\":%u,\"dx\":%u,"
+        "\"sp\":%u,\"bp\":%u,\"si\":%u,\"di\":%u,\"ip\":%u,\"flags\":%u,"
+        "\"es\":%u,\"cs\":%u,\"ss\":%u,\"ds\":%u},"
+        "\"memory_hash\":\"%016llx\"",
+        e8086_status_name(status), state.cycles,
+        state.ax, state.bx, state.cx, state.dx,
+        state.sp, state.bp, state.si, state.di, state.ip, state.flags,
+        state.es, state.cs, state.ss, state.ds,
+        hash_memory(sim));
+    if (profile_rows)
+    {
+        uint32 count = find_hotspots(sim, worker->hotspots, profile_rows);
+        out += sprintf(out, ",\"hotspots\":[");
+        for (uint32 index = 0; index < count; index++)
+        {
+            cycle_counter *entry = e8086_profile(sim) + worker->hotspots[index];
+            out += sprintf(out, "%s{\"ip\":%u,\"count\":%llu,\"cycles\":%llu,\"ea_cycles\":%llu}",
+                index ? "," : "", worker->hotspots[index], entry->count,
+                entry->cycles + entry->ea_cycles, entry->ea_cycles);
+        }
+        out += sprintf(out, "]");
+
+        // Nothing past the image runs, so that is all the next binary has to find zeroed
+        memset(e8086_profile(sim), 0, e8086_image_size(sim) * sizeof(cycle_counter));
+    }
+    if (status >= E8086_ERROR_UNKNOWN_OPCODE)
+    {
+        out += sprintf(out, ",\"error\":");
+        out = append_json_string(out, e8086_error(sim));
+    }
+    sprintf(out, "}\n");
+    return line;
+}
+
+// Writes every finished line that has no unfinished one in front of it
+void finish_batch_job(batch_runner *runner, uint32 job_index, char *line)
+{
+    pthread_mutex_lock(&runner->output_lock);
+    runner->jobs[job_index].line = line;
+    while (runner->next_output < runner->job_count && runner->jobs[runner->next_output].line)
+    {
+        batch_job *job = runner->jobs + runner->next_output;
+        fputs(job->line, stdout);
+        free(job->line);
+        job->line = 0;
+        runner->next_output += 1;
+    }
+    pthread_mutex_unlock(&runner->output_lock);
+}
+
+bool take_batch_job(batch_queue *queue, uint32 *job_index)
+{
+    pthread_mutex_lock(&queue->lock);
+    bool found = queue->begin < queue->end;
+    if (found) *job_index = queue->begin++;
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+// Moves the back half of some other worker's jobs into the (empty) queue of this one
+bool steal_batch_jobs(batch_worker *thief)
+{
+    batch_runner *runner = thief->runner;
+    for (uint32 offset = 1; offset < runner->worker_count; offset++)
+    {
+        batch_queue *victim = &runner->workers[(thief->index + offset) % runner->worker_count].queue;
+
+        pthread_mutex_lock(&victim->lock);
+        uint32 count = (victim->end - victim->begin + 1) / 2;
+        uint32 end = victim->end;
+        victim->end -= count;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (count)
+        {
+            pthread_mutex_lock(&thief->queue.lock);
+            thief->queue.begin = end - count;
+            thief->queue.end = end;
+            pthread_mutex_unlock(&thief->queue.lock);
+            thief->steals += 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+void *run_batch_worker(void *data)
+{
+    batch_worker *worker = data;
+    batch_runner *runner = worker->runner;
+
+    // Jobs are never added, so once nothing is left to steal the batch is done
+    uint32 job_index;
+    while (take_batch_job(&worker->queue, &job_index) ||
+           (steal_batch_jobs(worker) && take_batch_job(&worker->queue, &job_index)))
+    {
+        char *line = run_batch_job(worker, runner->jobs[job_index].path);
+        finish_batch_job(runner, job_index, line);
+        worker->runs += 1;
+    }
+    return 0;
+}
+
+int compare_strings(void const *a, void const *b)
+{
+    return strcmp(*(char const **) a, *(char const **) b);
+}
+
+void add_batch_path(char const ***paths, uint32 *count, uint32 *capacity, char *path)
+{
+    if (*count == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        *paths = realloc(*paths, *capacity * sizeof(char const *));
+    }
+    (*paths)[(*count)++] = path;
+}
+
+// Regular files of a directory, sorted by name so the output order is stable
+void add_batch_directory(char const ***paths, uint32 *count, uint32 *capacity, char const *directory)
+{
+    DIR *dir = opendir(directory);
+    if (!dir) return;
+
+    uint32 first = *count;
+    struct dirent *entry;
+    while ((entry = readdir(dir)))
+    {
+        uint32 length = (uint32) strlen(directory);
+        char const *separator = (length && directory[length - 1] == '/') ? "" : "/";
+        char *path = malloc(length + strlen(entry->d_name) + 2);
+        sprintf(path, "%s%s%s", directory, separator, entry->d_name);
+
+        struct stat info;
+        if (stat(path, &info) == 0 && S_ISREG(info.st_mode)) add_batch_path(paths, count, capacity, path);
+        else free(path);
+    }
+    closedir(dir);
+    qsort(*paths + first, *count - first, sizeof(char const *), compare_strings);
+}
+
+// Arguments can be binaries or directories, list_path names a file with one path per line
+int run_batch(char const **args, uint32 arg_count, char const *list_path,
+    uint32 thread_count, uint64 max_cycles, bool print_stats, uint32 profile_rows, stats_export *stats_out)
+{
+    char const **paths = 0;
+    uint32 count = 0;
+    uint32 capacity = 0;
+
+    if (list_path)
+    {
+        FILE *list = fopen(list_path, "r");
+        if (!list)
+        {
+            printf("Could not open batch list \'%s\'\n", list_path);
+            return 1;
+        }
+        char line[4096];
+        while (fgets(line, sizeof(line), list))
+        {
+            line[strcspn(line, "\r\n")] = 0;
+            if (line[0]) add_batch_path(&paths, &count, &capacity, strdup(line));
+        }
+        fclose(list);
+    }
+    for (uint32 arg_index = 0; arg_index < arg_count; arg_index++)
+    {
+        struct stat info;
+        if (stat(args[arg_index], &info) == 0 && S_ISDIR(info.st_mode))
+        {
+            add_batch_directory(&paths, &count, &capacity, args[arg_index]);
+        }
+        else add_batch_path(&paths, &count, &capacity, strdup(args[arg_index]));
+    }
+
+    batch_runner runner = { .job_count = count, .max_cycles = max_cycles, .profile_rows = profile_rows };
+    runner.jobs = calloc(count ? count : 1, sizeof(batch_job));
+    for (uint32 job_index = 0; job_index < count; job_index++) runner.jobs[job_index].path = paths[job_index];
+    pthread_mutex_init(&runner.output_lock, 0);
+
+    if (thread_count == 0) thread_count = 1;
+    if (thread_count > count && count > 0) thread_count = count;
+    runner.worker_count = thread_count;
+    runner.workers = aligned_alloc(alignof(batch_worker), thread_count * sizeof(batch_worker));
+    memset(runner.workers, 0, thread_count * sizeof(batch_worker));
+
+    double start = get_wall_clock();
+
+    // Simulators are created here, e8086_create fills tables every thread shares
+    for (uint32 worker_index = 0; worker_index < thread_count; worker_index++)
+    {
+        batch_worker *worker = runner.workers + worker_index;
+        worker->runner = &runner;
+        worker->index = worker_index;
+        worker->sim = e8086_create();
+        if (!worker->sim)
+        {
+            printf("Could not map memory for the simulator\n");
+            return 1;
+        }
+        worker->image = malloc(SEGMENT_SIZE + 1);
+        if (profile_rows)
+        {
+            e8086_count(worker->sim, E8086_COUNT_PROFILE);
+            worker->hotspots = malloc(profile_rows * sizeof(uint16));
+        }
+        if (stats_out) e8086_count(worker->sim, E8086_COUNT_STATS);
+        pthread_mutex_init(&worker->queue.lock, 0);
+        worker->queue.begin = (uint32) ((uint64) count * worker_index / thread_count);
+        worker->queue.end = (uint32) ((uint64) count * (worker_index + 1) / thread_count);
+    }
+
+    // The calling thread is worker 0. Jobs of workers that could not be
+    // started are left to be stolen.
+    uint32 started = 1;
+    for (; started < thread_count; started++)
+    {
+        batch_worker *worker = runner.workers + started;
+        if (pthread_create(&worker->thread, 0, run_batch_worker, worker) != 0) break;
+    }
+    run_batch_worker(runner.workers);
+    for (uint32 worker_index = 1; worker_index < started; worker_index++)
+    {
+        pthread_join(runner.workers[worker_index].thread, 0);
+    }
+
+    double elapsed = get_wall_clock() - start;
+    fflush(stdout);
+
+    if (print_stats)
+    {
+        fprintf(stderr, "Batch: %u binaries in %.3fs on %u threads, %.0f binaries/s\n",
+            count, elapsed, started, count / elapsed);
+        for (uint32 worker_index = 0; worker_index < thread_count; worker_index++)
+        {
+            batch_worker *worker = runner.workers + worker_index;
+            fprintf(stderr, "    thread %u: %llu runs, %llu steals\n", worker_index, worker->runs, worker->steals);
+        }
+    }
+
+    bool stats_written = true;
+    if (stats_out)
+    {
+        instruction_stats *stats = calloc(1, sizeof(instruction_stats));
+        for (uint32 worker_index = 0; worker_index < thread_count; worker_index++)
+        {
+            merge_stats(stats, e8086_instruction_stats(runner.workers[worker_index].sim));
+        }
+        write_stats(stats_out, stats);
+        stats_written = close_stats_export(stats_out);
+        free(stats);
+    }
+
+    for (uint32 worker_index = 0; worker_index < thread_count; worker_index++)
+    {
+        e8086_destroy(runner.workers[worker_index].sim);
+        free(runner.workers[worker_index].image);
+        free(runner.workers[worker_index].hotspots);
+        pthread_mutex_destroy(&runner.workers[worker_index].queue.lock);
+    }
+    for (uint32 job_index = 0; job_index < count; job_index++) free((char *) paths[job_index]);
+    free(paths);
+    free(runner.jobs);
+    free(runner.workers);
+    pthread_mutex_destroy(&runner.output_lock);
+
+    if (!stats_written)
+    {
+        fprintf(stderr, "Could not write the stats file\n");
+        return 1;
+    }
+    return 0;
+}
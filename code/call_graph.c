@@ -0,0 +1,120 @@
+/*
+    Call graphs (--call-graph=FILE): cycles by function and by call stack.
+
+    With E8086_COUNT_CALLS (e8086_count), the interpreter keeps a shadow
+    call stack next to the real one (track_call in e8086.c): a CALL goes
+    into the function at its target and a RET back to the caller. Every instruction adds its
+    cycles to the function it runs in, a CALL to the caller and a RET to
+    the function it returns from. The threaded engine and the JIT do not
+    track calls.
+
+    Stacks are the nodes of a tree, one per function per stack it was
+    called on, each with the cycles spent in that function itself. A CALL
+    looks for its target among the callees of the running node, any other
+    instruction adds to a counter. Node 0 is the code the run started in,
+    named by its IP as functions are named by their entry address.
+
+    The report lists functions by inclusive cycles, their own and those of
+    everything they called, next to their exclusive cycles, their own only.
+    A recursive function counts the inclusive cycles of its outermost calls.
+    FILE gets a line per stack with the exclusive cycles of its last
+    function, the collapsed stack format that flamegraph.pl and speedscope
+    read:
+
+        0000;0040;0100 1234
+
+    The shadow stack only follows CALL and RET. Code that leaves a function
+    some other way stays in it as far as the call graph goes, and a RET with
+    no CALL to return from is counted and otherwise ignored.
+*/
+
+#define CALL_GRAPH_ROWS 20
+
+typedef struct
+{
+    uint16 function;
+    uint64 calls;
+    uint64 inclusive;
+    uint64 exclusive;
+} function_cycles;
+
+// Most inclusive cycles first, then lower addresses
+int compare_function_cycles(void const *a, void const *b)
+{
+    function_cycles const *x = a;
+    function_cycles const *y = b;
+    if (x->inclusive != y->inclusive) return (x->inclusive < y->inclusive) ? 1 : -1;
+    return x->function - y->function;
+}
+
+// Whether the function of `node` is on the stack below it as well
+bool is_recursive_call(call_graph *graph, uint32 node)
+{
+    uint16 function = graph->nodes[node].function;
+    for (uint32 caller = node; caller != 0;)
+    {
+        caller = graph->nodes[caller].parent;
+        if (graph->nodes[caller].function == function) return true;
+    }
+    return false;
+}
+
+void print_out_call_graph(call_graph *graph)
+{
+    // Callees are added after their callers, so going backwards sums up subtrees
+    uint64 *inclusive = calloc(graph->count, sizeof(uint64));
+    for (uint32 node = 0; node < graph->count; node++) inclusive[node] = graph->nodes[node].cycles;
+    for (uint32 node = graph->count; node-- > 1;) inclusive[graph->nodes[node].parent] += inclusive[node];
+    uint64 total = inclusive[0];
+
+    function_cycles *functions = calloc(SEGMENT_SIZE, sizeof(function_cycles));
+    for (uint32 node = 0; node < graph->count; node++)
+    {
+        call_node *n = graph->nodes + node;
+        function_cycles *f = functions + n->function;
+        f->function = n->function;
+        f->calls += n->calls;
+        f->exclusive += n->cycles;
+        if (!is_recursive_call(graph, node)) f->inclusive += inclusive[node];
+    }
+    free(inclusive);
+
+    uint32 count = 0;
+    for (uint32 function = 0; function < SEGMENT_SIZE; function++)
+    {
+        if (functions[function].calls || functions[function].inclusive) functions[count++] = functions[function];
+    }
+    qsort(functions, count, sizeof(function_cycles), compare_function_cycles);
+
+    printf("Call graph: %u functions, %u call stacks, %llu cycles\n", count, graph->count, total);
+    printf("    function        calls    inclusive       %%    exclusive       %%\n");
+    for (uint32 index = 0; index < count && index < CALL_GRAPH_ROWS; index++)
+    {
+        function_cycles *f = functions + index;
+        printf("        %04x %12llu %12llu %6.2f%% %12llu %6.2f%%\n", f->function, f->calls,
+            f->inclusive, total ? 100.0 * f->inclusive / total : 0.0,
+            f->exclusive, total ? 100.0 * f->exclusive / total : 0.0);
+    }
+    if (graph->stray_returns) printf("    %llu returns without a call\n", graph->stray_returns);
+    free(functions);
+}
+
+// A line per stack that spent cycles in its last function. Gives false if
+// the file could not be written.
+bool write_collapsed_stacks(call_graph *graph, char const *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file) return false;
+
+    uint32 stack[CALL_GRAPH_MAX_DEPTH + 1];
+    for (uint32 node = 0; node < graph->count; node++)
+    {
+        if (!graph->nodes[node].cycles) continue;
+        uint32 depth = 0;
+        for (uint32 at = node; at != 0; at = graph->nodes[at].parent) stack[depth++] = at;
+        fprintf(file, "%04x", graph->nodes[0].function);
+        while (depth-- > 0) fprintf(file, ";%04x", graph->nodes[stack[depth]].function);
+        fprintf(file, " %llu\n", graph->nodes[node].cycles);
+    }
+    return fclose(file) == 0;
+}
@@ -0,0 +1,2343 @@
+// POSIX, BSD and Linux extensions (mmap flags, memfd_create and such)
+// are hidden under -std=c11
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdalign.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "e8086_internal.h"
+
+/*
+    sp - stack pointer
+    bp - base pointer
+    si - source index
+    di - destination index
+*/
+
+enum opcode
+{
+    OPCODE_MOV1 = 0b10001000, // mov (register/memory to/from register)
+    OPCODE_MOV2 = 0b11000110, // mov (immediate to register/memory)
+    OPCODE_MOV3 = 0b10110000, // mov (immediate to register)
+    OPCODE_MOV4 = 0b10100000, // mov (memory to accumulator)
+    OPCODE_MOV5 = 0b10100010, // mov (accumulator to memory)
+    OPCODE_MOV6 = 0b10001110, // mov (register/memory to segment register)
+    OPCODE_MOV7 = 0b10001100, // mov (segment register to register/memory)
+
+    OPCODE_ADD1 = 0b00000000, // add (reg/memory with register to either)
+    OPCODE_ADD3 = 0b00000100, // add (immediate to accumulator)
+
+    OPCODE_SUB1 = 0b00101000, // sub (reg/memory and register to either)
+    OPCODE_SUB3 = 0b00101100, // sub (immediate from accumulator)
+
+    OPCODE_CMP1 = 0b00111000, // cmp (reg/memory and register)
+    OPCODE_CMP3 = 0b00111100, // cmp (immediate with accumulator)
+
+    OPCODE_JE   = 0b01110100, // jump on equal / zero
+    OPCODE_JL   = 0b01111100, // jump on less / not greater or equal
+    OPCODE_JLE  = 0b01111110, // jump on less or equal / not greater
+    OPCODE_JB   = 0b01110010, // jump on below/not above or equal
+    OPCODE_JBE  = 0b01110110, // jump on below or equal / not above
+    OPCODE_JP   = 0b01111010, // jump on parity / parity even
+    OPCODE_JO   = 0b01110000, // jump on overflow
+    OPCODE_JS   = 0b01111000, // jump on sign
+    OPCODE_JNE  = 0b01110101, // jump on not equal / not zero
+    OPCODE_JNL  = 0b01111101, // jump on not less / greater or equal
+    OPCODE_JNLE = 0b01111111, // jump on not less or equal / greater
+    OPCODE_JNB  = 0b01110011, // jump on not below / above or equal
+    OPCODE_JNBE = 0b01110111, // jump on not below or equal / above
+    OPCODE_JNP  = 0b01111011, // jump on not par / par odd
+    OPCODE_JNO  = 0b01110001, // jump on not overflow
+    OPCODE_JNS  = 0b01111001, // jump on not sign
+    OPCODE_LOOP = 0b11100010, // loop CX times
+    OPCODE_LOOPZ = 0b11100001, // loop while zero
+    OPCODE_LOOPNZ = 0b11100000, // loop while not zero
+    OPCODE_JCXZ = 0b11100011, // jump on CX zero
+
+    OPCODE_IMM_TO_REG_MEM = 0b10000000, // add (immediate to register/memory)
+
+    OPCODE_PUSH_REG = 0b01010000, // push (register)
+    OPCODE_PUSH_SEG = 0b00000110, // push (segment register, 000 sreg 110)
+    OPCODE_POP_REG  = 0b01011000, // pop (register)
+    OPCODE_POP_SEG  = 0b00000111, // pop (segment register, 000 sreg 111)
+    OPCODE_POP_MEM  = 0b10001111, // pop (register/memory)
+    OPCODE_CALL     = 0b11101000, // call (direct within segment)
+    OPCODE_RET      = 0b11000010, // ret (within segment, 11000010 adds an immediate to SP)
+    OPCODE_GROUP_FF = 0b11111111, // call (indirect within segment) and push (register/memory)
+
+    OPCODE_MOVS = 0b10100100, // move byte/word (string)
+    OPCODE_CMPS = 0b10100110, // compare byte/word (string)
+    OPCODE_STOS = 0b10101010, // store byte/word from AL/AX (string)
+    OPCODE_LODS = 0b10101100, // load byte/word to AL/AX (string)
+    OPCODE_SCAS = 0b10101110, // scan byte/word (string)
+    OPCODE_CLD  = 0b11111100, // clear direction
+    OPCODE_STD  = 0b11111101, // set direction
+
+    OPCODE_SEGMENT = 0b00100110, // segment override prefix (001 sreg 110)
+    OPCODE_REP     = 0b11110010, // repeat prefix (1111001 z, z = 0 for repne)
+};
+
+enum
+{
+    MOD_00 = 0b00,
+    MOD_01 = 0b01,
+    MOD_10 = 0b10,
+    MOD_RM = 0b11,
+};
+
+enum
+{
+    FLAGS_OP_NONE, // flags are stored in registers.flags as they are
+    FLAGS_OP_ADD,
+    FLAGS_OP_SUB,  // SUB and CMP
+};
+
+// Arithmetic flags are not computed when an instruction runs. The operation
+// and its operands are recorded instead, and flags are derived from them
+// only when something reads them.
+typedef struct
+{
+    uint16 op;
+    uint16 w;
+    uint16 dst, src; // operands before the operation
+    uint16 result;   // truncated to the operation width
+} lazy_flags;
+
+// The general and segment registers are laid out in encoding order, so every
+// register encoding maps to a fixed byte offset (see register_offsets).
+typedef struct
+{
+    union
+    {
+        uint16 words[8]; // ax cx dx bx sp bp si di
+        struct
+        {
+            union { uint16 ax; struct { uint8 al, ah; }; };
+            union { uint16 cx; struct { uint8 cl, ch; }; };
+            union { uint16 dx; struct { uint8 dl, dh; }; };
+            union { uint16 bx; struct { uint8 bl, bh; }; };
+            uint16 sp;
+            uint16 bp;
+            uint16 si;
+            uint16 di;
+        };
+    };
+    union
+    {
+        uint16 segments[4]; // es cs ss ds
+        struct
+        {
+            uint16 es;
+            uint16 cs;
+            uint16 ss;
+            uint16 ds;
+        };
+    };
+    uint16 ip;
+    // struct
+    // {
+    //     uint16 _u0 : 1;
+    //     uint16 _u1 : 1;
+    //     uint16 _u2 : 1;
+    //     uint16 _u3 : 1;
+    //     uint16 fo : 1;
+    //     uint16 fd : 1;
+    //     uint16 fi : 1;
+    //     uint16 ft : 1;
+    //     uint16 fs : 1;
+    //     uint16 fz : 1;
+    //     uint16 _u4 : 1;
+    //     uint16 fa : 1;
+    //     uint16 _u5 : 1;
+    //     uint16 f : 1;
+    //     uint16 f : 1;
+    // };
+    uint16 flags; // arithmetic flags are only valid while lazy.op == FLAGS_OP_NONE
+    lazy_flags lazy;
+} registers;
+
+// Byte offset of every register encoding in registers: al cl dl bl are the
+// low bytes of the first four words, ah ch dh bh the high bytes.
+static uint8 register_offsets[20] =
+{
+    0, 2, 4, 6, 1, 3, 5, 7,
+    0, 2, 4, 6, 8, 10, 12, 14,
+    16, 18, 20, 22,
+};
+
+static void record_flags(registers *rs, uint16 op, int32 w, uint16 dst, uint16 src, uint16 result)
+{
+    rs->lazy = (lazy_flags) { .op = op, .w = w, .dst = dst, .src = src, .result = result };
+}
+
+// PF is set when the low byte of a result has an even number of set bits
+#define PARITY2(n) n, n ^ 1, n ^ 1, n
+#define PARITY4(n) PARITY2(n), PARITY2(n ^ 1), PARITY2(n ^ 1), PARITY2(n)
+#define PARITY6(n) PARITY4(n), PARITY4(n ^ 1), PARITY4(n ^ 1), PARITY4(n)
+static uint8 parity_table[256] = { PARITY6(1), PARITY6(0), PARITY6(0), PARITY6(1) };
+
+static uint16 sign_bit(int32 w)
+{
+    return w ? 0x8000 : 0x80;
+}
+
+static bool flag_zf(registers *rs)
+{
+    if (rs->lazy.op == FLAGS_OP_NONE) return (rs->flags & FLAG_ZF) != 0;
+    return rs->lazy.result == 0;
+}
+
+static bool flag_sf(registers *rs)
+{
+    if (rs->lazy.op == FLAGS_OP_NONE) return (rs->flags & FLAG_SF) != 0;
+    return (rs->lazy.result & sign_bit(rs->lazy.w)) != 0;
+}
+
+static bool flag_cf(registers *rs)
+{
+    lazy_flags *f = &rs->lazy;
+    switch (f->op)
+    {
+    case FLAGS_OP_ADD: return f->result < f->dst; // wrapped around
+    case FLAGS_OP_SUB: return f->dst < f->src;    // borrowed
+    default: return (rs->flags & FLAG_CF) != 0;
+    }
+}
+
+static bool flag_of(registers *rs)
+{
+    lazy_flags *f = &rs->lazy;
+    switch (f->op)
+    {
+    // operands of the same sign, result of the other one
+    case FLAGS_OP_ADD: return ((f->dst ^ f->result) & (f->src ^ f->result) & sign_bit(f->w)) != 0;
+    // operands of different signs, result has the sign of the subtrahend
+    case FLAGS_OP_SUB: return ((f->dst ^ f->src) & (f->dst ^ f->result) & sign_bit(f->w)) != 0;
+    default: return (rs->flags & FLAG_OF) != 0;
+    }
+}
+
+static bool flag_af(registers *rs)
+{
+    lazy_flags *f = &rs->lazy;
+    if (f->op == FLAGS_OP_NONE) return (rs->flags & FLAG_AF) != 0;
+    return ((f->dst ^ f->src ^ f->result) & 0x10) != 0; // carry or borrow out of bit 3
+}
+
+static bool flag_pf(registers *rs)
+{
+    if (rs->lazy.op == FLAGS_OP_NONE) return (rs->flags & FLAG_PF) != 0;
+    return parity_table[rs->lazy.result & 0xff];
+}
+
+// The whole FLAGS word, for everything that needs more than one flag
+static uint16 read_flags(registers *rs)
+{
+    if (rs->lazy.op == FLAGS_OP_NONE) return rs->flags;
+
+    uint16 result = rs->flags & ~(FLAG_CF | FLAG_PF | FLAG_AF | FLAG_ZF | FLAG_SF | FLAG_OF);
+    if (flag_cf(rs)) result |= FLAG_CF;
+    if (flag_pf(rs)) result |= FLAG_PF;
+    if (flag_af(rs)) result |= FLAG_AF;
+    if (flag_zf(rs)) result |= FLAG_ZF;
+    if (flag_sf(rs)) result |= FLAG_SF;
+    if (flag_of(rs)) result |= FLAG_OF;
+    return result;
+}
+
+
+#define REGISTER_OPERAND(REG) \
+    ((instruction_operand) { .tag = IOP_REG, .reg = (REG), .reg_offset = register_offsets[REG] })
+
+typedef struct
+{
+    enum opcode opcode;
+    int mask;
+    instruction_tag instruction;
+} opcode_info;
+
+static opcode_info opcode_table[] =
+{
+    { OPCODE_MOV1, 0b11111100, I_MOV },
+    { OPCODE_MOV2, 0b11111110, I_MOV },
+    { OPCODE_MOV3, 0b11110000, I_MOV },
+    { OPCODE_MOV4, 0b11111110, I_MOV },
+    { OPCODE_MOV5, 0b11111110, I_MOV },
+    { OPCODE_MOV6, 0b11111111, I_MOV },
+    { OPCODE_MOV7, 0b11111111, I_MOV },
+
+    { OPCODE_ADD1, 0b11111100, I_ADD },
+    { OPCODE_ADD3, 0b11111110, I_ADD },
+
+    { OPCODE_SUB1, 0b11111100, I_SUB },
+    { OPCODE_SUB3, 0b11111110, I_SUB },
+
+    { OPCODE_CMP1, 0b11111100, I_CMP },
+    { OPCODE_CMP3, 0b11111110, I_CMP },
+
+    { OPCODE_JE,   0b11111111, I_JE },
+    { OPCODE_JL,   0b11111111, I_JL },
+    { OPCODE_JLE,  0b11111111, I_JLE },
+    { OPCODE_JB,   0b11111111, I_JB },
+    { OPCODE_JBE,  0b11111111, I_JBE },
+    { OPCODE_JP,   0b11111111, I_JP },
+    { OPCODE_JO,   0b11111111, I_JO },
+    { OPCODE_JS,   0b11111111, I_JS },
+    { OPCODE_JNE,  0b11111111, I_JNE },
+    { OPCODE_JNL,  0b11111111, I_JNL },
+    { OPCODE_JNLE, 0b11111111, I_JNLE },
+    { OPCODE_JNB,  0b11111111, I_JNB },
+    { OPCODE_JNBE, 0b11111111, I_JNBE },
+    { OPCODE_JNP,  0b11111111, I_JNP },
+    { OPCODE_JNO,  0b11111111, I_JNO },
+    { OPCODE_JNS,  0b11111111, I_JNS },
+    { OPCODE_LOOP, 0b11111111, I_LOOP },
+    { OPCODE_LOOPZ, 0b11111111, I_LOOPZ },
+    { OPCODE_LOOPNZ, 0b11111111, I_LOOPNZ },
+    { OPCODE_JCXZ, 0b11111111, I_JCXZ },
+
+    { OPCODE_IMM_TO_REG_MEM, 0b11111100, I_NOOP },
+
+    { OPCODE_PUSH_REG, 0b11111000, I_PUSH },
+    { OPCODE_PUSH_SEG, 0b11100111, I_PUSH },
+    { OPCODE_POP_REG,  0b11111000, I_POP },
+    { OPCODE_POP_SEG,  0b11100111, I_POP },
+    { OPCODE_POP_MEM,  0b11111111, I_POP },
+    { OPCODE_CALL,     0b11111111, I_CALL },
+    { OPCODE_RET,      0b11111110, I_RET },
+    { OPCODE_GROUP_FF, 0b11111111, I_NOOP },
+
+    { OPCODE_MOVS, 0b11111110, I_MOVS },
+    { OPCODE_CMPS, 0b11111110, I_CMPS },
+    { OPCODE_STOS, 0b11111110, I_STOS },
+    { OPCODE_LODS, 0b11111110, I_LODS },
+    { OPCODE_SCAS, 0b11111110, I_SCAS },
+    { OPCODE_CLD,  0b11111111, I_CLD },
+    { OPCODE_STD,  0b11111111, I_STD },
+
+    { OPCODE_SEGMENT, 0b11100111, I_NOOP },
+    { OPCODE_REP,     0b11111110, I_NOOP },
+};
+
+char const *e8086_register_names[] =
+{
+    "al", "cl", "dl", "bl", "ah", "ch", "dh", "bh",
+    "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+    "es", "cs", "ss", "ds",
+};
+
+char const *e8086_instruction_names[] =
+{
+    "NOOP",
+    "MOV", "ADD", "SUB",
+    "CMP",
+    "JE", "JL", "JLE", "JB",
+    "JBE",
+    "JP",
+    "JO",
+    "JS",
+    "JNE",
+    "JNL",
+    "JNLE",
+    "JNB",
+    "JNBE",
+    "JNP",
+    "JNO",
+    "JNS",
+    "LOOP",
+    "LOOPZ",
+    "LOOPNZ",
+    "JCXZ",
+    "PUSH", "POP",
+    "CALL", "RET",
+    "CLD", "STD",
+    "MOVS", "CMPS", "SCAS", "LODS", "STOS",
+};
+
+#define PACKED_OPERAND_TAG(OPERAND) ((OPERAND) >> 6)
+#define PACKED_OPERAND_INDEX(OPERAND) ((OPERAND) & 0b11111)
+#define PACKED_WIDE 0b100000
+#define PACKED_TAG(TAG) ((TAG) & 0b11111)
+#define PACKED_SEGMENT_PREFIX 0b10000000
+#define PACKED_SEGMENT_SHIFT 5
+
+typedef struct
+{
+    packed_instruction instr;
+    uint8 length; // 0 if the entry is not filled
+} icache_entry;
+
+_Static_assert(sizeof(packed_instruction) == 8, "see the comment on packed_instruction");
+_Static_assert(sizeof(icache_entry) == 10, "see the comment on packed_instruction");
+
+typedef struct
+{
+    icache_entry *entries; // one entry per IP
+    uint32 size;
+    uint32 filled_end;     // entries from here on were never filled
+
+    uint64 hits;
+    uint64 misses;
+    uint64 invalidations;
+} instruction_cache;
+
+static uint8 const zero_page[MEMORY_PAGE_SIZE];
+
+// Segment prefixes add their cycles to the effective address
+#define SEGMENT_PREFIX_CYCLES 2
+
+typedef struct threaded_engine threaded_engine;
+
+struct sim8086
+{
+    // MEMORY_SIZE bytes, see create_guest_memory. The host only backs the
+    // pages a program uses, and used_pages tells which those are.
+    uint8 *memory;
+    uint8 *code; // memory + CS * 16, what IP indexes
+
+    registers rs;
+
+    uint64 cycles;
+
+    instruction_cache *icache; // 0 if disabled
+    branch_counter *branches;  // by address of the branch, 0 if not counted
+    cycle_counter *profile;    // by IP, 0 if not profiled
+    instruction_stats *stats;  // 0 if not counted
+    call_graph *calls;         // 0 if not tracked
+
+    // Physical bytes covered by translated code (see threaded.c), 0 if nothing
+    // is translated. A write to any of them sets code_modified.
+    uint8 *code_map;
+    bool code_modified;
+    threaded_engine *threaded; // owns code_map, 0 unless the threaded engine runs this simulator
+
+    memory_write_log *write_log; // writes of the current step, 0 unless a binary trace is recorded
+
+    // Pages written since snapshot_base was taken or restored. Translated
+    // code marks them itself, see emit_code_write_check.
+    uint8 dirty_pages[MEMORY_PAGE_COUNT];
+    uint64 snapshot_base; // id of that snapshot, 0 if none
+
+    // Pages that were written before that. A page that is neither used nor
+    // dirty is all zero, so reset, snapshots and checkpoints skip it.
+    uint8 used_pages[MEMORY_PAGE_COUNT];
+
+    uint32 image_size; // bytes loaded by e8086_load, the program ends when IP gets past them
+
+    // Set by the decoder or execute_instruction instead of exiting, see set_error
+    e8086_status error;
+    char error_message[64];
+};
+
+// BP based addresses go through SS, all others through DS
+effective_address e8086_ea_table[3][8] =
+{
+    // mod == 00 (MOD_00)
+    {
+        { .reg1 = R_BX, .reg2 = R_SI, .reg_count = 2, .cycles = 7, .segment = SEG_DS },  // bx + si
+        { .reg1 = R_BX, .reg2 = R_DI, .reg_count = 2, .cycles = 8, .segment = SEG_DS },  // bx + di
+        { .reg1 = R_BP, .reg2 = R_SI, .reg_count = 2, .cycles = 8, .segment = SEG_SS },  // bp + si
+        { .reg1 = R_BP, .reg2 = R_DI, .reg_count = 2, .cycles = 7, .segment = SEG_SS },  // bp + di
+        { .reg1 = R_SI,               .reg_count = 1, .cycles = 5, .segment = SEG_DS },  // si
+        { .reg1 = R_DI,               .reg_count = 1, .cycles = 5, .segment = SEG_DS },  // di
+        {                             .reg_count = 0, .cycles = 6, .segment = SEG_DS },  // direct address
+        { .reg1 = R_BX,               .reg_count = 1, .cycles = 5, .segment = SEG_DS },  // bx
+    },
+    // mod == 01 (MOD_01)
+    {
+        { .reg1 = R_BX, .reg2 = R_SI, .reg_count = 2, .cycles = 11, .segment = SEG_DS }, // bx + si + 8bit displacement
+        { .reg1 = R_BX, .reg2 = R_DI, .reg_count = 2, .cycles = 12, .segment = SEG_DS }, // bx + di + 8bit displacement
+        { .reg1 = R_BP, .reg2 = R_SI, .reg_count = 2, .cycles = 12, .segment = SEG_SS }, // bp + si + 8bit displacement
+        { .reg1 = R_BP, .reg2 = R_DI, .reg_count = 2, .cycles = 11, .segment = SEG_SS }, // bp + di + 8bit displacement
+        { .reg1 = R_SI,               .reg_count = 1, .cycles = 9, .segment = SEG_DS },  // si + 8bit displacement
+        { .reg1 = R_DI,               .reg_count = 1, .cycles = 9, .segment = SEG_DS },  // di + 8bit displacement
+        { .reg1 = R_BP,               .reg_count = 1, .cycles = 9, .segment = SEG_SS },  // bp + 8bit displacement
+        { .reg1 = R_BX,               .reg_count = 1, .cycles = 9, .segment = SEG_DS },  // bx + 8bit displacement
+    },
+    // mod == 10 (MOD_10)
+    {
+        { .reg1 = R_BX, .reg2 = R_SI, .reg_count = 2, .cycles = 11, .segment = SEG_DS }, // bx + si + 16 bit displacement
+        { .reg1 = R_BX, .reg2 = R_DI, .reg_count = 2, .cycles = 12, .segment = SEG_DS }, // bx + di + 16 bit displacement
+        { .reg1 = R_BP, .reg2 = R_SI, .reg_count = 2, .cycles = 12, .segment = SEG_SS }, // bp + si + 16 bit displacement
+        { .reg1 = R_BP, .reg2 = R_DI, .reg_count = 2, .cycles = 11, .segment = SEG_SS }, // bp + di + 16 bit displacement
+        { .reg1 = R_SI,               .reg_count = 1, .cycles = 9, .segment = SEG_DS },  // si + 16 bit displacement
+        { .reg1 = R_DI,               .reg_count = 1, .cycles = 9, .segment = SEG_DS },  // di + 16 bit displacement
+        { .reg1 = R_BP,               .reg_count = 1, .cycles = 9, .segment = SEG_SS },  // bp + 16 bit displacement
+        { .reg1 = R_BX,               .reg_count = 1, .cycles = 9, .segment = SEG_DS },  // bx + 16 bit displacement
+    },
+};
+
+
+// Index of the e8086_ea_table entry an effective address was made from. Entries
+// with and without an 8-bit displacement only differ in the displacement,
+// so either one gives back the same address.
+static int32 ea_table_index(effective_address ea)
+{
+    effective_address *entries = &e8086_ea_table[0][0];
+    for (int32 index = 0; index < 3 * 8; index++)
+    {
+        effective_address *entry = entries + index;
+        if (entry->reg_count == ea.reg_count && entry->cycles == ea.cycles &&
+            (ea.reg_count < 1 || entry->reg1 == ea.reg1) &&
+            (ea.reg_count < 2 || entry->reg2 == ea.reg2))
+        {
+            return index;
+        }
+    }
+    return -1;
+}
+
+static bool pack_operand(instruction_operand iop, packed_instruction *packed, uint8 *result)
+{
+    switch (iop.tag)
+    {
+    case IOPERAND_NONE: *result = 0; return true;
+    case IOP_IMM:
+        packed->imm = (int16) iop.imm;
+        *result = IOP_IMM << 6;
+        return packed->imm == iop.imm;
+    case IOP_REG:
+        *result = (IOP_REG << 6) | iop.reg;
+        return true;
+    case IOP_MEM:
+    {
+        effective_address ea = iop.addr;
+        if (ea.segment_prefix)
+        {
+            ea.cycles -= SEGMENT_PREFIX_CYCLES;
+            packed->tag |= PACKED_SEGMENT_PREFIX | (ea.segment << PACKED_SEGMENT_SHIFT);
+        }
+        int32 index = ea_table_index(ea);
+        packed->displacement = (int16) iop.addr.displacement;
+        *result = (IOP_MEM << 6) | index;
+        return index >= 0 && (uint32) (int32) packed->displacement == iop.addr.displacement;
+    }
+    }
+    return false;
+}
+
+static bool is_string_instruction(instruction_tag tag);
+
+// False if the instruction does not fit, it is not cached then. String
+// instructions have two memory operands and maybe a repeat prefix, and
+// their tags do not fit into PACKED_TAG either.
+static bool pack_instruction(instruction i, packed_instruction *result)
+{
+    if (is_string_instruction(i.tag) || PACKED_TAG(i.tag) != i.tag) return false;
+    *result = (packed_instruction) { .tag = (uint8) i.tag, .cycles = (uint8) i.cycles };
+    if (!pack_operand(i.destination, result, &result->destination)) return false;
+    if (!pack_operand(i.source, result, &result->source)) return false;
+    if (i.w) result->destination |= PACKED_WIDE;
+    return result->cycles == i.cycles;
+}
+
+// Unpacked form of every operand byte, without immediate and displacement
+static instruction_operand packed_operands[256];
+
+static void init_packed_operands(void)
+{
+    for (uint32 operand = 0; operand < 256; operand++)
+    {
+        instruction_operand *result = packed_operands + operand;
+        uint32 index = PACKED_OPERAND_INDEX(operand);
+        switch (PACKED_OPERAND_TAG(operand))
+        {
+        case IOPERAND_NONE: *result = (instruction_operand) {}; break;
+        case IOP_IMM: *result = (instruction_operand) { .tag = IOP_IMM }; break;
+        case IOP_REG: *result = REGISTER_OPERAND((index < ARRAY_COUNT(register_offsets)) ? index : 0); break;
+        case IOP_MEM:
+            *result = (instruction_operand) { .tag = IOP_MEM, .addr = (&e8086_ea_table[0][0])[(index < 3 * 8) ? index : 0] };
+            break;
+        }
+    }
+}
+
+#define UNPACK_OPERAND(OPERAND, RESULT) do { \
+    RESULT = packed_operands[OPERAND]; \
+    if (PACKED_OPERAND_TAG(OPERAND) == IOP_IMM) RESULT.imm = packed->imm; \
+    else if (PACKED_OPERAND_TAG(OPERAND) == IOP_MEM) RESULT.addr.displacement = (int32) packed->displacement; \
+    } while (false)
+
+// Copies whole prepared operands and only patches what the packed form holds
+static void unpack_instruction(packed_instruction *packed, instruction *result)
+{
+    result->tag = PACKED_TAG(packed->tag);
+    UNPACK_OPERAND(packed->source, result->source);
+    UNPACK_OPERAND(packed->destination, result->destination);
+    result->w = (packed->destination & PACKED_WIDE) != 0;
+    result->cycles = packed->cycles;
+    if (packed->tag & PACKED_SEGMENT_PREFIX)
+    {
+        effective_address *ea = (result->destination.tag == IOP_MEM) ? &result->destination.addr : &result->source.addr;
+        ea->segment = (packed->tag >> PACKED_SEGMENT_SHIFT) & 0b11;
+        ea->segment_prefix = true;
+        ea->cycles += SEGMENT_PREFIX_CYCLES;
+    }
+}
+
+// Nothing in the library prints or exits. A failing step leaves its reason
+// here and the caller decides what to do with it.
+static void set_error(sim8086 *sim, e8086_status error, char const *message)
+{
+    sim->error = error;
+    snprintf(sim->error_message, sizeof(sim->error_message), "%s", message);
+}
+
+// Decoders return an empty instruction on failure, execute_instruction
+// leaves it alone since its operands are missing.
+static instruction decode_error(sim8086 *sim, e8086_status error, char const *message)
+{
+    set_error(sim, error, message);
+    return (instruction) {};
+}
+
+// Little-endian word at CS:IP, IP wraps around between its bytes
+static int16 read_code_word(sim8086 *sim)
+{
+    uint8 low = sim->code[sim->rs.ip++];
+    uint8 high = sim->code[sim->rs.ip++];
+    return (int16) (low | (high << 8));
+}
+
+static effective_address read_ea(sim8086 *sim, int32 mod, int32 r_m)
+{
+    effective_address ea = e8086_ea_table[mod][r_m];
+
+    if (mod == MOD_00)
+    {
+        // Direct address reading
+        if (r_m == 0b110) ea.displacement = read_code_word(sim);
+    }
+    else if (mod == MOD_01)
+    {
+        ea.displacement = *(int8 *) (sim->code + sim->rs.ip);
+        sim->rs.ip += 1;
+    }
+    else if (mod == MOD_10)
+    {
+        ea.displacement = read_code_word(sim);
+    }
+
+    return ea;
+}
+
+static int32 read_data_bytes(sim8086 *sim, int32 w, int32 s)
+{
+    if (!s && w) return read_code_word(sim);
+    return (int8) sim->code[sim->rs.ip++];
+}
+
+
+static instruction instruction_type1(sim8086 *sim, opcode_info *info)
+{
+    uint8 byte1 = sim->code[sim->rs.ip++];
+    uint8 byte2 = sim->code[sim->rs.ip++];
+
+    int32 d = 0b00000010 & byte1;
+    int32 w = 0b00000001 & byte1;
+
+    int32 mod = (0b11000000 & byte2) >> 6;
+    int32 reg = (0b00111000 & byte2) >> 3;
+    int32 r_m = (0b00000111 & byte2);
+
+    instruction result =
+    {
+        .tag = info->instruction,
+        .source = REGISTER_OPERAND(reg | (w << 3)),
+        .w = w,
+    };
+
+    if (mod == MOD_RM)
+    {
+        // INSTR rx, rx
+        result.destination = REGISTER_OPERAND(r_m | (w << 3));
+        switch (info->instruction)
+        {
+        case I_MOV: result.cycles = 2; break;
+        case I_ADD: result.cycles = 3; break;
+        case I_SUB: result.cycles = 3; break;
+        case I_CMP: result.cycles = 3; break;
+        default: break;
+        }
+    }
+    else
+    {
+        // if (d) INSTR [ea], rx
+        //        INSTR rx, [ea]
+        result.destination = (instruction_operand)
+        {
+            .tag = IOP_MEM,
+            .addr = read_ea(sim, mod, r_m),
+        };
+        switch (info->instruction)
+        {
+        case I_MOV: result.cycles = d ? 8 : 9; break;
+        case I_ADD: result.cycles = d ? 9 : 16; break;
+        case I_SUB: result.cycles = d ? 9 : 16; break;
+        case I_CMP: result.cycles = 9; break;
+        default: break;
+        }
+    }
+
+    if (d)
+    {
+        instruction_operand tmp = result.destination;
+        result.destination = result.source;
+        result.source = tmp;
+    }
+
+    return result;
+}
+
+static instruction instruction_mov_imm_to_reg_mem(sim8086 *sim, opcode_info *info)
+{
+    uint8 byte1 = sim->code[sim->rs.ip++];
+    uint8 byte2 = sim->code[sim->rs.ip++];
+
+    int32 w = (0b00000001 & byte1);
+    int32 mod = (0b11000000 & byte2) >> 6;
+    int32 opc = (0b00111000 & byte2) >> 3;
+    int32 r_m = (0b00000111 & byte2);
+
+    if (opc != 0) return decode_error(sim, E8086_ERROR_UNKNOWN_SUB_OPCODE, "unknown sub_opcode");
+
+    instruction result = { .tag = I_MOV, .w = w };
+
+    if (mod == MOD_RM)
+    {
+        result.destination = REGISTER_OPERAND(r_m | (w << 3));
+        result.cycles = 4;
+    }
+    else
+    {
+        result.destination = (instruction_operand)
+        {
+            .tag = IOP_MEM,
+            .addr = read_ea(sim, mod, r_m),
+        };
+        result.cycles = 10;
+    }
+
+    result.source = (instruction_operand)
+    {
+        .tag = IOP_IMM,
+        .imm = read_data_bytes(sim, w, 0),
+    };
+
+    return result;
+}
+
+static instruction instruction_imm_to_reg(sim8086 *sim, opcode_info *info)
+{
+    uint8 byte1 = sim->code[sim->rs.ip++];
+
+    int32 w = (0b00001000 & byte1) >> 3;
+    int32 reg = 0b00000111 & byte1;
+
+    int32 data = read_data_bytes(sim, w, 0);
+
+    instruction result =
+    {
+        .tag = info->instruction,
+        .source =
+        {
+            .tag = IOP_IMM,
+            .imm = data,
+        },
+        .destination = REGISTER_OPERAND(reg | (w << 3)),
+        .w = w,
+    };
+    switch (info->instruction)
+    {
+    case I_MOV:
+    case I_ADD:
+    case I_SUB:
+    case I_CMP:
+        result.cycles = 4; break;
+    default: break;
+    }
+
+    return result;
+}
+
+
+// void mov_memory_and_accumulator(sim8086 *sim, opcode_info *info, bool reverse_order)
+// {
+//     uint8 byte1 = sim->code[sim->rs.ip++];
+
+//     int32 w = 0b00000001 & byte1;
+
+//     int32 addr = read_data_bytes(sim, w, 0);
+//     (void) addr;
+
+    // @todo:
+    // if (reverse_order)
+    //     printf("    %s [%d], ax\n", e8086_instruction_names[info->instruction], addr);
+    // else
+    //     printf("    %s ax, [%d]\n", e8086_instruction_names[info->instruction], addr);
+// }
+
+
+// Second-level table for OPCODE_IMM_TO_REG_MEM, indexed by the reg field of ModRM.
+static instruction_tag imm_to_reg_mem_group[8] =
+{
+    [0b000] = I_ADD,
+    [0b101] = I_SUB,
+    [0b111] = I_CMP,
+};
+
+static instruction instruction_imm_to_reg_mem(sim8086 *sim, opcode_info *info)
+{
+    uint8 byte1 = sim->code[sim->rs.ip++];
+    uint8 byte2 = sim->code[sim->rs.ip++];
+
+    int32 s = 0b00000010 & byte1;
+    int32 w = 0b00000001 & byte1;
+
+    int32 mod = (0b11000000 & byte2) >> 6;
+    int32 opc = (0b00111000 & byte2) >> 3;
+    int32 r_m = (0b00000111 & byte2);
+
+    instruction result = { .tag = imm_to_reg_mem_group[opc], .w = w };
+    if (result.tag == I_NOOP) return decode_error(sim, E8086_ERROR_UNKNOWN_SUB_OPCODE, "unknown sub_opcode");
+
+    if (mod == MOD_RM)
+    {
+        result.destination = REGISTER_OPERAND(r_m | (w << 3));
+        switch (result.tag)
+        {
+        case I_MOV:
+        case I_ADD:
+        case I_SUB:
+        case I_CMP:
+            result.cycles = 4; break;
+        default: break;
+        }
+    }
+    else
+    {
+        result.destination = (instruction_operand)
+        {
+            .tag = IOP_MEM,
+            .addr = read_ea(sim, mod, r_m),
+        };
+        switch (result.tag)
+        {
+        case I_MOV: result.cycles = 10; break;
+        case I_ADD: result.cycles = 17; break;
+        case I_SUB: result.cycles = 17; break;
+        case I_CMP: result.cycles = 10; break;
+        default: break;
+        }
+    }
+
+    result.source = (instruction_operand)
+    {
+        .tag = IOP_IMM,
+        .imm = read_data_bytes(sim, w, s),
+    };
+
+    return result;
+}
+
+
+static instruction instruction_imm_to_acc(sim8086 *sim, opcode_info *info)
+{
+    uint8 byte1 = sim->code[sim->rs.ip++];
+
+    int32 w = 0b00000001 & byte1;
+    int32 data = read_data_bytes(sim, w, 0);
+
+    instruction result =
+    {
+        .tag = info->instruction,
+        .source =
+        {
+            .tag = IOP_IMM,
+            .imm = data,
+        },
+        .destination = REGISTER_OPERAND(w << 3),
+        .w = w,
+    };
+    switch (info->instruction)
+    {
+    case I_MOV:
+    case I_ADD:
+    case I_SUB:
+    case I_CMP:
+        result.cycles = 4; break;
+    default: break;
+    }
+    return result;
+}
+
+// MOV6 and MOV7: mov sreg, r/m16 and mov r/m16, sreg. Loading CS moves
+// the code under IP, that is not supported.
+static instruction instruction_segment_mov(sim8086 *sim, opcode_info *info)
+{
+    uint8 byte1 = sim->code[sim->rs.ip++];
+    uint8 byte2 = sim->code[sim->rs.ip++];
+
+    int32 d = 0b00000010 & byte1;
+
+    int32 mod = (0b11000000 & byte2) >> 6;
+    int32 sr  = (0b00111000 & byte2) >> 3;
+    int32 r_m = (0b00000111 & byte2);
+
+    if (sr > SEG_DS) return decode_error(sim, E8086_ERROR_UNKNOWN_SUB_OPCODE, "unknown segment register");
+    if (d && sr == SEG_CS) return decode_error(sim, E8086_ERROR_UNSUPPORTED_INSTRUCTION, "mov cs is not supported");
+
+    instruction result =
+    {
+        .tag = I_MOV,
+        .source = REGISTER_OPERAND(R_ES + sr),
+        .w = 1,
+    };
+
+    if (mod == MOD_RM)
+    {
+        result.destination = REGISTER_OPERAND(r_m | 0b1000);
+        result.cycles = 2;
+    }
+    else
+    {
+        result.destination = (instruction_operand)
+        {
+            .tag = IOP_MEM,
+            .addr = read_ea(sim, mod, r_m),
+        };
+        result.cycles = d ? 8 : 9;
+    }
+
+    if (d)
+    {
+        instruction_operand tmp = result.destination;
+        result.destination = result.source;
+        result.source = tmp;
+    }
+
+    return result;
+}
+
+static instruction decode_next_instruction(sim8086 *sim);
+
+// The memory operand a segment prefix applies to, 0 if there is none. Of a
+// string instruction only the DS:SI operand can be moved, ES:DI stays.
+static effective_address *overridable_ea(instruction *i)
+{
+    bool string = is_string_instruction(i->tag);
+    if (i->destination.tag == IOP_MEM && (!string || i->destination.addr.reg1 == R_SI)) return &i->destination.addr;
+    if (i->source.tag == IOP_MEM && (!string || i->source.addr.reg1 == R_SI)) return &i->source.addr;
+    return 0;
+}
+
+// Gives the decode error of a prefixed instruction that got longer than
+// MAX_INSTRUCTION_LENGTH, `start` is where its first prefix is
+static bool check_prefixed_length(sim8086 *sim, uint16 start)
+{
+    if (sim->error || (uint16) (sim->rs.ip - start) <= MAX_INSTRUCTION_LENGTH) return true;
+    decode_error(sim, E8086_ERROR_UNSUPPORTED_INSTRUCTION, "too many prefixes");
+    return false;
+}
+
+// The prefix only changes the segment of the memory operand of the
+// instruction after it. With more than one prefix the last one counts, and
+// an instruction without a memory operand ignores it. String instructions
+// have no effective address cycles, the prefix adds to theirs.
+static instruction instruction_segment_prefix(sim8086 *sim, opcode_info *info)
+{
+    uint16 start = sim->rs.ip;
+    uint8 byte1 = sim->code[sim->rs.ip++];
+    uint32 segment = (0b00011000 & byte1) >> 3;
+
+    instruction result = decode_next_instruction(sim);
+    if (!check_prefixed_length(sim, start)) return (instruction) {};
+    effective_address *ea = overridable_ea(&result);
+    if (ea && !ea->segment_prefix)
+    {
+        ea->segment = segment;
+        ea->segment_prefix = true;
+        if (is_string_instruction(result.tag)) result.cycles += SEGMENT_PREFIX_CYCLES;
+        else ea->cycles += SEGMENT_PREFIX_CYCLES;
+    }
+    return result;
+}
+
+static bool is_jump(instruction_tag tag)
+{
+    return (I_JE <= tag) && (tag <= I_JCXZ);
+}
+
+static bool is_string_instruction(instruction_tag tag)
+{
+    return (I_MOVS <= tag) && (tag <= I_STOS);
+}
+
+// What goes in front of the name of a repeated instruction: "REP " for
+// MOVS, LODS and STOS, "REPE " or "REPNE " for compares, "" without REP
+static char const *rep_prefix_name(instruction *i)
+{
+    if (i->rep == REP_NE) return "REPNE ";
+    if (i->rep == REP_E) return (i->tag == I_CMPS || i->tag == I_SCAS) ? "REPE " : "REP ";
+    return "";
+}
+
+// Branches and repeated string instructions take cycles that depend on
+// what they find, the decoded instruction only has them once it ran
+static bool has_variable_cycles(instruction *i)
+{
+    return is_jump(i->tag) || i->rep != REP_NONE;
+}
+
+// CALL and RET end basic blocks as jumps do, but go to an address that is
+// not in the instruction (RET, indirect CALL)
+static bool is_call_or_return(instruction_tag tag)
+{
+    return tag == I_CALL || tag == I_RET;
+}
+
+static bool jump_condition(registers *rs, instruction_tag tag)
+{
+    switch (tag)
+    {
+    case I_JE:   return flag_zf(rs);
+    case I_JL:   return flag_sf(rs) != flag_of(rs);
+    case I_JLE:  return (flag_sf(rs) != flag_of(rs)) || flag_zf(rs);
+    case I_JB:   return flag_cf(rs);
+    case I_JBE:  return flag_cf(rs) || flag_zf(rs);
+    case I_JP:   return flag_pf(rs);
+    case I_JO:   return flag_of(rs);
+    case I_JS:   return flag_sf(rs);
+    case I_JNE:  return !flag_zf(rs);
+    case I_JNL:  return flag_sf(rs) == flag_of(rs);
+    case I_JNLE: return (flag_sf(rs) == flag_of(rs)) && !flag_zf(rs);
+    case I_JNB:  return !flag_cf(rs);
+    case I_JNBE: return !flag_cf(rs) && !flag_zf(rs);
+    case I_JNP:  return !flag_pf(rs);
+    case I_JNO:  return !flag_of(rs);
+    case I_JNS:  return !flag_sf(rs);
+    default: return false;
+    }
+}
+
+// LOOP, LOOPZ and LOOPNZ decrement CX before they decide
+static bool evaluate_branch(registers *rs, instruction_tag tag)
+{
+    switch (tag)
+    {
+    case I_LOOP:   rs->cx -= 1; return rs->cx != 0;
+    case I_LOOPZ:  rs->cx -= 1; return rs->cx != 0 && flag_zf(rs);
+    case I_LOOPNZ: rs->cx -= 1; return rs->cx != 0 && !flag_zf(rs);
+    case I_JCXZ:   return rs->cx == 0;
+    default:       return jump_condition(rs, tag);
+    }
+}
+
+static int32 branch_cycles(instruction_tag tag, bool taken)
+{
+    switch (tag)
+    {
+    case I_LOOP:   return taken ? 17 : 5;
+    case I_LOOPZ:  return taken ? 18 : 6;
+    case I_LOOPNZ: return taken ? 19 : 5;
+    case I_JCXZ:   return taken ? 18 : 6;
+    default:       return taken ? 16 : 4;
+    }
+}
+
+static void count_branch(sim8086 *sim, uint16 address, bool taken)
+{
+    if (!sim->branches) return;
+    if (taken) sim->branches[address].taken += 1;
+    else       sim->branches[address].not_taken += 1;
+}
+
+static instruction instruction_jumps(sim8086 *sim, opcode_info *info)
+{
+    sim->rs.ip++; // first byte is fully opcode
+    int8 ip_inc8 = sim->code[sim->rs.ip++];
+
+    instruction result =
+    {
+        .tag = info->instruction,
+        .destination =
+        {
+            .tag = IOP_IMM,
+            .imm = ip_inc8,
+        },
+        // Timing depends on the outcome, execute_instruction accounts for it
+    };
+    return result;
+}
+
+// Stack instructions always move words. The operand of PUSH and POP, and
+// the target or SP increment of CALL and RET, is the destination.
+
+// PUSH_REG and POP_REG: push r16 and pop r16
+static instruction instruction_push_pop_reg(sim8086 *sim, opcode_info *info)
+{
+    uint8 byte1 = sim->code[sim->rs.ip++];
+
+    instruction result =
+    {
+        .tag = info->instruction,
+        .destination = REGISTER_OPERAND((0b00000111 & byte1) | 0b1000),
+        .w = 1,
+        .cycles = (info->instruction == I_PUSH) ? 11 : 8,
+    };
+    return result;
+}
+
+// PUSH_SEG and POP_SEG: push sreg and pop sreg. Popping CS moves the code
+// under IP, that is not supported.
+static instruction instruction_push_pop_segment(sim8086 *sim, opcode_info *info)
+{
+    uint8 byte1 = sim->code[sim->rs.ip++];
+    int32 sr = (0b00011000 & byte1) >> 3;
+
+    if (info->instruction == I_POP && sr == SEG_CS)
+    {
+        return decode_error(sim, E8086_ERROR_UNSUPPORTED_INSTRUCTION, "pop cs is not supported");
+    }
+
+    instruction result =
+    {
+        .tag = info->instruction,
+        .destination = REGISTER_OPERAND(R_ES + sr),
+        .w = 1,
+        .cycles = (info->instruction == I_PUSH) ? 10 : 8,
+    };
+    return result;
+}
+
+static instruction instruction_pop_reg_mem(sim8086 *sim, opcode_info *info)
+{
+    sim->rs.ip++; // first byte is fully opcode
+    uint8 byte2 = sim->code[sim->rs.ip++];
+
+    int32 mod = (0b11000000 & byte2) >> 6;
+    int32 opc = (0b00111000 & byte2) >> 3;
+    int32 r_m = (0b00000111 & byte2);
+
+    if (opc != 0) return decode_error(sim, E8086_ERROR_UNKNOWN_SUB_OPCODE, "unknown sub_opcode");
+
+    instruction result = { .tag = I_POP, .w = 1 };
+    if (mod == MOD_RM)
+    {
+        result.destination = REGISTER_OPERAND(r_m | 0b1000);
+        result.cycles = 8;
+    }
+    else
+    {
+        result.destination = (instruction_operand)
+        {
+            .tag = IOP_MEM,
+            .addr = read_ea(sim, mod, r_m),
+        };
+        result.cycles = 17;
+    }
+    return result;
+}
+
+// Second-level table for OPCODE_GROUP_FF, indexed by the reg field of ModRM.
+static instruction_tag group_ff[8] =
+{
+    [0b010] = I_CALL,
+    [0b110] = I_PUSH,
+};
+
+// call r/m16 goes to the address in the operand, push r/m16 pushes it
+static instruction instruction_group_ff(sim8086 *sim, opcode_info *info)
+{
+    sim->rs.ip++; // first byte is fully opcode
+    uint8 byte2 = sim->code[sim->rs.ip++];
+
+    int32 mod = (0b11000000 & byte2) >> 6;
+    int32 opc = (0b00111000 & byte2) >> 3;
+    int32 r_m = (0b00000111 & byte2);
+
+    instruction result = { .tag = group_ff[opc], .w = 1 };
+    if (result.tag == I_NOOP) return decode_error(sim, E8086_ERROR_UNKNOWN_SUB_OPCODE, "unknown sub_opcode");
+
+    if (mod == MOD_RM)
+    {
+        result.destination = REGISTER_OPERAND(r_m | 0b1000);
+        result.cycles = (result.tag == I_CALL) ? 16 : 11;
+    }
+    else
+    {
+        result.destination = (instruction_operand)
+        {
+            .tag = IOP_MEM,
+            .addr = read_ea(sim, mod, r_m),
+        };
+        result.cycles = (result.tag == I_CALL) ? 21 : 16;
+    }
+    return result;
+}
+
+// call rel16, the destination is relative to the next instruction as with jumps
+static instruction instruction_call(sim8086 *sim, opcode_info *info)
+{
+    sim->rs.ip++; // first byte is fully opcode
+
+    instruction result =
+    {
+        .tag = I_CALL,
+        .destination =
+        {
+            .tag = IOP_IMM,
+            .imm = read_data_bytes(sim, 1, 0),
+        },
+        .w = 1,
+        .cycles = 19,
+    };
+    return result;
+}
+
+// ret, and ret imm16 that releases imm16 bytes of arguments after popping IP
+static instruction instruction_ret(sim8086 *sim, opcode_info *info)
+{
+    uint8 byte1 = sim->code[sim->rs.ip++];
+
+    instruction result = { .tag = I_RET, .w = 1, .cycles = 8 };
+    if (!(byte1 & 1))
+    {
+        result.destination = (instruction_operand)
+        {
+            .tag = IOP_IMM,
+            .imm = (uint16) read_data_bytes(sim, 1, 0),
+        };
+        result.cycles = 12;
+    }
+    return result;
+}
+
+// 8086 timing of the string instructions, by tag from I_MOVS: once, and per
+// repetition after the REP_START_CYCLES of a repeated one
+static struct
+{
+    int32 once;
+    int32 repeated;
+} string_cycles[] =
+{
+    { 18, 17 }, // movs
+    { 22, 22 }, // cmps
+    { 15, 15 }, // scas
+    { 12, 13 }, // lods
+    { 11, 10 }, // stos
+};
+
+#define REP_START_CYCLES 9
+
+// movs, cmps, scas, lods and stos. Their operands are fixed: DS:SI, ES:DI
+// and AL or AX, ordered as cmp would have them. They have no effective
+// address cycles, everything is in their own.
+static instruction instruction_string(sim8086 *sim, opcode_info *info)
+{
+    uint8 byte1 = sim->code[sim->rs.ip++];
+    int32 w = 0b00000001 & byte1;
+
+    instruction_operand source_index =
+    {
+        .tag = IOP_MEM,
+        .addr = { .reg1 = R_SI, .reg_count = 1, .segment = SEG_DS },
+    };
+    instruction_operand destination_index =
+    {
+        .tag = IOP_MEM,
+        .addr = { .reg1 = R_DI, .reg_count = 1, .segment = SEG_ES },
+    };
+    instruction_operand accumulator = REGISTER_OPERAND(w << 3);
+
+    instruction result =
+    {
+        .tag = info->instruction,
+        .w = w,
+        .cycles = string_cycles[info->instruction - I_MOVS].once,
+    };
+    switch (info->instruction)
+    {
+    case I_MOVS: result.destination = destination_index; result.source = source_index; break;
+    case I_CMPS: result.destination = source_index; result.source = destination_index; break;
+    case I_SCAS: result.destination = accumulator; result.source = destination_index; break;
+    case I_LODS: result.destination = accumulator; result.source = source_index; break;
+    case I_STOS: result.destination = destination_index; result.source = accumulator; break;
+    default: break;
+    }
+    return result;
+}
+
+// cld and std, which way string instructions step through memory
+static instruction instruction_direction(sim8086 *sim, opcode_info *info)
+{
+    sim->rs.ip++; // first byte is fully opcode
+    return (instruction) { .tag = info->instruction, .cycles = 2 };
+}
+
+// REP (REPE) and REPNE repeat the string instruction after them, anything
+// else ignores the prefix. As with segment prefixes the last one counts.
+static instruction instruction_rep_prefix(sim8086 *sim, opcode_info *info)
+{
+    uint16 start = sim->rs.ip;
+    uint8 byte1 = sim->code[sim->rs.ip++];
+
+    instruction result = decode_next_instruction(sim);
+    if (!check_prefixed_length(sim, start)) return (instruction) {};
+    if (is_string_instruction(result.tag) && result.rep == REP_NONE)
+    {
+        result.rep = (byte1 & 1) ? REP_E : REP_NE;
+        result.cycles += REP_START_CYCLES - string_cycles[result.tag - I_MOVS].once;
+    }
+    return result;
+}
+
+static instruction instruction_unsupported(sim8086 *sim, opcode_info *info)
+{
+    return decode_error(sim, E8086_ERROR_UNSUPPORTED_INSTRUCTION, "Don't know what to do!");
+}
+
+typedef instruction (*decode_proc)(sim8086 *sim, opcode_info *info);
+
+typedef struct
+{
+    decode_proc decode;
+    opcode_info info;
+} opcode_dispatch;
+
+// Indexed by the first byte of an instruction, filled once from opcode_table
+// by init_opcode_dispatch_table. Entries with decode == 0 are unknown bytes.
+static opcode_dispatch opcode_dispatch_table[256];
+
+static decode_proc choose_decode_proc(enum opcode opcode)
+{
+    switch (opcode)
+    {
+    case OPCODE_MOV1: return instruction_type1;
+    case OPCODE_MOV2: return instruction_mov_imm_to_reg_mem;
+    case OPCODE_MOV3: return instruction_imm_to_reg;
+    case OPCODE_MOV6: return instruction_segment_mov;
+    case OPCODE_MOV7: return instruction_segment_mov;
+    // case OPCODE_MOV4: mov_memory_and_accumulator(sim, &info, false); break;
+    // case OPCODE_MOV5: mov_memory_and_accumulator(sim, &info, true); break;
+
+    case OPCODE_ADD1: return instruction_type1;
+    case OPCODE_ADD3: return instruction_imm_to_acc;
+
+    case OPCODE_SUB1: return instruction_type1;
+    case OPCODE_SUB3: return instruction_imm_to_acc;
+
+    case OPCODE_CMP1: return instruction_type1;
+    case OPCODE_CMP3: return instruction_imm_to_acc;
+
+    case OPCODE_JE:
+    case OPCODE_JL:
+    case OPCODE_JLE:
+    case OPCODE_JB:
+    case OPCODE_JBE:
+    case OPCODE_JP:
+    case OPCODE_JO:
+    case OPCODE_JS:
+    case OPCODE_JNE:
+    case OPCODE_JNL:
+    case OPCODE_JNLE:
+    case OPCODE_JNB:
+    case OPCODE_JNBE:
+    case OPCODE_JNP:
+    case OPCODE_JNO:
+    case OPCODE_JNS:
+    case OPCODE_LOOP:
+    case OPCODE_LOOPZ:
+    case OPCODE_LOOPNZ:
+    case OPCODE_JCXZ:
+        return instruction_jumps;
+
+    case OPCODE_IMM_TO_REG_MEM:
+        return instruction_imm_to_reg_mem;
+
+    case OPCODE_SEGMENT:
+        return instruction_segment_prefix;
+
+    case OPCODE_REP:
+        return instruction_rep_prefix;
+
+    case OPCODE_PUSH_REG:
+    case OPCODE_POP_REG:
+        return instruction_push_pop_reg;
+
+    case OPCODE_PUSH_SEG:
+    case OPCODE_POP_SEG:
+        return instruction_push_pop_segment;
+
+    case OPCODE_POP_MEM: return instruction_pop_reg_mem;
+    case OPCODE_CALL: return instruction_call;
+    case OPCODE_RET: return instruction_ret;
+    case OPCODE_GROUP_FF: return instruction_group_ff;
+
+    case OPCODE_MOVS:
+    case OPCODE_CMPS:
+    case OPCODE_SCAS:
+    case OPCODE_LODS:
+    case OPCODE_STOS:
+        return instruction_string;
+
+    case OPCODE_CLD:
+    case OPCODE_STD:
+        return instruction_direction;
+
+    default:
+        return instruction_unsupported;
+    }
+}
+
+static void init_opcode_dispatch_table(void)
+{
+    for (int byte = 0; byte < 256; byte++)
+    {
+        opcode_dispatch entry = {};
+        // First match wins, same as the linear scan over opcode_table.
+        for (int opcode_index = 0; opcode_index < ARRAY_COUNT(opcode_table); opcode_index++)
+        {
+            opcode_info info = opcode_table[opcode_index];
+            if ((byte & info.mask) == info.opcode)
+            {
+                entry.decode = choose_decode_proc(info.opcode);
+                entry.info = info;
+                break;
+            }
+        }
+        opcode_dispatch_table[byte] = entry;
+    }
+}
+
+static instruction report_unknown_opcode(sim8086 *sim, uint8 byte)
+{
+    char message[64] = "Can't find opcode for byte: 0b";
+    char *digits = message + strlen(message);
+    for (int32 bit = 7; bit >= 0; bit--)
+    {
+        *digits++ = '0' + ((byte >> bit) & 1);
+    }
+    *digits = 0;
+    return decode_error(sim, E8086_ERROR_UNKNOWN_OPCODE, message);
+}
+
+static instruction decode_next_instruction(sim8086 *sim)
+{
+    uint8 byte = sim->code[sim->rs.ip];
+
+    opcode_dispatch *entry = opcode_dispatch_table + byte;
+    if (!entry->decode) return report_unknown_opcode(sim, byte);
+
+    return entry->decode(sim, &entry->info);
+}
+
+static instruction_cache *create_instruction_cache(uint32 size)
+{
+    instruction_cache *icache = calloc(1, sizeof(instruction_cache));
+    icache->entries = calloc(size, sizeof(icache_entry));
+    init_packed_operands();
+    icache->size = size;
+    return icache;
+}
+
+// Empties the whole cache without counting invalidations
+static void clear_instruction_cache(instruction_cache *icache)
+{
+    memset(icache->entries, 0, icache->filled_end * sizeof(icache_entry));
+    icache->filled_end = 0;
+}
+
+static void destroy_instruction_cache(instruction_cache *icache)
+{
+    if (!icache) return;
+    free(icache->entries);
+    free(icache);
+}
+
+// Fills in `result` rather than returning it: a returned instruction is
+// copied right after being written field by field, which stalls the copy.
+static void fetch_instruction(sim8086 *sim, instruction *result)
+{
+    instruction_cache *icache = sim->icache;
+    if (!icache)
+    {
+        *result = decode_next_instruction(sim);
+        return;
+    }
+
+    icache_entry *entry = icache->entries + sim->rs.ip;
+    if (entry->length)
+    {
+        icache->hits += 1;
+        sim->rs.ip += entry->length;
+        unpack_instruction(&entry->instr, result);
+        return;
+    }
+
+    icache->misses += 1;
+    uint16 ip = sim->rs.ip;
+    *result = decode_next_instruction(sim);
+    if (!sim->error && pack_instruction(*result, &entry->instr))
+    {
+        entry->length = (uint16) (sim->rs.ip - ip);
+        if (ip >= icache->filled_end) icache->filled_end = ip + 1;
+    }
+}
+
+// Drops every cached instruction that has bytes in [address, address + count) of the code segment.
+static void invalidate_instruction_cache(instruction_cache *icache, uint32 address, uint32 count)
+{
+    uint32 first = (address < MAX_INSTRUCTION_LENGTH) ? 0 : address - (MAX_INSTRUCTION_LENGTH - 1);
+    uint32 last = address + count;
+    if (last > icache->size) last = icache->size;
+
+    for (uint32 start = first; start < last; start++)
+    {
+        icache_entry *entry = icache->entries + start;
+        if (entry->length && (start + entry->length > address))
+        {
+            entry->length = 0;
+            icache->invalidations += 1;
+        }
+    }
+}
+
+// Guest memory is MEMORY_SIZE bytes with the first SEGMENT_SIZE of them
+// mapped once more right after, so code at CS:IP, a word at FFFFF and a
+// string copy that run past 1 MiB wrap around without being checked. Both
+// mappings share the pages of an anonymous file, which come from the host
+// untouched. Gives 0 if the host cannot map it.
+static uint8 *create_guest_memory(void)
+{
+#if defined(__linux__)
+    int fd = memfd_create("e8086", 0);
+#else
+    char name[64];
+    snprintf(name, sizeof(name), "/e8086-%d-%p", (int) getpid(), (void *) name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) shm_unlink(name);
+#endif
+    if (fd < 0) return 0;
+
+    uint8 *memory = 0;
+    if (ftruncate(fd, MEMORY_SIZE) == 0)
+    {
+        void *reserved = mmap(0, MEMORY_SIZE + SEGMENT_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (reserved != MAP_FAILED)
+        {
+            memory = reserved;
+            int protection = PROT_READ | PROT_WRITE;
+            if (mmap(memory, MEMORY_SIZE, protection, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+                mmap(memory + MEMORY_SIZE, SEGMENT_SIZE, protection, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+            {
+                munmap(reserved, MEMORY_SIZE + SEGMENT_SIZE);
+                memory = 0;
+            }
+        }
+    }
+    close(fd);
+    return memory;
+}
+
+static void destroy_guest_memory(uint8 *memory)
+{
+    if (memory) munmap(memory, MEMORY_SIZE + SEGMENT_SIZE);
+}
+
+static void log_memory_write(memory_write_log *log, uint32 address, uint32 count)
+{
+    if (log->count == log->capacity)
+    {
+        log->capacity = log->capacity ? log->capacity * 2 : 16;
+        log->writes = realloc(log->writes, log->capacity * sizeof(memory_write));
+    }
+    log->writes[log->count++] = (memory_write) { .address = address, .count = count };
+}
+
+static void mark_dirty_pages(sim8086 *sim, uint32 address, uint32 count)
+{
+    if (count == 0) return;
+    uint32 first = address >> MEMORY_PAGE_SHIFT;
+    uint32 last = (address + count - 1) >> MEMORY_PAGE_SHIFT;
+    if (last >= MEMORY_PAGE_COUNT) last = MEMORY_PAGE_COUNT - 1;
+    for (uint32 page = first; page <= last; page++) sim->dirty_pages[page] = 1;
+}
+
+// Drops cached and translated code that has bytes in [address, address + count)
+static void invalidate_code(sim8086 *sim, uint32 address, uint32 count)
+{
+    // Only the part in the code segment can hold cached instructions. The
+    // segment may run past 1 MiB and on at the start of memory.
+    uint32 code_base = (uint32) (sim->code - sim->memory);
+    uint32 start = (address - code_base) & MEMORY_ADDRESS_MASK;
+    if (start + count > MEMORY_SIZE)
+    {
+        count = start + count - MEMORY_SIZE; // starts in front of the segment
+        start = 0;
+    }
+    if (sim->icache && start < SEGMENT_SIZE) invalidate_instruction_cache(sim->icache, start, count);
+    if (sim->code_map)
+    {
+        for (uint32 offset = 0; offset < count; offset++)
+        {
+            if (sim->code_map[address + offset]) sim->code_modified = true;
+        }
+    }
+}
+
+// Code is fetched from CS:IP, but cached and translated code is kept by
+// IP. Both are dropped when CS points somewhere else.
+static void set_code_segment(sim8086 *sim)
+{
+    uint8 *code = sim->memory + ((uint32) sim->rs.cs << 4);
+    if (code == sim->code) return;
+    sim->code = code;
+    if (sim->icache) clear_instruction_cache(sim->icache);
+    if (sim->code_map) sim->code_modified = true;
+}
+
+// Moves the dirty marks into used_pages, for whoever clears them
+static void fold_dirty_pages(sim8086 *sim)
+{
+    for (uint32 page = 0; page < MEMORY_PAGE_COUNT; page++) sim->used_pages[page] |= sim->dirty_pages[page];
+    memset(sim->dirty_pages, 0, sizeof(sim->dirty_pages));
+}
+
+// Every write into guest memory has to go through here so that cached
+// and translated code never runs stale bytes.
+static void memory_written(sim8086 *sim, uint32 address, uint32 count)
+{
+    // What runs past 1 MiB went to the start of memory
+    address &= MEMORY_ADDRESS_MASK;
+    if (address + count > MEMORY_SIZE)
+    {
+        uint32 head = MEMORY_SIZE - address;
+        memory_written(sim, address, head);
+        memory_written(sim, 0, count - head);
+        return;
+    }
+
+    if (sim->write_log) log_memory_write(sim->write_log, address, count);
+    mark_dirty_pages(sim, address, count);
+    invalidate_code(sim, address, count);
+}
+
+// Reference decoder that scans opcode_table on every instruction.
+// Only kept to measure the dispatch table against it in --bench-decode.
+static instruction decode_next_instruction_linear(sim8086 *sim)
+{
+    uint8 byte = sim->code[sim->rs.ip];
+
+    opcode_info info = {};
+    bool found = false;
+    for (int opcode_index = 0; opcode_index < ARRAY_COUNT(opcode_table); opcode_index++)
+    {
+        info = opcode_table[opcode_index];
+        int32 opcode = (byte & info.mask);
+        if (opcode == info.opcode)
+        {
+            found = true;
+            break;
+        }
+    }
+    if (!found) return report_unknown_opcode(sim, byte);
+
+    return choose_decode_proc(info.opcode)(sim, &info);
+}
+
+static void *choose_register(sim8086 *sim, int32 reg)
+{
+    return (uint8 *) &sim->rs + register_offsets[reg];
+}
+
+// Address registers are always words, R_BX..R_DI or their low three bits
+static uint16 effective_address_base(registers *rs, effective_address ea)
+{
+    uint16 result = 0;
+    if (ea.reg_count > 0) result += rs->words[ea.reg1 & 0b111];
+    if (ea.reg_count > 1) result += rs->words[ea.reg2 & 0b111];
+    return result;
+}
+
+// Effective addresses wrap around at 64 KiB, the segment is added after that
+static uint16 effective_offset(registers *rs, effective_address ea)
+{
+    return (uint16) (ea.displacement + effective_address_base(rs, ea));
+}
+
+static uint32 segment_address(uint16 segment, uint16 offset)
+{
+    return (((uint32) segment << 4) + offset) & MEMORY_ADDRESS_MASK;
+}
+
+// A word at offset FFFF has its high byte at offset 0 of the same segment
+static uint16 read_memory_word(sim8086 *sim, uint16 segment, uint16 offset)
+{
+    uint8 low = sim->memory[segment_address(segment, offset)];
+    uint8 high = sim->memory[segment_address(segment, offset + 1)];
+    return (uint16) (low | (high << 8));
+}
+
+static void write_memory_word(sim8086 *sim, uint16 segment, uint16 offset, uint16 value)
+{
+    uint32 low = segment_address(segment, offset);
+    uint32 high = segment_address(segment, offset + 1);
+    sim->memory[low] = (uint8) value;
+    sim->memory[high] = (uint8) (value >> 8);
+    memory_written(sim, low, 1);
+    memory_written(sim, high, 1);
+}
+
+// Points at a memory operand. A word at offset FFFF is not in one piece,
+// it is read into *split and the operand points there instead.
+static void *memory_operand(sim8086 *sim, uint16 segment, uint16 offset, int32 w, uint16 *split)
+{
+    if (!w || offset != 0xFFFF) return sim->memory + segment_address(segment, offset);
+    *split = read_memory_word(sim, segment, offset);
+    return split;
+}
+
+// After a memory_operand was written, puts a split word back into memory
+static void memory_operand_written(sim8086 *sim, void *operand, uint16 segment, uint16 offset, int32 w, uint16 *split)
+{
+    if (operand == split) write_memory_word(sim, segment, offset, *split);
+    else memory_written(sim, (uint32) ((uint8 *) operand - sim->memory), w ? 2 : 1);
+}
+
+// The stack is SS:SP and grows down a word at a time
+static void push_word(sim8086 *sim, uint16 value)
+{
+    sim->rs.sp -= 2;
+    write_memory_word(sim, sim->rs.ss, sim->rs.sp, value);
+}
+
+static uint16 pop_word(sim8086 *sim)
+{
+    uint16 value = read_memory_word(sim, sim->rs.ss, sim->rs.sp);
+    sim->rs.sp += 2;
+    return value;
+}
+
+#define EXECUTE_INSTRUCTION(INSTR) do { \
+    if (w) { \
+        UPDATE_FLAGS(uint16); \
+        ASSIGN(INSTR, uint16); \
+    } else { \
+        UPDATE_FLAGS(uint8); \
+        ASSIGN(INSTR, uint8); \
+    }} while (false)
+
+static void execute_mov(sim8086 *sim, void *d, void *s, int32 w)
+{
+    if (w) *(uint16 *) d = *(uint16 *) s;
+    else   *(uint8  *) d = *(uint8  *) s;
+}
+
+#define execute_add_sub(INSTR, FLAGS_OP) \
+    if (w) { \
+        uint16 dst = *(uint16 *) d; \
+        uint16 src = *(uint16 *) s; \
+        *(uint16 *) d INSTR##= src; \
+        record_flags(&sim->rs, FLAGS_OP, w, dst, src, *(uint16 *) d); \
+    } else { \
+        uint8 dst = *(uint8 *) d; \
+        uint8 src = *(uint8 *) s; \
+        *(uint8 *) d INSTR##= src; \
+        record_flags(&sim->rs, FLAGS_OP, w, dst, src, *(uint8 *) d); \
+    }
+
+static void execute_cmp(sim8086 *sim, void *d, void *s, int32 w)
+{
+    if (w)
+    {
+        uint16 r = *(uint16 *) d - *(uint16 *) s;
+        record_flags(&sim->rs, FLAGS_OP_SUB, w, *(uint16 *) d, *(uint16 *) s, r);
+    }
+    else
+    {
+        uint8 r = *(uint8 *) d - *(uint8 *) s;
+        record_flags(&sim->rs, FLAGS_OP_SUB, w, *(uint8 *) d, *(uint8 *) s, r);
+    }
+}
+
+#include "string_instructions.c"
+
+static void execute_instruction(sim8086 *sim, instruction *i)
+{
+    if (is_string_instruction(i->tag))
+    {
+        execute_string(sim, i);
+        return;
+    }
+
+    void *s = 0;
+    void *d = 0;
+    int32 w = i->w;
+    uint16 split = 0; // a word operand at offset FFFF, see memory_operand
+
+    int32 ea_cycles = 0;
+
+    if (i->destination.tag == IOP_IMM) d = &i->destination.imm;
+    else if (i->destination.tag == IOP_REG) d = (uint8 *) &sim->rs + i->destination.reg_offset;
+    else if (i->destination.tag == IOP_MEM)
+    {
+        effective_address ea = i->destination.addr;
+        d = memory_operand(sim, sim->rs.segments[ea.segment], effective_offset(&sim->rs, ea), w, &split);
+        ea_cycles = i->destination.addr.cycles;
+    }
+    else if (i->tag == I_NOOP)
+    {
+        // Where an instruction the decoder failed on ends up, its error stays
+        if (!sim->error) set_error(sim, E8086_ERROR_BAD_OPERAND, "Error while executing instruction! (d)");
+        return;
+    }
+
+    if (i->source.tag == IOP_IMM) s = &i->source.imm;
+    else if (i->source.tag == IOP_REG) s = (uint8 *) &sim->rs + i->source.reg_offset;
+    else if (i->source.tag == IOP_MEM)
+    {
+        effective_address ea = i->source.addr;
+        s = memory_operand(sim, sim->rs.segments[ea.segment], effective_offset(&sim->rs, ea), w, &split);
+        ea_cycles = i->source.addr.cycles;
+    }
+    // else { printf("Error while executing instruction! (%d)\n", i->source.tag); exit(1); }
+
+    switch (i->tag)
+    {
+    case I_MOV: execute_mov(sim, d, s, w);  break;
+    case I_ADD: execute_add_sub(+, FLAGS_OP_ADD); break;
+    case I_SUB: execute_add_sub(-, FLAGS_OP_SUB); break;
+    case I_CMP: execute_cmp(sim, d, s, w); break;
+    case I_JE:   case I_JL:   case I_JLE:  case I_JB:
+    case I_JBE:  case I_JP:   case I_JO:   case I_JS:
+    case I_JNE:  case I_JNL:  case I_JNLE: case I_JNB:
+    case I_JNBE: case I_JNP:  case I_JNO:  case I_JNS:
+    case I_LOOP: case I_LOOPZ: case I_LOOPNZ: case I_JCXZ:
+    {
+        uint16 address = sim->rs.ip - 2; // all of them are two bytes long
+        bool taken = evaluate_branch(&sim->rs, i->tag);
+        if (taken) sim->rs.ip += i->destination.imm;
+        sim->cycles += branch_cycles(i->tag, taken);
+        count_branch(sim, address, taken);
+    } break;
+
+    // The 8086 pushes SP as it is after the decrement, and POP SP keeps the
+    // popped word rather than the incremented SP
+    case I_PUSH: push_word(sim, (d == &sim->rs.sp) ? sim->rs.sp - 2 : *(uint16 *) d); break;
+    case I_POP: *(uint16 *) d = pop_word(sim); break;
+    case I_CALL:
+    {
+        uint16 target = (i->destination.tag == IOP_IMM) ? sim->rs.ip + i->destination.imm : *(uint16 *) d;
+        push_word(sim, sim->rs.ip);
+        sim->rs.ip = target;
+    } break;
+    case I_RET:
+        sim->rs.ip = pop_word(sim);
+        if (i->destination.tag == IOP_IMM) sim->rs.sp += i->destination.imm;
+        break;
+
+    case I_CLD: sim->rs.flags &= ~FLAG_DF; break;
+    case I_STD: sim->rs.flags |= FLAG_DF; break;
+
+    default:
+        set_error(sim, E8086_ERROR_UNSUPPORTED_INSTRUCTION, "Cannot execute given instruction!");
+        return;
+    }
+
+    if ((i->destination.tag == IOP_MEM) &&
+        (i->tag == I_MOV || i->tag == I_ADD || i->tag == I_SUB || i->tag == I_POP))
+    {
+        effective_address ea = i->destination.addr;
+        memory_operand_written(sim, d, sim->rs.segments[ea.segment], effective_offset(&sim->rs, ea), w, &split);
+    }
+
+    sim->cycles += i->cycles + ea_cycles;
+}
+
+static void add_to_counter(cycle_counter *counter, int32 cycles, int32 ea_cycles)
+{
+    counter->count += 1;
+    counter->cycles += cycles;
+    counter->ea_cycles += ea_cycles;
+}
+
+// Node 0 is the code the run starts in at `entry`, see call_graph.c
+static call_graph *create_call_graph(uint16 entry)
+{
+    call_graph *graph = calloc(1, sizeof(call_graph));
+    graph->capacity = 64;
+    graph->nodes = calloc(graph->capacity, sizeof(call_node));
+    graph->nodes[0] = (call_node) { .function = entry };
+    graph->count = 1;
+    return graph;
+}
+
+// The callee `function` of `node`, added the first time it is called from there
+static uint32 find_callee(call_graph *graph, uint32 node, uint16 function)
+{
+    uint32 callee = graph->nodes[node].first_callee;
+    while (callee && graph->nodes[callee].function != function) callee = graph->nodes[callee].next_sibling;
+    if (callee) return callee;
+
+    if (graph->count == graph->capacity)
+    {
+        graph->capacity *= 2;
+        graph->nodes = realloc(graph->nodes, graph->capacity * sizeof(call_node));
+    }
+    callee = graph->count++;
+    call_node *parent = graph->nodes + node;
+    graph->nodes[callee] = (call_node)
+    {
+        .function = function,
+        .parent = node,
+        .next_sibling = parent->first_callee,
+        .depth = parent->depth + 1,
+    };
+    parent->first_callee = callee;
+    return callee;
+}
+
+// Adds the cycles of an instruction to the running function, then follows
+// a CALL into the function at `ip_after` or a RET out of the running one
+static void track_call(call_graph *graph, instruction_tag tag, uint16 ip_after, int32 cycles)
+{
+    call_node *node = graph->nodes + graph->current;
+    node->cycles += cycles;
+    if (tag == I_CALL)
+    {
+        if (node->depth == CALL_GRAPH_MAX_DEPTH)
+        {
+            graph->overflow += 1;
+            return;
+        }
+        graph->current = find_callee(graph, graph->current, ip_after);
+        graph->nodes[graph->current].calls += 1;
+    }
+    else if (tag == I_RET)
+    {
+        if (graph->overflow) graph->overflow -= 1;
+        else if (graph->current) graph->current = node->parent;
+        else graph->stray_returns += 1;
+    }
+}
+
+// Counts an instruction that started at `ip` and ran without an error, in
+// the profile, stats and call graph that are kept. Only the interpreter
+// calls this, and only when one of them is.
+static void count_instruction(sim8086 *sim, uint16 ip, instruction *instr, uint64 cycles_before)
+{
+    effective_address *ea = (instr->destination.tag == IOP_MEM) ? &instr->destination.addr
+                          : (instr->source.tag == IOP_MEM) ? &instr->source.addr
+                          : 0;
+    int32 ea_cycles = ea ? ea->cycles : 0;
+    int32 cycles = (int32) (sim->cycles - cycles_before) - ea_cycles;
+    if (sim->profile) add_to_counter(sim->profile + ip, cycles, ea_cycles);
+    if (sim->calls) track_call(sim->calls, instr->tag, sim->rs.ip, cycles + ea_cycles);
+
+    instruction_stats *stats = sim->stats;
+    if (!stats) return;
+    add_to_counter(&stats->total, cycles, ea_cycles);
+    add_to_counter(stats->by_tag + instr->tag, cycles, ea_cycles);
+    add_to_counter(stats->by_shape + instr->destination.tag * 4 + instr->source.tag, cycles, ea_cycles);
+    if (ea)
+    {
+        // e8086_ea_table has the cycles without the prefix
+        effective_address entry = *ea;
+        if (entry.segment_prefix) entry.cycles -= SEGMENT_PREFIX_CYCLES;
+        int32 index = ea_table_index(entry);
+        if (index >= 0) add_to_counter(stats->by_ea + index, 0, ea_cycles);
+    }
+}
+
+// Same as calling e8086_step in a loop, without re-reading the limits every
+// step. `executed` gets the number of instructions that ran.
+static e8086_status run_until(sim8086 *sim, e8086_run_limits limits, uint64 *executed)
+{
+    if (sim->error) set_error(sim, E8086_OK, "");
+
+    // A limit that is off never matches
+    uint64 max_instructions = limits.max_instructions ? limits.max_instructions : (uint64) -1;
+    uint64 max_cycles = limits.max_cycles ? limits.max_cycles : (uint64) -1;
+    int32 stop_ip = limits.stop_ip;
+    uint32 end_ip = sim->image_size;
+
+    e8086_status status = E8086_OK;
+    uint64 instructions = 0;
+    for (;; instructions++)
+    {
+        uint16 ip = sim->rs.ip;
+        if (instructions >= max_instructions) { status = E8086_INSTRUCTION_LIMIT; break; }
+        if (sim->cycles >= max_cycles) { status = E8086_CYCLE_LIMIT; break; }
+        if (ip == stop_ip) { status = E8086_REACHED_IP; break; }
+        if (ip >= end_ip) { status = E8086_HALTED; break; }
+
+        instruction instr;
+        uint64 cycles_before = sim->cycles;
+        fetch_instruction(sim, &instr);
+        execute_instruction(sim, &instr);
+        if (sim->error)
+        {
+            sim->rs.ip = ip;
+            status = sim->error;
+            break;
+        }
+        if (sim->profile || sim->stats || sim->calls) count_instruction(sim, ip, &instr, cycles_before);
+    }
+    *executed = instructions;
+    return status;
+}
+
+#include "threaded.c"
+#include "jit.c"
+#include "lockstep.c"
+#include "snapshot.c"
+#include "record.c"
+
+/*
+    Library API, see e8086.h
+*/
+
+sim8086 *e8086_create(void)
+{
+    init_opcode_dispatch_table();
+
+    sim8086 *sim = calloc(1, sizeof(sim8086));
+    sim->memory = create_guest_memory();
+    if (!sim->memory)
+    {
+        free(sim);
+        return 0;
+    }
+    sim->code = sim->memory;
+    sim->icache = create_instruction_cache(SEGMENT_SIZE);
+    return sim;
+}
+
+void e8086_destroy(sim8086 *sim)
+{
+    if (!sim) return;
+    destroy_instruction_cache(sim->icache);
+    if (sim->threaded) destroy_threaded_engine(sim->threaded);
+    free(sim->branches);
+    free(sim->profile);
+    free(sim->stats);
+    if (sim->calls) free(sim->calls->nodes);
+    free(sim->calls);
+    if (sim->write_log) free(sim->write_log->writes);
+    free(sim->write_log);
+    destroy_guest_memory(sim->memory);
+    free(sim);
+}
+
+void e8086_reset(sim8086 *sim)
+{
+    // Not a guest write, so there is nothing to log or invalidate one by one.
+    // Pages that held data change, and are all the pages that can.
+    for (uint32 page = 0; page < MEMORY_PAGE_COUNT; page++)
+    {
+        if (!sim->used_pages[page] && !sim->dirty_pages[page]) continue;
+        memset(sim->memory + (page << MEMORY_PAGE_SHIFT), 0, MEMORY_PAGE_SIZE);
+        sim->dirty_pages[page] = 1;
+        sim->used_pages[page] = 0;
+    }
+    if (sim->icache) clear_instruction_cache(sim->icache);
+    if (sim->code_map) sim->code_modified = true;
+    sim->rs = (registers) {};
+    sim->code = sim->memory;
+    sim->cycles = 0;
+    sim->image_size = 0;
+    set_error(sim, E8086_OK, "");
+}
+
+e8086_status e8086_load(sim8086 *sim, unsigned char const *image, unsigned int size)
+{
+    if (size > SEGMENT_SIZE)
+    {
+        set_error(sim, E8086_ERROR_IMAGE_TOO_LARGE, "Image does not fit into 64 KiB");
+        return sim->error;
+    }
+
+    memcpy(sim->code, image, size);
+    memory_written(sim, (uint32) (sim->code - sim->memory), size);
+    sim->image_size = size;
+    sim->rs.ip = 0;
+    set_error(sim, E8086_OK, "");
+    return E8086_OK;
+}
+
+e8086_status e8086_step(sim8086 *sim)
+{
+    if (sim->error) set_error(sim, E8086_OK, "");
+    if (sim->rs.ip >= sim->image_size) return E8086_HALTED;
+
+    uint16 ip = sim->rs.ip;
+    uint64 cycles_before = sim->cycles;
+    instruction instr;
+    fetch_instruction(sim, &instr);
+    execute_instruction(sim, &instr);
+    if (sim->error)
+    {
+        // Nothing was changed but IP, so the step can be retried after fixing the code
+        sim->rs.ip = ip;
+        return sim->error;
+    }
+    if (sim->profile || sim->stats || sim->calls) count_instruction(sim, ip, &instr, cycles_before);
+    return E8086_OK;
+}
+
+e8086_status e8086_run_until(sim8086 *sim, e8086_run_limits limits)
+{
+    // Translated code does not check limits
+    if (sim->threaded && !limits.max_cycles && !limits.max_instructions && limits.stop_ip < 0)
+    {
+        if (sim->error) set_error(sim, E8086_OK, "");
+        return run_threaded(sim, sim->threaded, sim->image_size);
+    }
+
+    uint64 executed;
+    return run_until(sim, limits, &executed);
+}
+
+e8086_engine e8086_set_engine(sim8086 *sim, e8086_engine engine, unsigned int jit_threshold)
+{
+    if (sim->threaded)
+    {
+        destroy_threaded_engine(sim->threaded);
+        sim->threaded = 0;
+        sim->code_map = 0;
+        sim->code_modified = false;
+    }
+    if (engine == E8086_ENGINE_INTERPRETER) return engine;
+
+    threaded_engine *threaded = create_threaded_engine(sim);
+    if (engine == E8086_ENGINE_JIT)
+    {
+        threaded->jit = create_jit();
+        threaded->jit_threshold = jit_threshold;
+        if (!threaded->jit) engine = E8086_ENGINE_THREADED;
+    }
+    return engine;
+}
+
+void e8086_set_instruction_cache(sim8086 *sim, int enabled)
+{
+    if (enabled && !sim->icache)
+    {
+        sim->icache = create_instruction_cache(SEGMENT_SIZE);
+    }
+    else if (!enabled && sim->icache)
+    {
+        destroy_instruction_cache(sim->icache);
+        sim->icache = 0;
+    }
+}
+
+e8086_state e8086_get_state(sim8086 *sim)
+{
+    registers *rs = &sim->rs;
+    e8086_state result =
+    {
+        .ax = rs->ax, .bx = rs->bx, .cx = rs->cx, .dx = rs->dx,
+        .sp = rs->sp, .bp = rs->bp, .si = rs->si, .di = rs->di,
+        .es = rs->es, .cs = rs->cs, .ss = rs->ss, .ds = rs->ds,
+        .ip = rs->ip,
+        .flags = read_flags(rs),
+        .cycles = sim->cycles,
+    };
+    return result;
+}
+
+void e8086_set_state(sim8086 *sim, e8086_state const *state)
+{
+    registers *rs = &sim->rs;
+    rs->ax = state->ax; rs->bx = state->bx; rs->cx = state->cx; rs->dx = state->dx;
+    rs->sp = state->sp; rs->bp = state->bp; rs->si = state->si; rs->di = state->di;
+    rs->es = state->es; rs->cs = state->cs; rs->ss = state->ss; rs->ds = state->ds;
+    rs->ip = state->ip;
+    rs->flags = state->flags;
+    rs->lazy = (lazy_flags) {};
+    sim->cycles = state->cycles;
+    set_code_segment(sim);
+}
+
+unsigned char *e8086_memory(sim8086 *sim)
+{
+    return sim->memory;
+}
+
+void e8086_write_memory(sim8086 *sim, unsigned int address, void const *data, unsigned int size)
+{
+    if (address >= MEMORY_SIZE) return;
+    if (size > MEMORY_SIZE - address) size = MEMORY_SIZE - address;
+    memcpy(sim->memory + address, data, size);
+    memory_written(sim, address, size);
+}
+
+char const *e8086_error(sim8086 *sim)
+{
+    return sim->error_message;
+}
+
+char const *e8086_status_name(e8086_status status)
+{
+    static char const *names[] =
+    {
+        [E8086_OK] = "ok",
+        [E8086_HALTED] = "halted",
+        [E8086_CYCLE_LIMIT] = "cycle_limit",
+        [E8086_INSTRUCTION_LIMIT] = "instruction_limit",
+        [E8086_REACHED_IP] = "reached_ip",
+        [E8086_ERROR_UNKNOWN_OPCODE] = "unknown_opcode",
+        [E8086_ERROR_UNKNOWN_SUB_OPCODE] = "unknown_sub_opcode",
+        [E8086_ERROR_UNSUPPORTED_INSTRUCTION] = "unsupported_instruction",
+        [E8086_ERROR_BAD_OPERAND] = "bad_operand",
+        [E8086_ERROR_IMAGE_TOO_LARGE] = "image_too_large",
+    };
+    if ((uint32) status >= ARRAY_COUNT(names)) return "unknown";
+    return names[status];
+}
+
+/*
+    Front end support, see e8086_internal.h
+*/
+
+// The decoder only uses code, IP and the error of the simulator it gets
+static _Thread_local sim8086 decode_scratch;
+
+static uint32 decode_with(instruction (*decode_next)(sim8086 *sim), uint8 *code, uint16 ip, instruction *result)
+{
+    sim8086 *scratch = &decode_scratch;
+    scratch->code = code;
+    scratch->rs.ip = ip;
+    scratch->error = E8086_OK;
+    *result = decode_next(scratch);
+    return scratch->error ? 0 : (uint16) (scratch->rs.ip - ip);
+}
+
+uint32 e8086_decode(uint8 *code, uint16 ip, instruction *result)
+{
+    return decode_with(decode_next_instruction, code, ip, result);
+}
+
+uint32 e8086_decode_linear(uint8 *code, uint16 ip, instruction *result)
+{
+    return decode_with(decode_next_instruction_linear, code, ip, result);
+}
+
+bool e8086_pack_instruction(instruction i, packed_instruction *result)
+{
+    return pack_instruction(i, result);
+}
+
+void e8086_unpack_instruction(packed_instruction *packed, instruction *result)
+{
+    unpack_instruction(packed, result);
+}
+
+char const *e8086_rep_prefix_name(instruction *i)
+{
+    return rep_prefix_name(i);
+}
+
+bool e8086_has_variable_cycles(instruction *i)
+{
+    return has_variable_cycles(i);
+}
+
+bool e8086_is_jump(instruction_tag tag)
+{
+    return is_jump(tag);
+}
+
+bool e8086_is_call_or_return(instruction_tag tag)
+{
+    return is_call_or_return(tag);
+}
+
+uint8 *e8086_code(sim8086 *sim)
+{
+    return sim->code;
+}
+
+uint32 e8086_image_size(sim8086 *sim)
+{
+    return sim->image_size;
+}
+
+bool e8086_page_is_zero(sim8086 *sim, uint32 page)
+{
+    if (!sim->used_pages[page] && !sim->dirty_pages[page]) return true;
+    return memcmp(sim->memory + (page << MEMORY_PAGE_SHIFT), zero_page, MEMORY_PAGE_SIZE) == 0;
+}
+
+void e8086_count(sim8086 *sim, uint32 counters)
+{
+    if ((counters & E8086_COUNT_BRANCHES) && !sim->branches) sim->branches = calloc(SEGMENT_SIZE, sizeof(branch_counter));
+    if ((counters & E8086_COUNT_PROFILE) && !sim->profile) sim->profile = calloc(SEGMENT_SIZE, sizeof(cycle_counter));
+    if ((counters & E8086_COUNT_STATS) && !sim->stats) sim->stats = calloc(1, sizeof(instruction_stats));
+    if ((counters & E8086_COUNT_CALLS) && !sim->calls) sim->calls = create_call_graph(sim->rs.ip);
+}
+
+branch_counter *e8086_branches(sim8086 *sim)
+{
+    return sim->branches;
+}
+
+cycle_counter *e8086_profile(sim8086 *sim)
+{
+    return sim->profile;
+}
+
+instruction_stats *e8086_instruction_stats(sim8086 *sim)
+{
+    return sim->stats;
+}
+
+call_graph *e8086_call_graph(sim8086 *sim)
+{
+    return sim->calls;
+}
+
+memory_write_log *e8086_log_writes(sim8086 *sim)
+{
+    if (!sim->write_log) sim->write_log = calloc(1, sizeof(memory_write_log));
+    return sim->write_log;
+}
+
+engine_statistics e8086_engine_statistics(sim8086 *sim)
+{
+    engine_statistics result = {};
+    instruction_cache *icache = sim->icache;
+    if (icache)
+    {
+        result.icache = true;
+        result.icache_hits = icache->hits;
+        result.icache_misses = icache->misses;
+        result.icache_invalidations = icache->invalidations;
+    }
+
+    threaded_engine *engine = sim->threaded;
+    if (engine)
+    {
+        result.threaded = true;
+        result.blocks_translated = engine->blocks_translated;
+        result.blocks_executed = engine->blocks_executed;
+        result.blocks_chained = engine->blocks_chained;
+        result.flushes = engine->flushes;
+    }
+    if (engine && engine->jit)
+    {
+        result.jit = true;
+        result.blocks_compiled = engine->jit->blocks_compiled;
+        result.blocks_rejected = engine->jit->blocks_rejected;
+        result.jit_code_size = engine->jit->used;
+    }
+    return result;
+}
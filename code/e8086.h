@@ -0,0 +1,202 @@
+/*
+    libe8086: the 8086 simulator as a library.
+
+    Build code/e8086.c on its own, build.sh makes libe8086.a and links the
+    e8086 front end against it. Nothing in the library prints or exits,
+    every failure comes back as an e8086_status and e8086_error describes
+    it.
+
+        sim8086 *sim = e8086_create();
+        e8086_load(sim, image, image_size);
+        e8086_run_limits limits = { .max_cycles = 100000, .stop_ip = -1 };
+        e8086_status status = e8086_run_until(sim, limits);
+        if (status >= E8086_ERROR_UNKNOWN_OPCODE) puts(e8086_error(sim));
+        e8086_destroy(sim);
+
+    A program ends when IP leaves the loaded image. Addresses are 20 bits,
+    segment * 16 + offset wrapped around at 1 MiB, and memory is the whole
+    1 MiB. Only the pages a program touches take memory on the host.
+*/
+
+#ifndef E8086_H
+#define E8086_H
+
+typedef struct sim8086 sim8086;
+
+typedef enum
+{
+    E8086_OK,                 // the step was executed
+    E8086_HALTED,             // IP is past the end of the image
+    E8086_CYCLE_LIMIT,        // run_until reached max_cycles
+    E8086_INSTRUCTION_LIMIT,  // run_until executed max_instructions
+    E8086_REACHED_IP,         // run_until arrived at stop_ip
+
+    // Errors, the instruction at IP was not executed
+    E8086_ERROR_UNKNOWN_OPCODE,
+    E8086_ERROR_UNKNOWN_SUB_OPCODE,
+    E8086_ERROR_UNSUPPORTED_INSTRUCTION,
+    E8086_ERROR_BAD_OPERAND,
+    E8086_ERROR_IMAGE_TOO_LARGE,
+} e8086_status;
+
+typedef struct
+{
+    unsigned long long max_cycles;       // 0 for no limit
+    unsigned long long max_instructions; // 0 for no limit
+    int stop_ip;                         // stops before executing at this IP, -1 for none
+} e8086_run_limits;
+
+typedef struct
+{
+    unsigned short ax, bx, cx, dx;
+    unsigned short sp, bp, si, di;
+    unsigned short es, cs, ss, ds;
+    unsigned short ip;
+    unsigned short flags;
+    unsigned long long cycles;
+} e8086_state;
+
+// Zeroed memory, registers cleared, instruction cache on. 0 if the host
+// cannot map the guest memory.
+sim8086 *e8086_create(void);
+void e8086_destroy(sim8086 *sim);
+
+// Clears registers, cycles, memory and errors, and unloads the image
+void e8086_reset(sim8086 *sim);
+
+// Copies the image (at most 64 KiB) to CS:0 and points IP at it
+e8086_status e8086_load(sim8086 *sim, unsigned char const *image, unsigned int size);
+
+e8086_status e8086_step(sim8086 *sim);
+e8086_status e8086_run_until(sim8086 *sim, e8086_run_limits limits);
+
+typedef enum
+{
+    E8086_ENGINE_INTERPRETER,
+    E8086_ENGINE_THREADED, // blocks of pre-decoded micro-ops, see threaded.c
+    E8086_ENGINE_JIT,      // the threaded engine, with x86-64 code for hot blocks, see jit.c
+} e8086_engine;
+
+// e8086_run_until runs the program through the engine when there are no
+// limits, runs with limits and e8086_step always interpret. Gives the
+// engine that runs from now on, which is the threaded engine where the JIT
+// is not available. jit_threshold is how often a block runs before it is
+// compiled.
+e8086_engine e8086_set_engine(sim8086 *sim, e8086_engine engine, unsigned int jit_threshold);
+// The cache of decoded instructions the interpreter keeps, on by default
+void e8086_set_instruction_cache(sim8086 *sim, int enabled);
+
+e8086_state e8086_get_state(sim8086 *sim);
+// Sets the registers, FLAGS and the cycle count
+void e8086_set_state(sim8086 *sim, e8086_state const *state);
+
+// Physical memory, to read. Reset, snapshots and memory hashes only look
+// at pages the simulator knows were written, so write through
+// e8086_write_memory, which also drops code cached for those bytes.
+unsigned char *e8086_memory(sim8086 *sim);
+void e8086_write_memory(sim8086 *sim, unsigned int address, void const *data, unsigned int size);
+
+// Text of the error the last call returned, "" if it did not fail
+char const *e8086_error(sim8086 *sim);
+
+// Short lowercase name of a status, "halted", "unknown_opcode" and so on
+char const *e8086_status_name(e8086_status status);
+
+/*
+    Snapshots save the registers, cycles and memory of a simulator, see
+    snapshot.c. Restoring the snapshot that was last taken or restored only
+    copies the pages the program wrote since, so going back to one point
+    again and again is cheap:
+
+        e8086_snapshot *start = e8086_snapshot_create(sim);
+        for (each continuation...)
+        {
+            e8086_snapshot_restore(sim, start);
+            e8086_run_until(sim, limits);
+        }
+
+    Snapshots only hold the pages the program used.
+*/
+
+typedef struct e8086_snapshot e8086_snapshot;
+
+e8086_snapshot *e8086_snapshot_create(sim8086 *sim);
+void e8086_snapshot_destroy(e8086_snapshot *snapshot);
+
+// Saves the current state into an existing snapshot, reusing its memory
+void e8086_snapshot_take(sim8086 *sim, e8086_snapshot *snapshot);
+// Returns the number of pages that had to be copied back
+unsigned int e8086_snapshot_restore(sim8086 *sim, e8086_snapshot const *snapshot);
+
+/*
+    Recordings keep checkpoints of a run, see record.c, so that any point
+    of it can be gone back to by restoring the checkpoint before it and
+    replaying from there. Run the simulator only through the recording
+    while it is recorded.
+
+        e8086_record_options options = { .checkpoint_cycles = 1000000 };
+        e8086_recording *recording = e8086_record_create(sim, options);
+        e8086_record_run(recording, limits);
+        e8086_seek_cycle(recording, 5000);
+        e8086_step_back(recording);
+*/
+
+typedef struct
+{
+    unsigned long long checkpoint_cycles; // cycles between checkpoints, 0 for 1000000
+    unsigned long long memory_budget;     // bytes the checkpoints may take, 0 for no limit
+} e8086_record_options;
+
+typedef struct e8086_recording e8086_recording;
+
+// Starts recording at the current state of the simulator
+e8086_recording *e8086_record_create(sim8086 *sim, e8086_record_options options);
+void e8086_record_destroy(e8086_recording *recording);
+
+// Runs like e8086_run_until and records, from the end of the recording
+e8086_status e8086_record_run(e8086_recording *recording, e8086_run_limits limits);
+
+// Instructions from the start of the recording to the state of the simulator, and in all
+unsigned long long e8086_record_position(e8086_recording *recording);
+unsigned long long e8086_record_length(e8086_recording *recording);
+
+// Seeks stop at the end of the recording. A cycle is found the way
+// max_cycles stops: at the first instruction that ends at or after it.
+void e8086_seek_instruction(e8086_recording *recording, unsigned long long instruction);
+void e8086_seek_cycle(e8086_recording *recording, unsigned long long cycle);
+// Goes one instruction back, false at the start of the recording
+int e8086_step_back(e8086_recording *recording);
+
+/*
+    Lockstep groups run one program for up to E8086_LOCKSTEP_LANES
+    different starting states at once, see lockstep.c. Every lane ends in
+    the state e8086_run_until would leave a simulator in. A lane that uses
+    segment registers or string instructions is finished on a simulator of
+    its own, so it gives the same results, only without the speedup.
+
+        e8086_lockstep *group = e8086_lockstep_create(16);
+        e8086_lockstep_load(group, image, image_size);
+        for (lane...) e8086_lockstep_set_state(group, lane, &states[lane]);
+        e8086_lockstep_run_until(group, limits);
+        e8086_state result = e8086_lockstep_get_state(group, lane);
+*/
+
+#define E8086_LOCKSTEP_LANES 16
+
+typedef struct e8086_lockstep e8086_lockstep;
+
+e8086_lockstep *e8086_lockstep_create(unsigned int lane_count);
+void e8086_lockstep_destroy(e8086_lockstep *group);
+
+// Resets every lane and copies the image into each of them
+e8086_status e8086_lockstep_load(e8086_lockstep *group, unsigned char const *image, unsigned int size);
+void e8086_lockstep_set_state(e8086_lockstep *group, unsigned int lane, e8086_state const *state);
+// Physical memory of a lane, 64 KiB from 0 while the lane is in the group
+unsigned char *e8086_lockstep_memory(e8086_lockstep *group, unsigned int lane);
+
+// Runs until every lane stopped, each with the status e8086_run_until would give
+void e8086_lockstep_run_until(e8086_lockstep *group, e8086_run_limits limits);
+e8086_status e8086_lockstep_status(e8086_lockstep *group, unsigned int lane);
+e8086_state e8086_lockstep_get_state(e8086_lockstep *group, unsigned int lane);
+
+#endif
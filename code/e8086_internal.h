@@ -0,0 +1,349 @@
+/*
+    What the e8086 front end sees of the library beyond e8086.h: decoded
+    instructions for disassembly and traces, and the counters a simulator
+    keeps when it is asked to. main.c and the files it includes are built
+    against this header and libe8086.a. It changes with the simulator and
+    is not meant to build anything else on.
+*/
+
+#ifndef E8086_INTERNAL_H
+#define E8086_INTERNAL_H
+
+#include "e8086.h"
+
+#define ARRAY_COUNT(ARRAY) (sizeof(ARRAY) / sizeof(ARRAY[0]))
+
+typedef int bool;
+#define true 1
+#define false 0
+
+typedef   signed char   int8;
+typedef unsigned char  uint8;
+typedef          short  int16;
+typedef unsigned short uint16;
+typedef   signed int    int32;
+typedef unsigned int   uint32;
+typedef   signed long long  int64;
+typedef unsigned long long uint64;
+
+enum
+{
+/*
+   0    1    2    3    4    5    6    7    8    9   10   11   12   13   14   15
+  al   cl   dl   bl   ah   ch   dh   bh   ax   cx   dx   bx   sp   bp   si   di
+ 000  001  010  011  100  101  110  111 1000 1001 1010 1011 1100 1101 1110 1111
+
+  16   17   18   19
+  es   cs   ss   ds   (R_ES + the sreg field)
+*/
+    R_AL, R_CL, R_DL, R_BL, R_AH, R_CH, R_DH, R_BH,
+    R_AX, R_CX, R_DX, R_BX, R_SP, R_BP, R_SI, R_DI,
+    R_ES, R_CS, R_SS, R_DS,
+};
+
+// Segment registers in sreg encoding order, an index into registers.segments
+enum
+{
+    SEG_ES, SEG_CS, SEG_SS, SEG_DS,
+};
+
+enum
+{
+    FLAG_CF = (1 << 0),
+    FLAG_PF = (1 << 2),
+    FLAG_AF = (1 << 4),
+    FLAG_ZF = (1 << 6),
+    FLAG_SF = (1 << 7),
+    FLAG_TF = (1 << 8),
+    FLAG_IF = (1 << 9),
+    FLAG_DF = (1 << 10),
+    FLAG_OF = (1 << 11),
+};
+
+typedef enum
+{
+    I_NOOP,
+
+    I_MOV,
+    I_ADD,
+    I_SUB,
+
+    I_CMP,
+    I_JE,  I_JL,  I_JLE,  I_JB,  I_JBE,  I_JP,  I_JO,  I_JS,
+    I_JNE, I_JNL, I_JNLE, I_JNB, I_JNBE, I_JNP, I_JNO, I_JNS,
+    I_LOOP,
+    I_LOOPZ,
+    I_LOOPNZ,
+    I_JCXZ,
+
+    I_PUSH,
+    I_POP,
+    I_CALL,
+    I_RET,
+
+    I_CLD,
+    I_STD,
+
+    // String instructions, see string_instructions.c
+    I_MOVS,
+    I_CMPS,
+    I_SCAS,
+    I_LODS,
+    I_STOS,
+} instruction_tag;
+
+#define INSTRUCTION_TAG_COUNT (I_STOS + 1)
+
+typedef enum
+{
+    IOPERAND_NONE,
+
+    IOP_IMM,
+    IOP_REG,
+    IOP_MEM,
+} instruction_operand_tag;
+
+typedef struct
+{
+    uint32 reg1, reg2;
+    uint32 reg_count; // 0, 1, or 2
+    uint32 displacement;
+    int32  cycles;
+    uint32 segment;      // SEG_ES..SEG_DS
+    bool segment_prefix; // segment comes from an override prefix, not from e8086_ea_table
+} effective_address;
+
+typedef struct
+{
+    instruction_operand_tag tag;
+    union
+    {
+        int32 imm;
+        struct
+        {
+            int32 reg;
+            uint32 reg_offset; // of reg in registers, resolved when decoding
+        };
+        effective_address addr;
+    };
+} instruction_operand;
+
+typedef struct
+{
+    instruction_tag tag;
+
+    instruction_operand source, destination;
+    int32 w; // operand width: 1 for words, 0 for bytes
+    int32 cycles;
+    int32 rep; // REP_NONE, or the prefix of a repeated string instruction
+} instruction;
+
+// Repeat prefixes. REP_E is REP for MOVS, LODS and STOS and REPE for CMPS
+// and SCAS, which stop repeating on a mismatch; REPNE stops on a match.
+enum
+{
+    REP_NONE,
+    REP_E,
+    REP_NE,
+};
+
+// The longest instruction the decoder takes is 9 bytes: two prefixes,
+// opcode, ModRM, 16-bit displacement and 16-bit immediate. Prefixes that
+// make an instruction longer than that are rejected.
+#define MAX_INSTRUCTION_LENGTH 9
+
+// An instruction as the cache keeps it, 8 bytes (10 with the length in
+// icache_entry) instead of the 80 of instruction on x86-64. Operand bytes
+// hold the operand tag in bits 6..7, and a register encoding or an
+// e8086_ea_table index (mod * 8 + r_m) in bits 0..4. Bit 5 of the destination
+// byte is the operand width. An instruction has at most one memory
+// operand and one immediate. The tag byte keeps the segment of an
+// override prefix in bits 5..6 and sets bit 7 for it.
+typedef struct
+{
+    uint8 tag;
+    uint8 cycles;
+    uint8 destination;
+    uint8 source;
+    int16 displacement;
+    int16 imm;
+} packed_instruction;
+
+typedef struct
+{
+    uint64 taken;
+    uint64 not_taken;
+} branch_counter;
+
+// What some executed instructions added up to, see count_instruction
+typedef struct
+{
+    uint64 count;
+    uint64 cycles;    // without the effective address cycles
+    uint64 ea_cycles;
+} cycle_counter;
+
+// Operand shapes are destination tag * 4 + source tag, see instruction_operand_tag
+#define INSTRUCTION_SHAPE_COUNT 16
+
+// Executed instructions by kind, see instruction_stats.c
+typedef struct
+{
+    cycle_counter total;
+    cycle_counter by_tag[INSTRUCTION_TAG_COUNT];
+    cycle_counter by_shape[INSTRUCTION_SHAPE_COUNT];
+    cycle_counter by_ea[3 * 8]; // by e8086_ea_table entry, their cycles are all effective address cycles
+} instruction_stats;
+
+// Calls deeper than this count into the function at this depth
+#define CALL_GRAPH_MAX_DEPTH 256
+
+// A function on one call stack, see call_graph.c
+typedef struct
+{
+    uint16 function;     // address the CALL went to, where the run started for node 0
+    uint32 parent;
+    uint32 first_callee; // 0 for none, node 0 is nobody's callee
+    uint32 next_sibling; // next callee of the parent, 0 for none
+    uint32 depth;
+    uint64 calls;
+    uint64 cycles;       // spent in the function itself, not in its callees
+} call_node;
+
+typedef struct
+{
+    call_node *nodes;
+    uint32 count;
+    uint32 capacity;
+    uint32 current;     // node of the running function
+    uint32 overflow;    // calls past CALL_GRAPH_MAX_DEPTH that did not return yet
+    uint64 stray_returns; // RETs with no CALL to return from
+} call_graph;
+
+typedef struct
+{
+    uint32 address; // physical
+    uint32 count;
+} memory_write;
+
+typedef struct
+{
+    memory_write *writes;
+    uint32 count;
+    uint32 capacity;
+} memory_write_log;
+
+// A segment is what IP and effective addresses can reach. Physical
+// addresses are segment * 16 + offset and wrap around at 1 MiB, the 8086
+// has 20 address lines. Offsets wrap around at 64 KiB, so a word at the
+// last offset of a segment takes its high byte from offset 0 of the same
+// segment.
+#define SEGMENT_SIZE (1 << 16)
+#define MEMORY_SIZE (1 << 20)
+#define MEMORY_ADDRESS_MASK (MEMORY_SIZE - 1)
+
+// Memory is tracked in pages for snapshots, see snapshot.c
+#define MEMORY_PAGE_SHIFT 8
+#define MEMORY_PAGE_SIZE (1 << MEMORY_PAGE_SHIFT)
+#define MEMORY_PAGE_COUNT (MEMORY_SIZE >> MEMORY_PAGE_SHIFT)
+
+extern char const *e8086_register_names[20];
+extern char const *e8086_instruction_names[INSTRUCTION_TAG_COUNT];
+// By mod (0 to 2) and r_m, BP based addresses go through SS, all others through DS
+extern effective_address e8086_ea_table[3][8];
+
+// Decodes the instruction at code[ip] without running it, `code` being the
+// 64 KiB a CS value reaches (e8086_code). Gives its length, 0 if the bytes
+// there are not an instruction the simulator runs.
+uint32 e8086_decode(uint8 *code, uint16 ip, instruction *result);
+// The same with a search through the opcode table instead of the dispatch
+// table, only for --bench-decode
+uint32 e8086_decode_linear(uint8 *code, uint16 ip, instruction *result);
+
+// false if the instruction does not fit into a packed_instruction
+bool e8086_pack_instruction(instruction i, packed_instruction *result);
+void e8086_unpack_instruction(packed_instruction *packed, instruction *result);
+
+char const *e8086_rep_prefix_name(instruction *i);
+// Branches and repeats, their cycles are only known once they ran
+bool e8086_has_variable_cycles(instruction *i);
+bool e8086_is_jump(instruction_tag tag);
+bool e8086_is_call_or_return(instruction_tag tag);
+
+// Memory at CS:0, what IP indexes
+uint8 *e8086_code(sim8086 *sim);
+// Bytes e8086_load loaded, the program ends when IP gets past them
+uint32 e8086_image_size(sim8086 *sim);
+// Whether a page of memory holds only zeros. Pages the program never
+// wrote are known to without looking at them.
+bool e8086_page_is_zero(sim8086 *sim, uint32 page);
+
+enum
+{
+    E8086_COUNT_BRANCHES = (1 << 0), // e8086_branches
+    E8086_COUNT_PROFILE  = (1 << 1), // e8086_profile
+    E8086_COUNT_STATS    = (1 << 2), // e8086_instruction_stats
+    E8086_COUNT_CALLS    = (1 << 3), // e8086_call_graph, from the current IP on
+};
+
+// Starts counting, `counters` is a mask of the E8086_COUNT_ values. Call
+// it before the first run, the JIT builds the branch counters into its
+// code. Branches are counted by every engine, everything else only by the
+// interpreter. Counts add up over runs until the simulator is destroyed.
+void e8086_count(sim8086 *sim, uint32 counters);
+// By address of the branch, 0 if not counted
+branch_counter *e8086_branches(sim8086 *sim);
+// By IP, 0 if not counted
+cycle_counter *e8086_profile(sim8086 *sim);
+instruction_stats *e8086_instruction_stats(sim8086 *sim);
+call_graph *e8086_call_graph(sim8086 *sim);
+
+// Starts logging the memory writes of every step into the returned log,
+// which the simulator owns. Whoever reads it sets count back to 0.
+memory_write_log *e8086_log_writes(sim8086 *sim);
+
+typedef struct
+{
+    bool icache;    // 0 if the instruction cache is off
+    uint64 icache_hits;
+    uint64 icache_misses;
+    uint64 icache_invalidations;
+
+    bool threaded;  // 0 unless the threaded engine or the JIT runs
+    uint64 blocks_translated;
+    uint64 blocks_executed;
+    uint64 blocks_chained;
+    uint64 flushes;
+
+    bool jit;       // 0 unless the JIT runs
+    uint64 blocks_compiled;
+    uint64 blocks_rejected;
+    uint32 jit_code_size;
+} engine_statistics;
+
+engine_statistics e8086_engine_statistics(sim8086 *sim);
+
+typedef struct
+{
+    uint64 steps;        // instructions decoded for the group
+    uint64 lane_steps;   // instructions executed summed over the lanes
+    uint64 scalar_steps; // instructions lanes ran on their own simulator
+} lockstep_statistics;
+
+// Added up over every run of the group
+lockstep_statistics e8086_lockstep_statistics(e8086_lockstep *group);
+
+typedef struct
+{
+    uint64 instructions;      // recorded
+    uint32 checkpoint_count;
+    uint64 checkpoint_cycles; // between checkpoints, grows as they are thinned
+    uint64 pages;             // held by all checkpoints
+    uint64 memory_used;       // bytes
+    uint32 thinned;           // times every other checkpoint was merged away
+    uint64 replayed;          // instructions run again to seek
+} recording_statistics;
+
+recording_statistics e8086_recording_statistics(e8086_recording *recording);
+
+#endif
@@ -0,0 +1,98 @@
+/*
+    e8086-trace: prints binary trace files written by e8086 --trace-out.
+
+    Without options the output is the same as e8086 --trace=cycles prints
+    for the run, except for messages the program printed on the way.
+*/
+
+#define E8086_NO_MAIN
+#include "main.c"
+
+int main(int argc, char **argv)
+{
+    char const *filename = 0;
+    trace_level trace = TRACE_CYCLES;
+    int32 low_ip = 0;
+    int32 high_ip = 1 << 16;
+    uint64 from = 0;
+    uint64 count = (uint64) -1;
+
+    for (int arg_index = 1; arg_index < argc; arg_index++)
+    {
+        char const *arg = argv[arg_index];
+        if (strncmp(arg, "--trace=", 8) == 0)
+        {
+            trace = TRACE_NONE;
+            for (uint32 level = 1; level < ARRAY_COUNT(trace_level_names); level++)
+            {
+                if (strcmp(arg + 8, trace_level_names[level]) == 0) trace = level;
+            }
+            if (trace == TRACE_NONE)
+            {
+                printf("Unknown trace level \'%s\'\n", arg + 8);
+                return 1;
+            }
+        }
+        else if (strncmp(arg, "--ip=", 5) == 0)
+        {
+            if (sscanf(arg + 5, "%i:%i", &low_ip, &high_ip) != 2 ||
+                low_ip < 0 || high_ip > (1 << 16) || low_ip >= high_ip)
+            {
+                printf("Bad IP range \'%s\'\n", arg + 5);
+                return 1;
+            }
+        }
+        else if (strncmp(arg, "--from=", 7) == 0) from = strtoull(arg + 7, 0, 0);
+        else if (strncmp(arg, "--count=", 8) == 0) count = strtoull(arg + 8, 0, 0);
+        else filename = arg;
+    }
+
+    if (!filename)
+    {
+        printf("e8086-trace [--trace=instructions|cycles|registers] [--ip=LOW:HIGH]\n"
+               "            [--from=STEP] [--count=N] <trace_file>\n");
+        return 1;
+    }
+
+    trace_file_reader *reader = open_trace_file(filename);
+    if (!reader)
+    {
+        printf("Could not read trace file \'%s\'\n", filename);
+        return 1;
+    }
+
+    // The summary needs the memory, which is only known when every step was read
+    bool whole_run = (from == 0) && (count == (uint64) -1);
+    if (whole_run) printf("; read %u bytes\nbits 16\n", reader->image_size);
+
+    fflush(stdout);
+    trace_output = create_output_buffer(STDOUT_FILENO, TRACE_OUTPUT_SIZE);
+    atexit(flush_trace_output);
+
+    if (from) seek_trace_file(reader, from);
+
+    trace_file_step step;
+    while (count && read_trace_step(reader, &step))
+    {
+        if (step.number < from) continue;
+        count -= 1;
+        if (step.ip < low_ip || step.ip >= high_ip) continue;
+
+        e8086_state before = state_from_trace_state(&step.before);
+        e8086_state after = state_from_trace_state(&step.after);
+        trace_instruction(trace, step.before.cycles, step.instr, &before, &after);
+    }
+
+    flush_trace_output();
+    trace_output = 0;
+
+    if (whole_run)
+    {
+        e8086_state final = state_from_trace_state(&reader->final);
+        printf("Cycles: %llu\n", final.cycles);
+        print_out_registers_state(&final);
+        print_out_memory_state(reader->memory, 999, 1024);
+    }
+    close_trace_file_reader(reader);
+    return 0;
+}
@@ -0,0 +1,112 @@
+/*
+    Hex dumps of memory, as print_out_memory_state prints them.
+
+    A row is the address, the 16 bytes of its paragraph in hex and the
+    same bytes as text, printable ASCII as is and the rest as '.':
+
+        0x00000000000003e0 | 00 01 ... 0f  | ................
+
+    format_memory_row writes a whole row into a buffer. With SSE2, which
+    every x86-64 has, the 16 bytes are turned into hex digits and text
+    with a few vector operations; a row is exactly one register, so wider
+    vectors would not help. Elsewhere the same is done a byte at a time.
+
+    Rows are written in blocks with fwrite. Three or more rows in a row
+    that hold the same bytes are collapsed into the first one, a "*" line
+    and the last one, as xxd -a does, so dumping a mostly zero address
+    space gives a few lines. Two equal rows are both printed, a "*" would
+    not make that shorter.
+*/
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define MEMORY_ROW_LENGTH 89 // "0x" + 16 + " | " + 16 * 3 + " | " + 16 + '\n'
+
+// Writes the row of 16 bytes at `address`, gives its length
+uint32 format_memory_row(char *out, uint32 address, uint8 const *bytes)
+{
+    char const *hex_digits = "0123456789abcdef";
+    out[0] = '0';
+    out[1] = 'x';
+    for (uint32 digit = 0; digit < 16; digit++) out[2 + digit] = hex_digits[((uint64) address >> (60 - 4 * digit)) & 0xf];
+    memcpy(out + 18, " | ", 3);
+
+    char *hex = out + 21;
+    char *text = out + 21 + 48 + 3;
+#if defined(__SSE2__)
+    __m128i values = _mm_loadu_si128((__m128i const *) bytes);
+    __m128i nibble_mask = _mm_set1_epi8(0x0f);
+    __m128i high = _mm_and_si128(_mm_srli_epi16(values, 4), nibble_mask);
+    __m128i low = _mm_and_si128(values, nibble_mask);
+
+    // '0' + n, and 'a' - '0' - 10 more for n > 9
+    __m128i nine = _mm_set1_epi8(9);
+    __m128i letter_offset = _mm_set1_epi8('a' - '0' - 10);
+    __m128i zero = _mm_set1_epi8('0');
+    high = _mm_add_epi8(_mm_add_epi8(high, zero), _mm_and_si128(_mm_cmpgt_epi8(high, nine), letter_offset));
+    low = _mm_add_epi8(_mm_add_epi8(low, zero), _mm_and_si128(_mm_cmpgt_epi8(low, nine), letter_offset));
+
+    // Digit pairs of bytes 0-7 and 8-15, each followed by a space
+    alignas(16) uint16 pairs[16];
+    _mm_store_si128((__m128i *) pairs, _mm_unpacklo_epi8(high, low));
+    _mm_store_si128((__m128i *) (pairs + 8), _mm_unpackhi_epi8(high, low));
+    for (uint32 index = 0; index < 16; index++)
+    {
+        memcpy(hex + 3 * index, pairs + index, 2);
+        hex[3 * index + 2] = ' ';
+    }
+
+    // Signed compares, so bytes from 0x80 up are not printable either
+    __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(values, _mm_set1_epi8(31)),
+                                      _mm_cmplt_epi8(values, _mm_set1_epi8(127)));
+    __m128i dots = _mm_andnot_si128(printable, _mm_set1_epi8('.'));
+    _mm_storeu_si128((__m128i *) text, _mm_or_si128(_mm_and_si128(printable, values), dots));
+#else
+    for (uint32 index = 0; index < 16; index++)
+    {
+        uint8 value = bytes[index];
+        hex[3 * index] = hex_digits[value >> 4];
+        hex[3 * index + 1] = hex_digits[value & 0xf];
+        hex[3 * index + 2] = ' ';
+        text[index] = (value > 31 && value < 127) ? (char) value : '.';
+    }
+#endif
+    memcpy(out + 21 + 48, " | ", 3);
+    out[MEMORY_ROW_LENGTH - 1] = '\n';
+    return MEMORY_ROW_LENGTH;
+}
+
+// Prints the rows that hold memory [low_addr, high_addr)
+void print_out_memory_state(uint8 const *memory, int32 low_addr, int32 high_addr)
+{
+    char buffer[256 * MEMORY_ROW_LENGTH];
+    uint32 used = 0;
+
+    uint32 first_row = (uint32) low_addr & ~15u;
+    uint32 end = (uint32) high_addr;
+    for (uint32 row = first_row; row < end;)
+    {
+        // Rows after this one with the same bytes
+        uint8 const *bytes = memory + row;
+        uint32 last = row;
+        while (last + 16 < end && memcmp(memory + last + 16, bytes, 16) == 0) last += 16;
+
+        if (used + 3 * MEMORY_ROW_LENGTH > sizeof(buffer))
+        {
+            fwrite(buffer, 1, used, stdout);
+            used = 0;
+        }
+        used += format_memory_row(buffer + used, row, bytes);
+        if (last >= row + 32)
+        {
+            memcpy(buffer + used, "*\n", 2);
+            used += 2;
+            used += format_memory_row(buffer + used, last, bytes);
+            row = last + 16;
+        }
+        else row += 16;
+    }
+    fwrite(buffer, 1, used, stdout);
+}
@@ -0,0 +1,149 @@
+/*
+    Instruction statistics (--stats-out): what a program executes and what
+    it costs.
+
+    With E8086_COUNT_STATS (e8086_count), the interpreter counts every
+    instruction it runs by instruction tag, by operand shape (reg/imm,
+    mem/reg, ...) and by the e8086_ea_table entry of its memory operand,
+    each with its base and effective address cycles (count_instruction in
+    e8086.c). The threaded engine and
+    the JIT do not count.
+
+    The counters are written as JSON, one object per line:
+
+        {"cycles":66000,"instructions":6003,"base_cycles":44000,"ea_cycles":22000,
+         "by_instruction":{"MOV":{"count":2003,"base_cycles":...,"ea_cycles":...},...},
+         "by_operands":{"reg/imm":{...},...},
+         "by_ea":{"[bx + si + d8]":{...},...}}
+
+    or as CSV rows of at_cycles,group,name,count,base_cycles,ea_cycles.
+    Counters that stayed 0 are left out. With --stats-every=N a line (or
+    set of rows) is written every N cycles as well as at the end, each
+    with the totals so far. A batch counts per worker thread and writes
+    the sum of all of them once it is done.
+*/
+
+typedef struct
+{
+    FILE *file;
+    bool csv;
+    uint64 every; // cycles between writes, 0 for only at the end
+    uint64 next;  // cycles of the next write
+} stats_export;
+
+char const *operand_tag_names[] = { "none", "imm", "reg", "mem" };
+
+void operand_shape_name(char *name, uint32 shape)
+{
+    uint32 destination = shape / 4;
+    uint32 source = shape % 4;
+    if (source == IOPERAND_NONE) sprintf(name, "%s", operand_tag_names[destination]);
+    else sprintf(name, "%s/%s", operand_tag_names[destination], operand_tag_names[source]);
+}
+
+// "[bx + si + d8]" for the mod 01 entry of bx + si
+void ea_entry_name(char *name, uint32 index)
+{
+    effective_address *ea = &e8086_ea_table[0][0] + index;
+    char const *displacements[] = { "", " + d8", " + d16" };
+    if (ea->reg_count == 0) sprintf(name, "[d16]");
+    else if (ea->reg_count == 1) sprintf(name, "[%s%s]", e8086_register_names[ea->reg1 | 0b1000], displacements[index / 8]);
+    else sprintf(name, "[%s + %s%s]", e8086_register_names[ea->reg1 | 0b1000], e8086_register_names[ea->reg2 | 0b1000],
+        displacements[index / 8]);
+}
+
+void merge_stats(instruction_stats *into, instruction_stats const *from)
+{
+    // Every field is a cycle_counter
+    cycle_counter *a = (cycle_counter *) into;
+    cycle_counter const *b = (cycle_counter const *) from;
+    for (uint32 index = 0; index < sizeof(instruction_stats) / sizeof(cycle_counter); index++)
+    {
+        a[index].count += b[index].count;
+        a[index].cycles += b[index].cycles;
+        a[index].ea_cycles += b[index].ea_cycles;
+    }
+}
+
+void write_stats_group(stats_export *out, uint64 at_cycles, char const *group, char const *name,
+    cycle_counter *counter, bool *first)
+{
+    if (!counter->count) return;
+    if (out->csv)
+    {
+        fprintf(out->file, "%llu,%s,%s,%llu,%llu,%llu\n",
+            at_cycles, group, name, counter->count, counter->cycles, counter->ea_cycles);
+        return;
+    }
+    fprintf(out->file, "%s\"%s\":{\"count\":%llu,\"base_cycles\":%llu,\"ea_cycles\":%llu}",
+        *first ? "" : ",", name, counter->count, counter->cycles, counter->ea_cycles);
+    *first = false;
+}
+
+void write_stats(stats_export *out, instruction_stats *stats)
+{
+    cycle_counter *total = &stats->total;
+    uint64 at_cycles = total->cycles + total->ea_cycles;
+    char name[32];
+    bool first;
+
+    if (out->csv)
+    {
+        fprintf(out->file, "%llu,total,all,%llu,%llu,%llu\n", at_cycles, total->count, total->cycles, total->ea_cycles);
+    }
+    else
+    {
+        fprintf(out->file, "{\"cycles\":%llu,\"instructions\":%llu,\"base_cycles\":%llu,\"ea_cycles\":%llu,"
+            "\"by_instruction\":{", at_cycles, total->count, total->cycles, total->ea_cycles);
+    }
+
+    first = true;
+    for (uint32 tag = 0; tag < ARRAY_COUNT(stats->by_tag); tag++)
+    {
+        write_stats_group(out, at_cycles, "instruction", e8086_instruction_names[tag], stats->by_tag + tag, &first);
+    }
+    if (!out->csv) fprintf(out->file, "},\"by_operands\":{");
+
+    first = true;
+    for (uint32 shape = 0; shape < INSTRUCTION_SHAPE_COUNT; shape++)
+    {
+        operand_shape_name(name, shape);
+        write_stats_group(out, at_cycles, "operands", name, stats->by_shape + shape, &first);
+    }
+    if (!out->csv) fprintf(out->file, "},\"by_ea\":{");
+
+    first = true;
+    for (uint32 index = 0; index < ARRAY_COUNT(stats->by_ea); index++)
+    {
+        ea_entry_name(name, index);
+        write_stats_group(out, at_cycles, "ea", name, stats->by_ea + index, &first);
+    }
+    if (!out->csv) fprintf(out->file, "}}\n");
+}
+
+// Gives 0 if the file cannot be created
+stats_export *open_stats_export(char const *path, bool csv, uint64 every)
+{
+    FILE *file = fopen(path, "w");
+    if (!file) return 0;
+    stats_export *out = calloc(1, sizeof(stats_export));
+    *out = (stats_export) { .file = file, .csv = csv, .every = every, .next = every };
+    if (csv) fprintf(file, "at_cycles,group,name,count,base_cycles,ea_cycles\n");
+    return out;
+}
+
+// Writes the counters if the next --stats-every point has been passed
+void maybe_write_stats(stats_export *out, sim8086 *sim)
+{
+    uint64 cycles = e8086_get_state(sim).cycles;
+    if (cycles < out->next) return;
+    write_stats(out, e8086_instruction_stats(sim));
+    while (out->next <= cycles) out->next += out->every;
+}
+
+bool close_stats_export(stats_export *out)
+{
+    bool ok = (fclose(out->file) == 0);
+    free(out);
+    return ok;
+}
@@ -0,0 +1,627 @@
+/*
+    JIT tier for the threaded engine, Linux x86-64 hosts only.
+
+    Once a block has run jit_threshold times it is compiled to native code
+    in an mmap'd buffer. The buffer is never writable and executable at
+    once: it is made writable while a block is emitted and read-only and
+    executable again before the block runs. While native code runs, guest
+    registers live in host registers:
+
+        ax  r8     sp  r12
+        cx  r9     bp  r13
+        dx  r10    si  r14
+        bx  r11    di  r15
+
+    rbx holds the sim8086 pointer, rdi the guest memory and rsi the code map.
+    Segment registers stay in sim. rax, rcx and rdx are scratch: rax holds
+    physical addresses, rcx source
+    and rdx destination values. Lazy flags and cycles are written to sim the
+    same way execute_instruction does it, and a block that jumps to its own
+    start loops without leaving native code.
+
+    Blocks with anything the compiler does not handle stay on the threaded
+    engine. So does a word operand at offset FFFF, whose high byte is at
+    offset 0: the block stops in front of its instruction and the threaded
+    engine runs the rest.
+*/
+
+#if defined(__linux__) && defined(__x86_64__)
+#define JIT_SUPPORTED 1
+#include <stddef.h>
+#include <sys/mman.h>
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+#define JIT_BUFFER_SIZE (16 << 20)
+#define JIT_MAX_OP_SIZE 256 // no micro-op takes more bytes than that
+
+struct jit_state
+{
+    uint8 *code;
+    uint32 size;
+    uint32 used;
+
+    uint64 blocks_compiled;
+    uint64 blocks_rejected;
+};
+
+#if JIT_SUPPORTED
+
+enum
+{
+    HOST_RAX, HOST_RCX, HOST_RDX, HOST_RBX, HOST_RSP, HOST_RBP, HOST_RSI, HOST_RDI,
+    HOST_R8,  HOST_R9,  HOST_R10, HOST_R11, HOST_R12, HOST_R13, HOST_R14, HOST_R15,
+};
+
+typedef struct
+{
+    uint8 *at;
+
+    uint8 *epilogue;
+    uint8 *body;
+} jit_emitter;
+
+static jit_state *create_jit(void)
+{
+    void *code = mmap(0, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) return 0;
+
+    jit_state *jit = calloc(1, sizeof(jit_state));
+    jit->code = code;
+    jit->size = JIT_BUFFER_SIZE;
+    return jit;
+}
+
+static void jit_reset(jit_state *jit)
+{
+    jit->used = 0;
+}
+
+static void destroy_jit(jit_state *jit)
+{
+    munmap(jit->code, jit->size);
+    free(jit);
+}
+
+static bool set_jit_code_writable(jit_state *jit, bool writable)
+{
+    int protection = writable ? (PROT_READ | PROT_WRITE) : (PROT_READ | PROT_EXEC);
+    return mprotect(jit->code, jit->size, protection) == 0;
+}
+
+static void emit8(jit_emitter *e, uint8 value) { *e->at++ = value; }
+static void emit16(jit_emitter *e, uint16 value) { memcpy(e->at, &value, 2); e->at += 2; }
+static void emit32(jit_emitter *e, uint32 value) { memcpy(e->at, &value, 4); e->at += 4; }
+static void emit64(jit_emitter *e, uint64 value) { memcpy(e->at, &value, 8); e->at += 8; }
+
+static void emit_rel32_to(jit_emitter *e, uint8 *target)
+{
+    emit32(e, (uint32) (target - (e->at + 4)));
+}
+
+// Host register holding a guest register, for R_AH..R_BH it is the register
+// with the byte in bits 8..15
+static int32 host_register(int32 reg)
+{
+    if (reg < R_AX) return HOST_R8 + (reg & 0b11);
+    return HOST_R8 + (reg & 0b111);
+}
+
+static uint32 guest_register_offset(int32 reg)
+{
+    return offsetof(sim8086, rs.words) + register_offsets[reg | 0b1000];
+}
+
+// movzx host32, word [rbx + offset]
+static void emit_load_guest_register(jit_emitter *e, int32 reg)
+{
+    int32 host = host_register(reg);
+    emit8(e, 0x44);
+    emit8(e, 0x0F); emit8(e, 0xB7);
+    emit8(e, 0x80 | ((host & 7) << 3) | HOST_RBX);
+    emit32(e, guest_register_offset(reg));
+}
+
+// mov word [rbx + offset], host16
+static void emit_store_guest_register(jit_emitter *e, int32 reg)
+{
+    int32 host = host_register(reg);
+    emit8(e, 0x66); emit8(e, 0x44);
+    emit8(e, 0x89);
+    emit8(e, 0x80 | ((host & 7) << 3) | HOST_RBX);
+    emit32(e, guest_register_offset(reg));
+}
+
+// add qword [rbx + offset], imm32 (sign extended)
+static void emit_add_sim_qword(jit_emitter *e, uint32 offset, int32 value)
+{
+    emit8(e, 0x48); emit8(e, 0x81); emit8(e, 0x83);
+    emit32(e, offset);
+    emit32(e, value);
+}
+
+// mov dword [rbx + offset], imm32
+static void emit_store_sim_dword(jit_emitter *e, uint32 offset, int32 value)
+{
+    emit8(e, 0xC7); emit8(e, 0x83);
+    emit32(e, offset);
+    emit32(e, value);
+}
+
+// mov word [rbx + offset], imm16
+static void emit_store_sim_word(jit_emitter *e, uint32 offset, uint16 value)
+{
+    emit8(e, 0x66); emit8(e, 0xC7); emit8(e, 0x83);
+    emit32(e, offset);
+    emit16(e, value);
+}
+
+// Leaves the block with IP at `ip`, `cycles` being what ran since the last
+// exit point. The block gives `stopped`, see native_block_proc.
+static void emit_leave(jit_emitter *e, uint16 ip, int32 cycles, bool stopped)
+{
+    if (cycles) emit_add_sim_qword(e, offsetof(sim8086, cycles), cycles);
+    emit_store_sim_word(e, offsetof(sim8086, rs.ip), ip);
+    emit8(e, 0xB8); emit32(e, stopped);         // mov eax, stopped
+    emit8(e, 0xE9); emit_rel32_to(e, e->epilogue);
+}
+
+static void emit_exit(jit_emitter *e, uint16 next_ip, int32 cycles)
+{
+    emit_leave(e, next_ip, cycles, false);
+}
+
+static void emit_prologue_and_epilogue(jit_emitter *e)
+{
+    emit8(e, 0x53);                             // push rbx
+    emit8(e, 0x41); emit8(e, 0x54);             // push r12
+    emit8(e, 0x41); emit8(e, 0x55);             // push r13
+    emit8(e, 0x41); emit8(e, 0x56);             // push r14
+    emit8(e, 0x41); emit8(e, 0x57);             // push r15
+    emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xFB); // mov rbx, rdi
+    emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xF7); // mov rdi, rsi
+    emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xD6); // mov rsi, rdx
+    for (int32 reg = R_AX; reg <= R_DI; reg++) emit_load_guest_register(e, reg);
+
+    emit8(e, 0xE9);                             // jmp body
+    uint8 *jump_to_body = e->at;
+    emit32(e, 0);
+
+    e->epilogue = e->at;
+    for (int32 reg = R_AX; reg <= R_DI; reg++) emit_store_guest_register(e, reg);
+    emit8(e, 0x41); emit8(e, 0x5F);             // pop r15
+    emit8(e, 0x41); emit8(e, 0x5E);             // pop r14
+    emit8(e, 0x41); emit8(e, 0x5D);             // pop r13
+    emit8(e, 0x41); emit8(e, 0x5C);             // pop r12
+    emit8(e, 0x5B);                             // pop rbx
+    emit8(e, 0xC3);                             // ret
+
+    e->body = e->at;
+    uint32 rel = (uint32) (e->body - (jump_to_body + 4));
+    memcpy(jump_to_body, &rel, 4);
+}
+
+// eax = (segment * 16 + (uint16) (displacement + base1 + base2)) & MEMORY_ADDRESS_MASK
+// A word at offset FFFF is not in one piece, the block stops in front of
+// the instruction at `ip` for the threaded engine to run it.
+static void emit_effective_address(jit_emitter *e, effective_address ea, int32 w, uint16 ip, int32 cycles)
+{
+    emit8(e, 0xB8); emit32(e, ea.displacement); // mov eax, imm32
+    if (ea.reg_count > 0)
+    {
+        emit8(e, 0x44); emit8(e, 0x01);         // add eax, base1
+        emit8(e, 0xC0 | ((host_register(ea.reg1) & 7) << 3));
+    }
+    if (ea.reg_count > 1)
+    {
+        emit8(e, 0x44); emit8(e, 0x01);         // add eax, base2
+        emit8(e, 0xC0 | ((host_register(ea.reg2) & 7) << 3));
+    }
+    emit8(e, 0x0F); emit8(e, 0xB7); emit8(e, 0xC0); // movzx eax, ax
+    if (w)
+    {
+        emit8(e, 0x3D); emit32(e, 0xFFFF);          // cmp eax, 0xFFFF
+        emit8(e, 0x75);                             // jne whole
+        uint8 *whole = e->at;
+        emit8(e, 0);
+        emit_leave(e, ip, cycles, true);
+        *whole = (uint8) (e->at - (whole + 1));
+    }
+    emit8(e, 0x0F); emit8(e, 0xB7); emit8(e, 0x93); // movzx edx, word [rbx + segment]
+    emit32(e, offsetof(sim8086, rs.segments) + ea.segment * 2);
+    emit8(e, 0xC1); emit8(e, 0xE2); emit8(e, 4);    // shl edx, 4
+    emit8(e, 0x01); emit8(e, 0xD0);                 // add eax, edx
+    emit8(e, 0x25); emit32(e, MEMORY_ADDRESS_MASK); // and eax, MEMORY_ADDRESS_MASK
+}
+
+// ecx = source value, low 8 or 16 bits are what the operation uses
+static void emit_load_source(jit_emitter *e, instruction_operand source, int32 w)
+{
+    switch (source.tag)
+    {
+    case IOP_REG:
+    {
+        int32 host = host_register(source.reg);
+        emit8(e, 0x44); emit8(e, 0x89);         // mov ecx, host32
+        emit8(e, 0xC0 | ((host & 7) << 3) | HOST_RCX);
+        if (!w && (source.reg & 0b100))
+        {
+            emit8(e, 0xC1); emit8(e, 0xE9); emit8(e, 8); // shr ecx, 8
+        }
+    } break;
+
+    case IOP_IMM:
+        emit8(e, 0xB9); emit32(e, source.imm);  // mov ecx, imm32
+        break;
+
+    case IOP_MEM:
+        // movzx ecx, word/byte [rdi + rax]
+        emit8(e, 0x0F); emit8(e, w ? 0xB7 : 0xB6); emit8(e, 0x0C); emit8(e, 0x07);
+        break;
+
+    default: break;
+    }
+}
+
+// Opcode of `op r/m8, r8`; the 16-bit form is the next opcode
+static uint8 host_alu_opcode(instruction_tag tag)
+{
+    switch (tag)
+    {
+    case I_ADD: return 0x00;
+    case I_SUB: return 0x28;
+    case I_CMP: return 0x38;
+    default:    return 0x88; // I_MOV
+    }
+}
+
+// ror host16, 8 swaps the bytes, so the high byte can be used as host8
+static void emit_swap_bytes(jit_emitter *e, int32 host)
+{
+    emit8(e, 0x66); emit8(e, 0x41); emit8(e, 0xC1);
+    emit8(e, 0xC8 | (host & 7)); emit8(e, 8);
+}
+
+// mov word [rbx + offset], dx/cx
+static void emit_store_sim_word_register(jit_emitter *e, uint32 offset, int32 host)
+{
+    emit8(e, 0x66); emit8(e, 0x89);
+    emit8(e, 0x80 | (host << 3) | HOST_RBX);
+    emit32(e, offset);
+}
+
+// Records the operation for lazy flags: edx holds the destination and
+// ecx the source operand, both zero-extended from the operation width.
+static void emit_record_flags(jit_emitter *e, uint16 flags_op, int32 w)
+{
+    emit_store_sim_word(e, offsetof(sim8086, rs.lazy.op), flags_op);
+    emit_store_sim_word(e, offsetof(sim8086, rs.lazy.w), w);
+    emit_store_sim_word_register(e, offsetof(sim8086, rs.lazy.dst), HOST_RDX);
+    emit_store_sim_word_register(e, offsetof(sim8086, rs.lazy.src), HOST_RCX);
+}
+
+// mov byte [rbx + dirty_pages + (eax >> MEMORY_PAGE_SHIFT)], 1
+static void emit_mark_dirty_page(jit_emitter *e)
+{
+    emit8(e, 0x89); emit8(e, 0xC2);                     // mov edx, eax
+    emit8(e, 0xC1); emit8(e, 0xEA); emit8(e, MEMORY_PAGE_SHIFT); // shr edx, MEMORY_PAGE_SHIFT
+    emit8(e, 0xC6); emit8(e, 0x84); emit8(e, 0x13);     // mov byte [rbx + rdx + offset], 1
+    emit32(e, offsetof(sim8086, dirty_pages));
+    emit8(e, 1);
+}
+
+// Same bookkeeping as memory_written does for translated code: marks the
+// written pages dirty and leaves the block right after the write if it
+// touched any translated byte. The high byte of a word at FFFFF is at 0.
+static void emit_code_write_check(jit_emitter *e, int32 w, uint16 next_ip, int32 cycles)
+{
+    emit_mark_dirty_page(e);
+    emit8(e, 0x8A); emit8(e, 0x0C); emit8(e, 0x06);     // mov cl, [rsi + rax]
+    if (w)
+    {
+        emit8(e, 0xFF); emit8(e, 0xC0);                 // inc eax
+        emit8(e, 0x25); emit32(e, MEMORY_ADDRESS_MASK); // and eax, MEMORY_ADDRESS_MASK
+        emit_mark_dirty_page(e);
+        emit8(e, 0x0A); emit8(e, 0x0C); emit8(e, 0x06); // or cl, [rsi + rax]
+    }
+    emit8(e, 0x84); emit8(e, 0xC9);                     // test cl, cl
+    emit8(e, 0x74);                                     // jz continue
+    uint8 *skip = e->at;
+    emit8(e, 0);
+
+    emit_store_sim_dword(e, offsetof(sim8086, code_modified), true);
+    emit_exit(e, next_ip, cycles);
+
+    *skip = (uint8) (e->at - (skip + 1));
+}
+
+// Segment registers have no host register, moves of them stay threaded
+static bool jit_can_compile_op(micro_op *op)
+{
+    instruction *i = &op->instr;
+    if (i->destination.tag == IOP_REG && i->destination.reg >= R_ES) return false;
+    if (i->source.tag == IOP_REG && i->source.reg >= R_ES) return false;
+    return op->kind != MOP_INTERPRET;
+}
+
+// edx = destination value, zero-extended from the operation width
+static void emit_load_destination(jit_emitter *e, instruction_operand destination, int32 w)
+{
+    if (destination.tag == IOP_REG)
+    {
+        int32 host = host_register(destination.reg);
+        emit8(e, 0x44); emit8(e, 0x89);                     // mov edx, host32
+        emit8(e, 0xC0 | ((host & 7) << 3) | HOST_RDX);
+        if (!w && (destination.reg & 0b100))
+        {
+            emit8(e, 0xC1); emit8(e, 0xEA); emit8(e, 8);    // shr edx, 8
+        }
+        if (!w)
+        {
+            emit8(e, 0x0F); emit8(e, 0xB6); emit8(e, 0xD2); // movzx edx, dl
+        }
+    }
+    else
+    {
+        // movzx edx, word/byte [rdi + rax]
+        emit8(e, 0x0F); emit8(e, w ? 0xB7 : 0xB6); emit8(e, 0x14); emit8(e, 0x07);
+    }
+}
+
+// Writes the low 8 or 16 bits of `host_source` (rcx or rdx) to the destination
+static void emit_store_destination(jit_emitter *e, instruction_operand destination, int32 w, int32 host_source)
+{
+    uint8 opcode = w ? 0x89 : 0x88;
+    if (destination.tag == IOP_REG)
+    {
+        int32 host = host_register(destination.reg);
+        bool high_byte = !w && (destination.reg & 0b100);
+
+        if (high_byte) emit_swap_bytes(e, host);
+        if (w) emit8(e, 0x66);
+        emit8(e, 0x41); emit8(e, opcode);                   // mov host, source
+        emit8(e, 0xC0 | (host_source << 3) | (host & 7));
+        if (high_byte) emit_swap_bytes(e, host);
+    }
+    else
+    {
+        if (w) emit8(e, 0x66);
+        emit8(e, opcode);                                   // mov [rdi + rax], source
+        emit8(e, 0x04 | (host_source << 3)); emit8(e, 0x07);
+    }
+}
+
+// `ip` is where the instruction starts, `cycles` what ran since the last
+// exit point with the instruction itself
+static void emit_alu_op(jit_emitter *e, micro_op *op, uint16 ip, int32 cycles)
+{
+    instruction *i = &op->instr;
+    int32 w = i->w;
+
+    int32 cycles_before = cycles - op->cycles;
+    if (i->destination.tag == IOP_MEM) emit_effective_address(e, i->destination.addr, w, ip, cycles_before);
+    if (i->source.tag == IOP_MEM) emit_effective_address(e, i->source.addr, w, ip, cycles_before);
+    emit_load_source(e, i->source, w);
+
+    if (i->tag == I_MOV)
+    {
+        emit_store_destination(e, i->destination, w, HOST_RCX);
+    }
+    else
+    {
+        if (!w)
+        {
+            emit8(e, 0x0F); emit8(e, 0xB6); emit8(e, 0xC9);  // movzx ecx, cl
+        }
+        emit_load_destination(e, i->destination, w);
+
+        uint16 flags_op = (i->tag == I_ADD) ? FLAGS_OP_ADD : FLAGS_OP_SUB;
+        emit_record_flags(e, flags_op, w);
+
+        if (w) emit8(e, 0x66);
+        emit8(e, host_alu_opcode(i->tag == I_CMP ? I_SUB : i->tag) + (w ? 1 : 0));
+        emit8(e, 0xC0 | (HOST_RCX << 3) | HOST_RDX);         // add/sub dx, cx
+        emit_store_sim_word_register(e, offsetof(sim8086, rs.lazy.result), HOST_RDX);
+
+        if (i->tag != I_CMP) emit_store_destination(e, i->destination, w, HOST_RDX);
+    }
+
+    if (i->destination.tag == IOP_MEM && i->tag != I_CMP)
+    {
+        emit_code_write_check(e, w, op->next_ip, cycles);
+    }
+}
+
+// 8086 conditional jumps use the same condition encoding as x86 Jcc
+static uint8 jump_condition_code(instruction_tag tag)
+{
+    switch (tag)
+    {
+    case I_JE:   return OPCODE_JE & 0x0F;
+    case I_JL:   return OPCODE_JL & 0x0F;
+    case I_JLE:  return OPCODE_JLE & 0x0F;
+    case I_JB:   return OPCODE_JB & 0x0F;
+    case I_JBE:  return OPCODE_JBE & 0x0F;
+    case I_JP:   return OPCODE_JP & 0x0F;
+    case I_JO:   return OPCODE_JO & 0x0F;
+    case I_JS:   return OPCODE_JS & 0x0F;
+    case I_JNE:  return OPCODE_JNE & 0x0F;
+    case I_JNL:  return OPCODE_JNL & 0x0F;
+    case I_JNLE: return OPCODE_JNLE & 0x0F;
+    case I_JNB:  return OPCODE_JNB & 0x0F;
+    case I_JNBE: return OPCODE_JNBE & 0x0F;
+    case I_JNP:  return OPCODE_JNP & 0x0F;
+    case I_JNO:  return OPCODE_JNO & 0x0F;
+    default:     return OPCODE_JNS & 0x0F;
+    }
+}
+
+// Branch counters do not move while the program runs, so their addresses
+// are baked into the code. Nothing is emitted when branches are not counted.
+static void emit_count_branch(jit_emitter *e, sim8086 *sim, uint16 address, bool taken)
+{
+    if (!sim->branches) return;
+    branch_counter *counter = sim->branches + address;
+    uint64 *count = taken ? &counter->taken : &counter->not_taken;
+    emit8(e, 0x48); emit8(e, 0xB8); emit64(e, (uint64) count); // mov rax, count
+    emit8(e, 0x48); emit8(e, 0xFF); emit8(e, 0x00);           // inc qword [rax]
+}
+
+// flags_op and flags_w describe the flag-setting operation before the branch
+// in this block. For conditional jumps it is repeated on the recorded
+// operands, which leaves the host flags exactly as the guest ones, and the
+// host Jcc does the rest.
+static void emit_branch(jit_emitter *e, sim8086 *sim, block *b, micro_op *op,
+                 uint16 flags_op, int32 flags_w, int32 cycles)
+{
+    instruction_tag tag = op->instr.tag;
+    uint8 jump_taken = 0;
+    uint8 *not_taken = 0; // LOOPZ and LOOPNZ leave early when CX reaches 0
+
+    switch (tag)
+    {
+    case I_LOOP:
+    case I_LOOPZ:
+    case I_LOOPNZ:
+        emit8(e, 0x66); emit8(e, 0x41); emit8(e, 0x83);         // sub cx, 1
+        emit8(e, 0xE8 | (HOST_R9 & 7)); emit8(e, 1);
+        if (tag == I_LOOP)
+        {
+            jump_taken = 0x85;                                   // jnz
+            break;
+        }
+        emit8(e, 0x0F); emit8(e, 0x84);                         // jz not taken
+        not_taken = e->at;
+        emit32(e, 0);
+        emit8(e, 0x66); emit8(e, 0x83); emit8(e, 0xBB);         // cmp word [rbx + result], 0
+        emit32(e, offsetof(sim8086, rs.lazy.result)); emit8(e, 0);
+        jump_taken = (tag == I_LOOPZ) ? 0x84 : 0x85;             // je/jne
+        break;
+
+    case I_JCXZ:
+        emit8(e, 0x66); emit8(e, 0x45); emit8(e, 0x85);         // test cx, cx
+        emit8(e, 0xC0 | ((HOST_R9 & 7) << 3) | (HOST_R9 & 7));
+        jump_taken = 0x84;                                       // jz
+        break;
+
+    default:
+    {
+        emit8(e, 0x0F); emit8(e, 0xB7); emit8(e, 0x93);         // movzx edx, word [rbx + dst]
+        emit32(e, offsetof(sim8086, rs.lazy.dst));
+        if (flags_w) emit8(e, 0x66);
+        uint8 opcode = (flags_op == FLAGS_OP_ADD) ? 0x02 : 0x2A; // add/sub dx/dl, [rbx + src]
+        emit8(e, opcode + (flags_w ? 1 : 0)); emit8(e, 0x93);
+        emit32(e, offsetof(sim8086, rs.lazy.src));
+        jump_taken = 0x80 | jump_condition_code(tag);
+    } break;
+    }
+
+    emit8(e, 0x0F); emit8(e, jump_taken);
+    uint8 *taken = e->at;
+    emit32(e, 0);
+
+    uint16 address = op->next_ip - 2;
+    if (not_taken)
+    {
+        uint32 rel = (uint32) (e->at - (not_taken + 4));
+        memcpy(not_taken, &rel, 4);
+    }
+    emit_count_branch(e, sim, address, false);
+    emit_exit(e, op->next_ip, cycles + branch_cycles(tag, false));
+
+    uint32 rel = (uint32) (e->at - (taken + 4));
+    memcpy(taken, &rel, 4);
+    emit_count_branch(e, sim, address, true);
+    if (op->target_ip == b->start_ip)
+    {
+        // Loop back into this block without leaving native code
+        emit_add_sim_qword(e, offsetof(sim8086, cycles), cycles + branch_cycles(tag, true));
+        emit8(e, 0xE9); emit_rel32_to(e, e->body);
+    }
+    else
+    {
+        emit_exit(e, op->target_ip, cycles + branch_cycles(tag, true));
+    }
+}
+
+static native_block_proc jit_compile_block(jit_state *jit, sim8086 *sim, block *b)
+{
+    // Branches that test flags are only compiled when the flags come
+    // from an operation in the same block, so the width is known here.
+    bool flags_known = false;
+    for (uint32 op_index = 0; op_index < b->op_count; op_index++)
+    {
+        micro_op *op = b->ops + op_index;
+        bool tests_flags = is_branch_kind(op->kind) && op->kind != MOP_LOOP && op->kind != MOP_JCXZ;
+        if (!jit_can_compile_op(op) || (tests_flags && !flags_known))
+        {
+            jit->blocks_rejected += 1;
+            return 0;
+        }
+        if (op->kind != MOP_END && !is_branch_kind(op->kind) && op->instr.tag != I_MOV) flags_known = true;
+    }
+
+    uint32 worst_case = (b->op_count + 2) * JIT_MAX_OP_SIZE;
+    if (jit->used + worst_case > jit->size || !set_jit_code_writable(jit, true))
+    {
+        jit->blocks_rejected += 1;
+        return 0;
+    }
+
+    jit_emitter e = { .at = jit->code + jit->used };
+    uint8 *start = e.at;
+
+    emit_prologue_and_epilogue(&e);
+
+    // Cycles are added to sim->cycles only when the block is left
+    int32 cycles = 0;
+    uint16 flags_op = FLAGS_OP_NONE;
+    int32 flags_w = 0;
+    uint16 ip = b->start_ip;
+    for (uint32 op_index = 0; op_index < b->op_count; op_index++)
+    {
+        micro_op *op = b->ops + op_index;
+        switch (op->kind)
+        {
+        case MOP_END:
+            emit_exit(&e, op->next_ip, cycles);
+            break;
+
+        default:
+            if (is_branch_kind(op->kind))
+            {
+                emit_branch(&e, sim, b, op, flags_op, flags_w, cycles);
+                break;
+            }
+            cycles += op->cycles;
+            emit_alu_op(&e, op, ip, cycles);
+            if (op->instr.tag != I_MOV)
+            {
+                flags_op = (op->instr.tag == I_ADD) ? FLAGS_OP_ADD : FLAGS_OP_SUB;
+                flags_w = op->instr.w;
+            }
+            break;
+        }
+        ip = op->next_ip;
+    }
+
+    if (!set_jit_code_writable(jit, false))
+    {
+        jit->blocks_rejected += 1;
+        return 0;
+    }
+    jit->used += (uint32) (e.at - start);
+    jit->blocks_compiled += 1;
+    return (native_block_proc) start;
+}
+
+#else
+
+static jit_state *create_jit(void) { return 0; }
+static void jit_reset(jit_state *jit) {}
+static void destroy_jit(jit_state *jit) {}
+static native_block_proc jit_compile_block(jit_state *jit, sim8086 *sim, block *b) { return 0; }
+
+#endif // JIT_SUPPORTED
@@ -0,0 +1,773 @@
+/*
+    Lockstep groups: one program, up to LOCKSTEP_LANES instances of it.
+
+    Differential fuzzing runs the same short program from thousands of
+    starting states. A group keeps the registers of its lanes as arrays,
+    words[register][lane], decodes an instruction once and runs it for
+    every lane at that IP with plain loops over the lanes. What a group
+    saves is decoding and dispatch, once per step instead of once per
+    lane. Lanes take part in a step through a mask. Each step runs
+    the lanes with the lowest IP, so lanes that took the other way at a
+    branch wait for the rest to catch up and the group comes back together
+    after loops and forward branches.
+
+    Every lane ends exactly as e8086_run_until leaves a scalar simulator,
+    lazy flags and errors included. While all lanes hold the same code,
+    decoded instructions are cached by IP. A write into the loaded image
+    drops the cache, and from then on a lane only runs with the others
+    when its instruction bytes match those of the lane that decoded them.
+
+    Lanes have the first 64 KiB of memory only and their segment registers
+    are 0. A lane that gets to an instruction the group cannot run (one
+    with a segment register operand, or a string instruction, whose
+    repeats would take every lane a different number of cycles) leaves
+    the group: its registers and memory go into a sim8086 of its own,
+    which runs it to the end. So does a lane given segment registers other
+    than 0. Such a lane ends the same as any other, only slower.
+*/
+
+#define LOCKSTEP_LANES E8086_LOCKSTEP_LANES
+
+// The segment at 0 every lane runs in
+#define LOCKSTEP_LANE_MEMORY (1 << 16)
+
+typedef struct
+{
+    instruction instr;
+    uint8 length; // 0 if not decoded yet
+} lockstep_entry;
+
+struct e8086_lockstep
+{
+    // Registers of every lane, words in the order of registers.words
+    alignas(32) uint16 words[8][LOCKSTEP_LANES];
+    alignas(32) uint16 ip[LOCKSTEP_LANES];
+    alignas(32) uint16 flags[LOCKSTEP_LANES];
+    alignas(32) uint16 lazy_op[LOCKSTEP_LANES];
+    alignas(32) uint16 lazy_w[LOCKSTEP_LANES];
+    alignas(32) uint16 lazy_dst[LOCKSTEP_LANES];
+    alignas(32) uint16 lazy_src[LOCKSTEP_LANES];
+    alignas(32) uint16 lazy_result[LOCKSTEP_LANES];
+    alignas(32) uint64 cycles[LOCKSTEP_LANES];
+
+    alignas(32) uint16 running[LOCKSTEP_LANES]; // 0xffff until the lane stops
+    e8086_status status[LOCKSTEP_LANES];
+    uint32 lane_count;
+
+    uint8 *memory; // LOCKSTEP_LANE_MEMORY bytes for every lane
+    uint32 image_size;
+
+    lockstep_entry *decoded; // by IP, image_size entries
+    bool code_shared;        // every lane has the same image, decoded can be used
+    sim8086 decoder;         // memory points at the lane that decodes
+
+    // Lanes that left the group run on a simulator of their own, created
+    // the first time a lane needs one and kept for later runs
+    uint16 on_scalar[LOCKSTEP_LANES];
+    sim8086 *scalar[LOCKSTEP_LANES];
+
+    uint64 steps;        // instructions decoded for the group
+    uint64 lane_steps;   // instructions executed summed over the lanes
+    uint64 scalar_steps; // instructions lanes ran on their own simulator
+};
+
+static uint8 *lockstep_lane_memory(e8086_lockstep *group, uint32 lane)
+{
+    return group->memory + (uint64) lane * LOCKSTEP_LANE_MEMORY;
+}
+
+// A word at 0xFFFF takes its high byte from 0, as in sim8086
+static uint16 lockstep_read_word(uint8 const *memory, uint16 address)
+{
+    return (uint16) (memory[address] | (memory[(uint16) (address + 1)] << 8));
+}
+
+static void lockstep_write_word(uint8 *memory, uint16 address, uint16 value)
+{
+    memory[address] = (uint8) value;
+    memory[(uint16) (address + 1)] = (uint8) (value >> 8);
+}
+
+// Scalar view of a lane, for the flag and branch code of the interpreter
+static registers lockstep_lane_registers(e8086_lockstep *group, uint32 lane)
+{
+    registers rs = {};
+    for (uint32 reg = 0; reg < 8; reg++) rs.words[reg] = group->words[reg][lane];
+    rs.ip = group->ip[lane];
+    rs.flags = group->flags[lane];
+    rs.lazy = (lazy_flags)
+    {
+        .op = group->lazy_op[lane], .w = group->lazy_w[lane],
+        .dst = group->lazy_dst[lane], .src = group->lazy_src[lane], .result = group->lazy_result[lane],
+    };
+    return rs;
+}
+
+static void lockstep_stop_lanes(e8086_lockstep *group, uint16 *lanes, e8086_status status)
+{
+    for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        if (!lanes[lane]) continue;
+        group->status[lane] = status;
+        group->running[lane] = 0;
+    }
+}
+
+// Moves a lane out of the group into its own simulator, which
+// e8086_lockstep_run_until runs on from the instruction at the lane's IP
+static void lockstep_move_to_scalar(e8086_lockstep *group, uint32 lane)
+{
+    sim8086 *sim = group->scalar[lane];
+    if (!sim)
+    {
+        sim = e8086_create();
+        if (!sim) return;
+        group->scalar[lane] = sim;
+    }
+    // Not a guest write: the reset left no cached code to drop. Most of a
+    // lane is zero, only the pages that hold something are copied.
+    e8086_reset(sim);
+    uint8 const *memory = lockstep_lane_memory(group, lane);
+    for (uint32 address = 0; address < LOCKSTEP_LANE_MEMORY; address += MEMORY_PAGE_SIZE)
+    {
+        if (memcmp(memory + address, zero_page, MEMORY_PAGE_SIZE) == 0) continue;
+        memcpy(sim->memory + address, memory + address, MEMORY_PAGE_SIZE);
+        mark_dirty_pages(sim, address, MEMORY_PAGE_SIZE);
+    }
+    sim->image_size = group->image_size;
+    sim->rs = lockstep_lane_registers(group, lane);
+    sim->cycles = group->cycles[lane];
+    set_code_segment(sim);
+    group->on_scalar[lane] = 0xffff;
+}
+
+// Lanes at an instruction the group cannot run leave it, see lockstep_move_to_scalar
+static void lockstep_leave_group(e8086_lockstep *group, uint16 *lanes)
+{
+    for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        if (!lanes[lane]) continue;
+        lockstep_move_to_scalar(group, lane);
+        group->running[lane] = 0;
+        // Only when the host has no memory for another simulator
+        if (!group->on_scalar[lane]) group->status[lane] = E8086_ERROR_UNSUPPORTED_INSTRUCTION;
+    }
+}
+
+// Segments are 0 in every lane, so the physical address is the offset
+static void lockstep_effective_addresses(e8086_lockstep *group, effective_address ea, uint16 *address)
+{
+    uint16 *reg1 = group->words[ea.reg1 & 0b111];
+    uint16 *reg2 = group->words[ea.reg2 & 0b111];
+    for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        // Effective addresses wrap around at 64 KiB.
+        uint16 base = 0;
+        if (ea.reg_count > 0) base += reg1[lane];
+        if (ea.reg_count > 1) base += reg2[lane];
+        address[lane] = (uint16) (ea.displacement + base);
+    }
+}
+
+static void lockstep_read_operand(e8086_lockstep *group, instruction_operand *op, int32 w, uint16 *value, uint16 *address)
+{
+    switch (op->tag)
+    {
+    case IOP_IMM:
+    {
+        uint16 imm = w ? (uint16) op->imm : (uint8) op->imm;
+        for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++) value[lane] = imm;
+    } break;
+
+    case IOP_REG:
+    {
+        uint16 *word = group->words[op->reg_offset >> 1];
+        if (w) for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++) value[lane] = word[lane];
+        else if (op->reg_offset & 1) for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++) value[lane] = word[lane] >> 8;
+        else for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++) value[lane] = word[lane] & 0xff;
+    } break;
+
+    case IOP_MEM:
+    {
+        lockstep_effective_addresses(group, op->addr, address);
+        for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+        {
+            uint8 *m = lockstep_lane_memory(group, lane);
+            value[lane] = w ? lockstep_read_word(m, address[lane]) : m[address[lane]];
+        }
+    } break;
+
+    default: break;
+    }
+}
+
+static void lockstep_write_operand(e8086_lockstep *group, instruction_operand *op, int32 w,
+    uint16 *value, uint16 *address, uint16 *active)
+{
+    if (op->tag == IOP_REG)
+    {
+        uint16 *word = group->words[op->reg_offset >> 1];
+        uint16 keep = w ? 0 : (op->reg_offset & 1) ? 0x00ff : 0xff00;
+        uint32 shift = (!w && (op->reg_offset & 1)) ? 8 : 0;
+        for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+        {
+            uint16 result = (word[lane] & keep) | (uint16) (value[lane] << shift);
+            word[lane] = (result & active[lane]) | (word[lane] & ~active[lane]);
+        }
+    }
+    else if (op->tag == IOP_MEM)
+    {
+        for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+        {
+            if (!active[lane]) continue;
+            uint8 *m = lockstep_lane_memory(group, lane);
+            if (w) lockstep_write_word(m, address[lane], value[lane]);
+            else m[address[lane]] = (uint8) value[lane];
+
+            // Lanes may now run different code
+            if (address[lane] < group->image_size || (w && (uint16) (address[lane] + 1) < group->image_size))
+            {
+                group->code_shared = false;
+            }
+        }
+    }
+}
+
+// Pushes value[lane] in the lanes in `active`. Segments are 0, so the stack is at SP.
+static void lockstep_push(e8086_lockstep *group, uint16 *value, uint16 *active)
+{
+    uint16 *sp = group->words[R_SP & 0b111];
+    for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        if (!active[lane]) continue;
+        sp[lane] -= 2;
+        lockstep_write_word(lockstep_lane_memory(group, lane), sp[lane], value[lane]);
+        if (sp[lane] < group->image_size || (uint16) (sp[lane] + 1) < group->image_size) group->code_shared = false;
+    }
+}
+
+static void lockstep_pop(e8086_lockstep *group, uint16 *value, uint16 *active)
+{
+    uint16 *sp = group->words[R_SP & 0b111];
+    for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        value[lane] = lockstep_read_word(lockstep_lane_memory(group, lane), sp[lane]);
+        sp[lane] += active[lane] & 2;
+    }
+}
+
+// Flags of every lane, 0xffff where set, as flag_zf and the others derive them
+static void lockstep_flags(e8086_lockstep *group, uint16 *zf, uint16 *sf, uint16 *cf, uint16 *of)
+{
+    for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        uint16 op = group->lazy_op[lane];
+        uint16 flags = group->flags[lane];
+        uint16 dst = group->lazy_dst[lane];
+        uint16 src = group->lazy_src[lane];
+        uint16 result = group->lazy_result[lane];
+        uint16 sign = group->lazy_w[lane] ? 0x8000 : 0x80;
+
+        bool none = (op == FLAGS_OP_NONE);
+        bool add = (op == FLAGS_OP_ADD);
+        bool sub = (op == FLAGS_OP_SUB);
+        bool z = none ? (flags & FLAG_ZF) != 0 : result == 0;
+        bool s = none ? (flags & FLAG_SF) != 0 : (result & sign) != 0;
+        bool c = add ? result < dst : sub ? dst < src : (flags & FLAG_CF) != 0;
+        bool o = add ? ((dst ^ result) & (src ^ result) & sign) != 0
+               : sub ? ((dst ^ src) & (dst ^ result) & sign) != 0
+               : (flags & FLAG_OF) != 0;
+        zf[lane] = -(uint16) z;
+        sf[lane] = -(uint16) s;
+        cf[lane] = -(uint16) c;
+        of[lane] = -(uint16) o;
+    }
+}
+
+// Same decisions and timing as evaluate_branch and branch_cycles, for all lanes at once
+static void lockstep_branch(e8086_lockstep *group, instruction *instr, uint16 *active)
+{
+    alignas(32) uint16 zf[LOCKSTEP_LANES];
+    alignas(32) uint16 sf[LOCKSTEP_LANES];
+    alignas(32) uint16 cf[LOCKSTEP_LANES];
+    alignas(32) uint16 of[LOCKSTEP_LANES];
+    alignas(32) uint16 taken[LOCKSTEP_LANES];
+    uint16 *cx = group->words[1];
+    instruction_tag tag = instr->tag;
+
+    if (tag != I_LOOP && tag != I_JCXZ) lockstep_flags(group, zf, sf, cf, of);
+    if (tag == I_LOOP || tag == I_LOOPZ || tag == I_LOOPNZ)
+    {
+        for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++) cx[lane] -= active[lane] & 1;
+    }
+
+    for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        uint16 t = 0;
+        switch (tag)
+        {
+        case I_JE:     t = zf[lane]; break;
+        case I_JL:     t = sf[lane] ^ of[lane]; break;
+        case I_JLE:    t = (sf[lane] ^ of[lane]) | zf[lane]; break;
+        case I_JB:     t = cf[lane]; break;
+        case I_JBE:    t = cf[lane] | zf[lane]; break;
+        case I_JO:     t = of[lane]; break;
+        case I_JS:     t = sf[lane]; break;
+        case I_JNE:    t = ~zf[lane]; break;
+        case I_JNL:    t = ~(sf[lane] ^ of[lane]); break;
+        case I_JNLE:   t = ~(sf[lane] ^ of[lane]) & ~zf[lane]; break;
+        case I_JNB:    t = ~cf[lane]; break;
+        case I_JNBE:   t = ~cf[lane] & ~zf[lane]; break;
+        case I_JNO:    t = ~of[lane]; break;
+        case I_JNS:    t = ~sf[lane]; break;
+        case I_LOOP:   t = -(uint16) (cx[lane] != 0); break;
+        case I_LOOPZ:  t = -(uint16) (cx[lane] != 0) & zf[lane]; break;
+        case I_LOOPNZ: t = -(uint16) (cx[lane] != 0) & ~zf[lane]; break;
+        case I_JCXZ:   t = -(uint16) (cx[lane] == 0); break;
+        case I_JP:
+        case I_JNP:
+        {
+            // Parity needs a table lookup per lane, flag_pf does it for us
+            registers rs = lockstep_lane_registers(group, lane);
+            t = -(uint16) (flag_pf(&rs) == (tag == I_JP));
+        } break;
+        default: break;
+        }
+        taken[lane] = t & active[lane];
+    }
+
+    uint16 offset = (uint16) instr->destination.imm;
+    int32 taken_cycles = branch_cycles(tag, true);
+    int32 not_taken_cycles = branch_cycles(tag, false);
+    for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        group->ip[lane] += offset & taken[lane];
+        int32 cycles = taken[lane] ? taken_cycles : not_taken_cycles;
+        group->cycles[lane] += cycles & (int32) (int16) active[lane];
+    }
+}
+
+// Runs `instr` for the lanes in `active`, which all start at `ip`
+static void lockstep_execute(e8086_lockstep *group, instruction *instr, uint16 ip, uint32 length, uint16 *active)
+{
+    int32 w = instr->w;
+    int32 ea_cycles = 0;
+    alignas(32) uint16 dst[LOCKSTEP_LANES];
+    alignas(32) uint16 src[LOCKSTEP_LANES];
+    alignas(32) uint16 result[LOCKSTEP_LANES];
+    alignas(32) uint16 dst_address[LOCKSTEP_LANES];
+    alignas(32) uint16 src_address[LOCKSTEP_LANES];
+
+    instruction_operand_tag dst_tag = instr->destination.tag;
+    if (instr->tag == I_NOOP)
+    {
+        lockstep_stop_lanes(group, active, E8086_ERROR_BAD_OPERAND);
+        return;
+    }
+    if ((dst_tag == IOP_REG && instr->destination.reg >= R_ES) ||
+        (instr->source.tag == IOP_REG && instr->source.reg >= R_ES))
+    {
+        lockstep_leave_group(group, active);
+        return;
+    }
+    if (dst_tag == IOP_MEM) ea_cycles = instr->destination.addr.cycles;
+    if (instr->source.tag == IOP_MEM) ea_cycles = instr->source.addr.cycles;
+
+    uint16 next_ip = (uint16) (ip + length);
+    for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        group->ip[lane] = (next_ip & active[lane]) | (group->ip[lane] & ~active[lane]);
+    }
+
+    uint16 flags_op = FLAGS_OP_NONE;
+    switch (instr->tag)
+    {
+    case I_MOV:
+    {
+        lockstep_read_operand(group, &instr->source, w, src, src_address);
+        if (dst_tag == IOP_MEM) lockstep_effective_addresses(group, instr->destination.addr, dst_address);
+        lockstep_write_operand(group, &instr->destination, w, src, dst_address, active);
+    } break;
+
+    case I_ADD:
+    case I_SUB:
+    case I_CMP:
+    {
+        lockstep_read_operand(group, &instr->source, w, src, src_address);
+        lockstep_read_operand(group, &instr->destination, w, dst, dst_address);
+        uint16 mask = w ? 0xffff : 0x00ff;
+        if (instr->tag == I_ADD)
+        {
+            flags_op = FLAGS_OP_ADD;
+            for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++) result[lane] = (dst[lane] + src[lane]) & mask;
+        }
+        else
+        {
+            flags_op = FLAGS_OP_SUB;
+            for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++) result[lane] = (dst[lane] - src[lane]) & mask;
+        }
+        if (instr->tag != I_CMP) lockstep_write_operand(group, &instr->destination, w, result, dst_address, active);
+    } break;
+
+    case I_JE:   case I_JL:   case I_JLE:  case I_JB:
+    case I_JBE:  case I_JP:   case I_JO:   case I_JS:
+    case I_JNE:  case I_JNL:  case I_JNLE: case I_JNB:
+    case I_JNBE: case I_JNP:  case I_JNO:  case I_JNS:
+    case I_LOOP: case I_LOOPZ: case I_LOOPNZ: case I_JCXZ:
+        lockstep_branch(group, instr, active);
+        break;
+
+    case I_PUSH:
+    {
+        // As in execute_instruction, PUSH SP pushes the decremented SP
+        lockstep_read_operand(group, &instr->destination, w, src, src_address);
+        if (dst_tag == IOP_REG && instr->destination.reg == R_SP)
+        {
+            for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++) src[lane] -= 2;
+        }
+        lockstep_push(group, src, active);
+    } break;
+
+    case I_POP:
+    {
+        lockstep_pop(group, src, active);
+        if (dst_tag == IOP_MEM) lockstep_effective_addresses(group, instr->destination.addr, dst_address);
+        lockstep_write_operand(group, &instr->destination, w, src, dst_address, active);
+    } break;
+
+    case I_CALL:
+    {
+        if (dst_tag == IOP_IMM)
+        {
+            uint16 target = (uint16) (next_ip + instr->destination.imm);
+            for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++) src[lane] = target;
+        }
+        else lockstep_read_operand(group, &instr->destination, w, src, src_address);
+        for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++) result[lane] = next_ip;
+        lockstep_push(group, result, active);
+        for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+        {
+            group->ip[lane] = (src[lane] & active[lane]) | (group->ip[lane] & ~active[lane]);
+        }
+    } break;
+
+    case I_RET:
+    {
+        lockstep_pop(group, src, active);
+        uint16 release = (dst_tag == IOP_IMM) ? (uint16) instr->destination.imm : 0;
+        uint16 *sp = group->words[R_SP & 0b111];
+        for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+        {
+            group->ip[lane] = (src[lane] & active[lane]) | (group->ip[lane] & ~active[lane]);
+            sp[lane] += release & active[lane];
+        }
+    } break;
+
+    case I_CLD:
+    case I_STD:
+    {
+        uint16 df = (instr->tag == I_STD) ? FLAG_DF : 0;
+        for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+        {
+            uint16 flags = (group->flags[lane] & ~FLAG_DF) | df;
+            group->flags[lane] = (flags & active[lane]) | (group->flags[lane] & ~active[lane]);
+        }
+    } break;
+
+    default:
+        for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+        {
+            group->ip[lane] = (ip & active[lane]) | (group->ip[lane] & ~active[lane]);
+        }
+        lockstep_leave_group(group, active);
+        return;
+    }
+
+    if (flags_op != FLAGS_OP_NONE)
+    {
+        for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+        {
+            uint16 m = active[lane];
+            group->lazy_op[lane]     = (flags_op    & m) | (group->lazy_op[lane]     & ~m);
+            group->lazy_w[lane]      = ((uint16) w  & m) | (group->lazy_w[lane]      & ~m);
+            group->lazy_dst[lane]    = (dst[lane]    & m) | (group->lazy_dst[lane]    & ~m);
+            group->lazy_src[lane]    = (src[lane]    & m) | (group->lazy_src[lane]    & ~m);
+            group->lazy_result[lane] = (result[lane] & m) | (group->lazy_result[lane] & ~m);
+        }
+    }
+
+    int32 cycles = instr->cycles + ea_cycles;
+    for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        group->cycles[lane] += cycles & (int32) (int16) active[lane];
+    }
+}
+
+e8086_lockstep *e8086_lockstep_create(unsigned int lane_count)
+{
+    init_opcode_dispatch_table();
+
+    e8086_lockstep *group = aligned_alloc(alignof(e8086_lockstep), sizeof(e8086_lockstep));
+    memset(group, 0, sizeof(e8086_lockstep));
+    group->lane_count = (lane_count < LOCKSTEP_LANES) ? lane_count : LOCKSTEP_LANES;
+    group->memory = calloc(LOCKSTEP_LANES, LOCKSTEP_LANE_MEMORY);
+    group->decoded = calloc(1 << 16, sizeof(lockstep_entry));
+    return group;
+}
+
+void e8086_lockstep_destroy(e8086_lockstep *group)
+{
+    if (!group) return;
+    for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++) e8086_destroy(group->scalar[lane]);
+    free(group->memory);
+    free(group->decoded);
+    free(group);
+}
+
+e8086_status e8086_lockstep_load(e8086_lockstep *group, unsigned char const *image, unsigned int size)
+{
+    if (size > (1 << 16)) return E8086_ERROR_IMAGE_TOO_LARGE;
+
+    // Registers, flags and cycles of every lane start at 0, and every lane is in the group
+    uint8 *memory = group->memory;
+    lockstep_entry *decoded = group->decoded;
+    uint32 lane_count = group->lane_count;
+    sim8086 *scalar[LOCKSTEP_LANES];
+    memcpy(scalar, group->scalar, sizeof(scalar));
+    memset(group, 0, sizeof(e8086_lockstep));
+    group->memory = memory;
+    group->decoded = decoded;
+    group->lane_count = lane_count;
+    memcpy(group->scalar, scalar, sizeof(scalar));
+
+    memset(memory, 0, (uint64) LOCKSTEP_LANES * LOCKSTEP_LANE_MEMORY);
+    for (uint32 lane = 0; lane < group->lane_count; lane++)
+    {
+        memcpy(lockstep_lane_memory(group, lane), image, size);
+        group->running[lane] = 0xffff;
+    }
+    group->image_size = size;
+    return E8086_OK;
+}
+
+void e8086_lockstep_set_state(e8086_lockstep *group, unsigned int lane, e8086_state const *state)
+{
+    uint16 words[8] = { state->ax, state->cx, state->dx, state->bx, state->sp, state->bp, state->si, state->di };
+    for (uint32 reg = 0; reg < 8; reg++) group->words[reg][lane] = words[reg];
+    group->ip[lane] = state->ip;
+    group->flags[lane] = state->flags;
+    group->lazy_op[lane] = FLAGS_OP_NONE;
+    group->cycles[lane] = state->cycles;
+
+    // A lane that left the group stays out of it until the next load
+    bool segments = (state->es | state->cs | state->ss | state->ds) != 0;
+    if (segments && !group->on_scalar[lane]) lockstep_move_to_scalar(group, lane);
+    if (group->on_scalar[lane]) e8086_set_state(group->scalar[lane], state);
+}
+
+unsigned char *e8086_lockstep_memory(e8086_lockstep *group, unsigned int lane)
+{
+    if (group->on_scalar[lane]) return e8086_memory(group->scalar[lane]);
+    return lockstep_lane_memory(group, lane);
+}
+
+// The most cycles one instruction can take, branches included
+#define LOCKSTEP_MAX_STEP_CYCLES 64
+
+void e8086_lockstep_run_until(e8086_lockstep *group, e8086_run_limits limits)
+{
+    uint64 max_instructions = limits.max_instructions ? limits.max_instructions : (uint64) -1;
+    uint64 max_cycles = limits.max_cycles ? limits.max_cycles : (uint64) -1;
+    uint32 end_ip = group->image_size;
+
+    // Lanes may have been given different code since the load
+    group->code_shared = true;
+    for (uint32 lane = 1; lane < group->lane_count; lane++)
+    {
+        if (memcmp(lockstep_lane_memory(group, lane), group->memory, end_ip) != 0) group->code_shared = false;
+    }
+    memset(group->decoded, 0, end_ip * sizeof(lockstep_entry));
+
+    alignas(32) uint64 instructions[LOCKSTEP_LANES] = {};
+    alignas(32) uint16 active[LOCKSTEP_LANES];
+    for (uint32 lane = 0; lane < group->lane_count; lane++)
+    {
+        group->running[lane] = ~group->on_scalar[lane];
+        group->status[lane] = E8086_OK;
+    }
+
+    // Steps are cheap when nothing stops. IP based stops are looked for with
+    // a few vector compares. The limits are only checked once a lane may
+    // have used up its instructions or cycles, which the budgets tell.
+    uint16 last_ip = (uint16) (end_ip - 1);
+    uint16 stop_ip = (uint16) limits.stop_ip;
+    uint16 stop_ip_mask = (limits.stop_ip >= 0 && limits.stop_ip < (1 << 16)) ? 0xffff : 0;
+    int64 instruction_budget = -1;
+    int64 cycle_budget = -1;
+
+    for (;;)
+    {
+        uint16 stopping = 0;
+        for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+        {
+            uint16 ip = group->ip[lane];
+            uint16 halted = -(uint16) (ip > last_ip);
+            uint16 at_stop = -(uint16) (ip == stop_ip) & stop_ip_mask;
+            stopping |= group->running[lane] & (halted | at_stop);
+        }
+
+        if (stopping || end_ip == 0 || instruction_budget < 0 || cycle_budget < 0)
+        {
+            // Lanes stop before their next instruction the way e8086_run_until stops
+            instruction_budget = (int64) ((uint64) -1 >> 1);
+            cycle_budget = (int64) ((uint64) -1 >> 1);
+            for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+            {
+                if (!group->running[lane]) continue;
+                uint16 ip = group->ip[lane];
+                e8086_status status = E8086_OK;
+                if (instructions[lane] >= max_instructions) status = E8086_INSTRUCTION_LIMIT;
+                else if (group->cycles[lane] >= max_cycles) status = E8086_CYCLE_LIMIT;
+                else if (ip == limits.stop_ip) status = E8086_REACHED_IP;
+                else if (ip >= end_ip) status = E8086_HALTED;
+
+                if (status != E8086_OK)
+                {
+                    group->status[lane] = status;
+                    group->running[lane] = 0;
+                    continue;
+                }
+
+                // Steps this lane can surely take before it could reach a limit
+                uint64 instructions_left = max_instructions - instructions[lane] - 1;
+                uint64 cycles_left = max_cycles - group->cycles[lane] - 1;
+                if (instructions_left < (uint64) instruction_budget) instruction_budget = (int64) instructions_left;
+                if (cycles_left < (uint64) cycle_budget) cycle_budget = (int64) cycles_left;
+            }
+        }
+
+        uint16 lowest_ip = 0xffff;
+        uint16 any_running = 0;
+        for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+        {
+            uint16 key = group->ip[lane] | ~group->running[lane];
+            lowest_ip = (key < lowest_ip) ? key : lowest_ip;
+            any_running |= group->running[lane];
+        }
+        if (!any_running) break;
+
+        uint16 ip = lowest_ip;
+        for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+        {
+            active[lane] = group->running[lane] & -(uint16) (group->ip[lane] == ip);
+        }
+        uint32 leader = 0;
+        while (!active[leader]) leader++;
+
+        instruction decoded;
+        instruction *instr = &decoded;
+        uint32 length = 0;
+        lockstep_entry *entry = group->decoded + ip;
+        if (group->code_shared && entry->length)
+        {
+            instr = &entry->instr;
+            length = entry->length;
+        }
+        else
+        {
+            sim8086 *decoder = &group->decoder;
+            decoder->memory = lockstep_lane_memory(group, leader);
+            decoder->code = decoder->memory;
+            decoder->rs.ip = ip;
+            decoder->error = E8086_OK;
+            decoded = decode_next_instruction(decoder);
+            length = (uint16) (decoder->rs.ip - ip);
+            if (decoder->error)
+            {
+                // With different code only the leader is known to fail here
+                if (!group->code_shared)
+                {
+                    for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++) active[lane] = (lane == leader) ? 0xffff : 0;
+                }
+                lockstep_stop_lanes(group, active, decoder->error);
+                continue;
+            }
+
+            if (group->code_shared)
+            {
+                entry->instr = decoded;
+                entry->length = (uint8) length;
+            }
+            else
+            {
+                uint8 *code = lockstep_lane_memory(group, leader);
+                for (uint32 lane = leader + 1; lane < LOCKSTEP_LANES; lane++)
+                {
+                    if (!active[lane]) continue;
+                    uint8 *other = lockstep_lane_memory(group, lane);
+                    for (uint32 offset = 0; offset < length; offset++)
+                    {
+                        uint16 address = (uint16) (ip + offset);
+                        if (other[address] != code[address]) active[lane] = 0;
+                    }
+                }
+            }
+        }
+
+        lockstep_execute(group, instr, ip, length, active);
+
+        uint32 ran_count = 0;
+        for (uint32 lane = 0; lane < LOCKSTEP_LANES; lane++)
+        {
+            uint16 ran = active[lane] & group->running[lane] & 1;
+            instructions[lane] += ran;
+            ran_count += ran;
+        }
+        group->steps += 1;
+        group->lane_steps += ran_count;
+        instruction_budget -= 1;
+        cycle_budget -= LOCKSTEP_MAX_STEP_CYCLES;
+    }
+
+    // Lanes that left the group run on by themselves, within what is left of the limits
+    for (uint32 lane = 0; lane < group->lane_count; lane++)
+    {
+        if (!group->on_scalar[lane]) continue;
+        e8086_run_limits rest = limits;
+        if (limits.max_instructions) rest.max_instructions = limits.max_instructions - instructions[lane];
+        uint64 executed = 0;
+        group->status[lane] = run_until(group->scalar[lane], rest, &executed);
+        group->scalar_steps += executed;
+    }
+}
+
+e8086_status e8086_lockstep_status(e8086_lockstep *group, unsigned int lane)
+{
+    return group->status[lane];
+}
+
+e8086_state e8086_lockstep_get_state(e8086_lockstep *group, unsigned int lane)
+{
+    if (group->on_scalar[lane]) return e8086_get_state(group->scalar[lane]);
+    registers rs = lockstep_lane_registers(group, lane);
+    e8086_state result =
+    {
+        .ax = rs.ax, .bx = rs.bx, .cx = rs.cx, .dx = rs.dx,
+        .sp = rs.sp, .bp = rs.bp, .si = rs.si, .di = rs.di,
+        .ip = rs.ip,
+        .flags = read_flags(&rs),
+        .cycles = group->cycles[lane],
+    };
+    return result;
+}
+
+lockstep_statistics e8086_lockstep_statistics(e8086_lockstep *group)
+{
+    lockstep_statistics result =
+    {
+        .steps = group->steps,
+        .lane_steps = group->lane_steps,
+        .scalar_steps = group->scalar_steps,
+    };
+    return result;
+}
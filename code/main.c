@@ -1,23 +1,21 @@
+// POSIX extensions (dup, sysconf, fseeko and such) are hidden under -std=c11
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#define ARRAY_COUNT(ARRAY) (sizeof(ARRAY) / sizeof(ARRAY[0]))
-
-typedef int bool;
-#define true 1
-#define false 0
+#include "e8086_internal.h"
 
 char const *spaces = "                                          ";
 
-typedef   signed char   int8;
-typedef unsigned char  uint8;
-typedef          short  int16;
-typedef unsigned short uint16;
-typedef   signed int    int32;
-typedef unsigned int   uint32;
-
-
 void print_binary8(uint8 n)
 {
     uint32 mask = 0b10000000;
@@ -49,251 +47,17 @@ void print_binary32(uint32 n)
 }
 
 
-/*
-    sp - stack pointer
-    bp - base pointer
-    si - source index
-    di - destination index
-*/
-
-enum opcode
-{
-    OPCODE_MOV1 = 0b10001000, // mov (register/memory to/from register)
-    OPCODE_MOV2 = 0b11000110, // mov (immediate to register/memory)
-    OPCODE_MOV3 = 0b10110000, // mov (immediate to register)
-    OPCODE_MOV4 = 0b10100000, // mov (memory to accumulator)
-    OPCODE_MOV5 = 0b10100010, // mov (accumulator to memory)
-    OPCODE_MOV6 = 0b10001110, // mov (register/memory to segment register)
-    OPCODE_MOV7 = 0b10001100, // mov (segment register to register/memory)
-
-    OPCODE_ADD1 = 0b00000000, // add (reg/memory with register to either)
-    OPCODE_ADD3 = 0b00000100, // add (immediate to accumulator)
-
-    OPCODE_SUB1 = 0b00101000, // sub (reg/memory and register to either)
-    OPCODE_SUB3 = 0b00101100, // sub (immediate from accumulator)
-
-    OPCODE_CMP1 = 0b00111000, // cmp (reg/memory and register)
-    OPCODE_CMP3 = 0b00111100, // cmp (immediate with accumulator)
-
-    OPCODE_JE   = 0b01110100, // jump on equal / zero
-    OPCODE_JL   = 0b01111100, // jump on less / not greater or equal
-    OPCODE_JLE  = 0b01111110, // jump on less or equal / not greater
-    OPCODE_JB   = 0b01110010, // jump on below/not above or equal
-    OPCODE_JBE  = 0b01110110, // jump on below or equal / not above
-    OPCODE_JP   = 0b01111010, // jump on parity / parity even
-    OPCODE_JO   = 0b01110000, // jump on overflow
-    OPCODE_JS   = 0b01111000, // jump on sign
-    OPCODE_JNE  = 0b01110101, // jump on not equal / not zero
-    OPCODE_JNL  = 0b01111101, // jump on not less / greater or equal
-    OPCODE_JNLE = 0b01111111, // jump on not less or equal / greater
-    OPCODE_JNB  = 0b01110011, // jump on not below / above or equal
-    OPCODE_JNBE = 0b01110111, // jump on not below or equal / above
-    OPCODE_JNP  = 0b01111011, // jump on not par / par odd
-    OPCODE_JNO  = 0b01110001, // jump on not overflow
-    OPCODE_JNS  = 0b01111001, // jump on not sign
-    OPCODE_LOOP = 0b11100010, // loop CX times
-    OPCODE_LOOPZ = 0b11100001, // loop while zero
-    OPCODE_LOOPNZ = 0b11100000, // loop while not zero
-    OPCODE_JCXZ = 0b11100011, // jump on CX zero
-
-    OPCODE_IMM_TO_REG_MEM = 0b10000000, // add (immediate to register/memory)
-};
-
-enum
-{
-    MOD_00 = 0b00,
-    MOD_01 = 0b01,
-    MOD_10 = 0b10,
-    MOD_RM = 0b11,
-};
-
-enum
-{
-/*
-   0    1    2    3    4    5    6    7    8    9   10   11   12   13   14   15
-  al   cl   dl   bl   ah   ch   dh   bh   ax   cx   dx   bx   sp   bp   si   di
- 000  001  010  011  100  101  110  111 1000 1001 1010 1011 1100 1101 1110 1111
-*/
-    R_AL, R_CL, R_DL, R_BL, R_AH, R_CH, R_DH, R_BH,
-    R_AX, R_CX, R_DX, R_BX, R_SP, R_BP, R_SI, R_DI,
-};
-
-typedef struct
-{
-    union { uint16 ax; struct { uint8 al, ah; }; };
-    union { uint16 bx; struct { uint8 bl, bh; }; };
-    union { uint16 cx; struct { uint8 cl, ch; }; };
-    union { uint16 dx; struct { uint8 dl, dh; }; };
-    uint16 sp;
-    uint16 bp;
-    uint16 si;
-    uint16 di;
-    uint16 ip;
-    // struct
-    // {
-    //     uint16 _u0 : 1;
-    //     uint16 _u1 : 1;
-    //     uint16 _u2 : 1;
-    //     uint16 _u3 : 1;
-    //     uint16 fo : 1;
-    //     uint16 fd : 1;
-    //     uint16 fi : 1;
-    //     uint16 ft : 1;
-    //     uint16 fs : 1;
-    //     uint16 fz : 1;
-    //     uint16 _u4 : 1;
-    //     uint16 fa : 1;
-    //     uint16 _u5 : 1;
-    //     uint16 f : 1;
-    //     uint16 f : 1;
-    // };
-    bool fz;
-    bool fs;
-} registers;
-
-typedef enum
-{
-    I_NOOP,
-
-    I_MOV,
-    I_ADD,
-    I_SUB,
-
-    I_CMP,
-    I_JE,  I_JL,  I_JLE,  I_JB,  I_JBE,  I_JP,  I_JO,  I_JS,
-    I_JNE, I_JNL, I_JNLE, I_JNB, I_JNBE, I_JNP, I_JNO, I_JNS,
-    I_LOOP,
-    I_LOOPZ,
-    I_LOOPNZ,
-    I_JCXZ,
-} instruction_tag;
-
-typedef enum
-{
-    IOPERAND_NONE,
-
-    IOP_IMM,
-    IOP_REG,
-    IOP_MEM,
-} instruction_operand_tag;
-
-typedef struct
-{
-    uint32 reg1, reg2;
-    uint32 reg_count; // 0, 1, or 2
-    uint32 displacement;
-    int32  cycles;
-} effective_address;
-
-typedef struct
-{
-    instruction_operand_tag tag;
-    union
-    {
-        int32 imm;
-        int32 reg;
-        effective_address addr;
-    };
-} instruction_operand;
-
-typedef struct
-{
-    instruction_tag tag;
-
-    instruction_operand source, destination;
-    int32 cycles;
-} instruction;
-
-typedef struct
-{
-    enum opcode opcode;
-    int mask;
-    instruction_tag instruction;
-} opcode_info;
-
-opcode_info opcode_table[] =
-{
-    { OPCODE_MOV1, 0b11111100, I_MOV },
-    { OPCODE_MOV2, 0b11111110, I_MOV },
-    { OPCODE_MOV3, 0b11110000, I_MOV },
-    { OPCODE_MOV4, 0b11111110, I_MOV },
-    { OPCODE_MOV5, 0b11111110, I_MOV },
-    { OPCODE_MOV6, 0b11111111, I_MOV },
-    { OPCODE_MOV7, 0b11111111, I_MOV },
-
-    { OPCODE_ADD1, 0b11111100, I_ADD },
-    { OPCODE_ADD3, 0b11111110, I_ADD },
-
-    { OPCODE_SUB1, 0b11111100, I_SUB },
-    { OPCODE_SUB3, 0b11111110, I_SUB },
-
-    { OPCODE_CMP1, 0b11111100, I_CMP },
-    { OPCODE_CMP3, 0b11111110, I_CMP },
-
-    { OPCODE_JE,   0b11111111, I_JE },
-    { OPCODE_JL,   0b11111111, I_JL },
-    { OPCODE_JLE,  0b11111111, I_JLE },
-    { OPCODE_JB,   0b11111111, I_JB },
-    { OPCODE_JBE,  0b11111111, I_JBE },
-    { OPCODE_JP,   0b11111111, I_JP },
-    { OPCODE_JO,   0b11111111, I_JO },
-    { OPCODE_JS,   0b11111111, I_JS },
-    { OPCODE_JNE,  0b11111111, I_JNE },
-    { OPCODE_JNL,  0b11111111, I_JNL },
-    { OPCODE_JNLE, 0b11111111, I_JNLE },
-    { OPCODE_JNB,  0b11111111, I_JNB },
-    { OPCODE_JNBE, 0b11111111, I_JNBE },
-    { OPCODE_JNP,  0b11111111, I_JNP },
-    { OPCODE_JNO,  0b11111111, I_JNO },
-    { OPCODE_JNS,  0b11111111, I_JNS },
-    { OPCODE_LOOP, 0b11111111, I_LOOP },
-    { OPCODE_LOOPZ, 0b11111111, I_LOOPZ },
-    { OPCODE_LOOPNZ, 0b11111111, I_LOOPNZ },
-    { OPCODE_JCXZ, 0b11111111, I_JCXZ },
-
-    { OPCODE_IMM_TO_REG_MEM, 0b11111100, I_NOOP },
-};
-
-char const *register_names[] =
-{
-    "al", "cl", "dl", "bl", "ah", "ch", "dh", "bh",
-    "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
-};
-
-char const *instruction_names[] =
-{
-    "NOOP",
-    "MOV", "ADD", "SUB",
-    "CMP",
-    "JE", "JL", "JLE", "JB",
-    "JBE",
-    "JP",
-    "JO",
-    "JS",
-    "JNE",
-    "JNL",
-    "JNLE",
-    "JNB",
-    "JNBE",
-    "JNP",
-    "JNO",
-    "JNS",
-    "LOOP",
-    "LOOPZ",
-    "LOOPNZ",
-    "JCXZ",
-};
-
 int print_ea(effective_address ea)
 {
     int n = 0;
+    if (ea.segment_prefix) n += printf("%s:", e8086_register_names[R_ES + ea.segment]);
     if (ea.reg_count == 0)
     {
         n += printf("[%d]", ea.displacement);
     }
     else if (ea.reg_count == 1)
     {
-        n += printf("[%s", register_names[ea.reg1 | 0b1000]);
+        n += printf("[%s", e8086_register_names[ea.reg1 | 0b1000]);
         if (ea.displacement == 0)
         {
             n += printf("]");
@@ -305,8 +69,8 @@ int print_ea(effective_address ea)
     }
     else if (ea.reg_count == 2)
     {
-        n += printf("[%s + %s", register_names[ea.reg1 | 0b1000],
-            register_names[ea.reg2 | 0b1000]);
+        n += printf("[%s + %s", e8086_register_names[ea.reg1 | 0b1000],
+            e8086_register_names[ea.reg2 | 0b1000]);
         if (ea.displacement == 0)
         {
             n += printf("]");
@@ -326,782 +90,1070 @@ int print_instruction_operand(instruction_operand iop)
     {
     case IOPERAND_NONE: break;
     case IOP_IMM: n += printf("%d", iop.imm); break;
-    case IOP_REG: n += printf("%s", register_names[iop.reg]); break;
+    case IOP_REG: n += printf("%s", e8086_register_names[iop.reg]); break;
     case IOP_MEM: n += print_ea(iop.addr); break;
     }
     return n;
 }
 
-int print_instruction(int32 cycles, instruction i)
+int print_instruction_text(instruction i)
 {
     int n = 0;
-    n += printf("    %s ", instruction_names[i.tag]);
+    n += printf("    %s%s ", e8086_rep_prefix_name(&i), e8086_instruction_names[i.tag]);
     n += print_instruction_operand(i.destination);
     if (i.source.tag != IOPERAND_NONE)
     {
         n += printf(", ");
         n += print_instruction_operand(i.source);
     }
+    return n;
+}
+
+// printf-based trace line, kept as the reference for --bench-trace.
+// Traces are written by format_instruction in trace.c.
+int print_instruction(uint64 cycles, instruction i)
+{
+    int n = print_instruction_text(i);
     int ea_cycles = (i.destination.tag == IOP_MEM) ? i.destination.addr.cycles
                   : (i.source.tag == IOP_MEM) ? i.source.addr.cycles
                   : 0;
     if (ea_cycles > 0)
-        n += printf("%.*s%d = %d + %dea cycles (overall: %d)\n",
+        n += printf("%.*s%d = %d + %dea cycles (overall: %llu)\n",
             30 - n, spaces,
             i.cycles + ea_cycles,
             i.cycles, ea_cycles,
-            i.cycles + ea_cycles + cycles);
+            cycles + i.cycles + ea_cycles);
     else
-        n += printf("%.*s%d (overall: %d)\n",
+        n += printf("%.*s%d (overall: %llu)\n",
             30 - n, spaces,
-            i.cycles, i.cycles + cycles);
+            i.cycles, cycles + i.cycles);
     return n;
 }
 
+#include "trace.c"
+#include "trace_thread.c"
+
+// A step of a traced run: the instruction as it was decoded before it ran,
+// since it may overwrite itself, and the state around it
 typedef struct
 {
-    uint8 *memory;
-    uint32 size;
-
-    registers rs;
+    instruction decoded;
+    instruction instr; // decoded, with the cycles the step took if they vary
+    uint8 code[MAX_INSTRUCTION_LENGTH];
+    uint32 length;
+    e8086_state before;
+    e8086_state after;
+} executed_step;
+
+e8086_status execute_step(sim8086 *sim, executed_step *step)
+{
+    uint8 *code = e8086_code(sim);
+    step->before = e8086_get_state(sim);
+    step->length = e8086_decode(code, step->before.ip, &step->decoded);
+    for (uint32 offset = 0; offset < step->length; offset++) step->code[offset] = code[(uint16) (step->before.ip + offset)];
+
+    e8086_status status = e8086_step(sim);
+    step->after = e8086_get_state(sim);
+
+    // Branch timing is only known once the branch has been taken or
+    // not, and that of a repeat once it stopped
+    step->instr = step->decoded;
+    if (e8086_has_variable_cycles(&step->instr)) step->instr.cycles = (int32) (step->after.cycles - step->before.cycles);
+    return status;
+}
 
-    int32 cycles;
-} sim8086;
+void print_out_compound_register_state(uint16 rx)
+{
+    uint8 rl = rx >> 8;
+    uint8 rh = rx & (0xff);
+    print_binary8(rl);
+    printf(" ");
+    print_binary8(rh);
+    printf(" (%d|%d; %d)", rl, rh, rx);
+}
 
-effective_address ea_table[3][8] =
+void print_out_registers_state(e8086_state *state)
 {
-    // mod == 00 (MOD_00)
-    {
-        { .reg1 = R_BX, .reg2 = R_SI, .reg_count = 2, .cycles = 7 },  // bx + si
-        { .reg1 = R_BX, .reg2 = R_DI, .reg_count = 2, .cycles = 8 },  // bx + di
-        { .reg1 = R_BP, .reg2 = R_SI, .reg_count = 2, .cycles = 8 },  // bp + si
-        { .reg1 = R_BP, .reg2 = R_DI, .reg_count = 2, .cycles = 7 },  // bp + di
-        { .reg1 = R_SI,               .reg_count = 1, .cycles = 5 },  // si
-        { .reg1 = R_DI,               .reg_count = 1, .cycles = 5 },  // di
-        {                             .reg_count = 0, .cycles = 6 },  // direct address
-        { .reg1 = R_BX,               .reg_count = 1, .cycles = 5 },  // bx
-    },
-    // mod == 01 (MOD_01)
+    printf("Registers:\n"
+           "    AX: ");
+    print_out_compound_register_state(state->ax);
+    printf("\n");
+    printf("    BX: ");
+    print_out_compound_register_state(state->bx);
+    printf("\n");
+    printf("    CX: ");
+    print_out_compound_register_state(state->cx);
+    printf("\n");
+    printf("    DX: ");
+    print_out_compound_register_state(state->dx);
+    printf("\n");
+    printf("    SP: ");
+    print_binary16(state->sp);
+    printf(" (%d)\n", state->sp);
+    printf("    BP: ");
+    print_binary16(state->bp);
+    printf(" (%d)\n", state->bp);
+    printf("    SI: ");
+    print_binary16(state->si);
+    printf(" (%d)\n", state->si);
+    printf("    DI: ");
+    print_binary16(state->di);
+    printf(" (%d)\n", state->di);
+    // Segment registers only once a program uses them
+    char const *segment_names[] = { "ES", "CS", "SS", "DS" };
+    uint16 segments[] = { state->es, state->cs, state->ss, state->ds };
+    for (uint32 index = 0; index < ARRAY_COUNT(segment_names); index++)
     {
-        { .reg1 = R_BX, .reg2 = R_SI, .reg_count = 2, .cycles = 11 }, // bx + si + 8bit displacement
-        { .reg1 = R_BX, .reg2 = R_DI, .reg_count = 2, .cycles = 12 }, // bx + di + 8bit displacement
-        { .reg1 = R_BP, .reg2 = R_SI, .reg_count = 2, .cycles = 12 }, // bp + si + 8bit displacement
-        { .reg1 = R_BP, .reg2 = R_DI, .reg_count = 2, .cycles = 11 }, // bp + di + 8bit displacement
-        { .reg1 = R_SI,               .reg_count = 1, .cycles = 9 },  // si + 8bit displacement
-        { .reg1 = R_DI,               .reg_count = 1, .cycles = 9 },  // di + 8bit displacement
-        { .reg1 = R_BP,               .reg_count = 1, .cycles = 9 },  // bp + 8bit displacement
-        { .reg1 = R_BX,               .reg_count = 1, .cycles = 9 },  // bx + 8bit displacement
-    },
-    // mod == 10 (MOD_10)
+        if (!segments[index]) continue;
+        printf("    %s: ", segment_names[index]);
+        print_binary16(segments[index]);
+        printf(" (%d)\n", segments[index]);
+    }
+    printf("    IP: ");
+    print_binary16(state->ip);
+    printf(" (%d)\n", state->ip);
+    printf("Flags:\n"
+           "       _ _ _ _ O D I T S Z _ A _ P _ C\n"
+           "      ");
+    for (int32 bit = 15; bit >= 0; bit--)
     {
-        { .reg1 = R_BX, .reg2 = R_SI, .reg_count = 2, .cycles = 11 }, // bx + si + 16 bit displacement
-        { .reg1 = R_BX, .reg2 = R_DI, .reg_count = 2, .cycles = 12 }, // bx + di + 16 bit displacement
-        { .reg1 = R_BP, .reg2 = R_SI, .reg_count = 2, .cycles = 12 }, // bp + si + 16 bit displacement
-        { .reg1 = R_BP, .reg2 = R_DI, .reg_count = 2, .cycles = 11 }, // bp + di + 16 bit displacement
-        { .reg1 = R_SI,               .reg_count = 1, .cycles = 9 },  // si + 16 bit displacement
-        { .reg1 = R_DI,               .reg_count = 1, .cycles = 9 },  // di + 16 bit displacement
-        { .reg1 = R_BP,               .reg_count = 1, .cycles = 9 },  // bp + 16 bit displacement
-        { .reg1 = R_BX,               .reg_count = 1, .cycles = 9 },  // bx + 16 bit displacement
-    },
-};
-
-
-effective_address read_ea(sim8086 *sim, int32 mod, int32 r_m)
+        printf(" %d", (state->flags >> bit) & 1);
+    }
+    printf("\n");
+}
+
+#include "hexdump.c"
+#include "profile.c"
+#include "call_graph.c"
+#include "instruction_stats.c"
+#include "trace_file.c"
+
+void print_out_statistics(sim8086 *sim)
 {
-    effective_address ea = ea_table[mod][r_m];
+    printf("Statistics:\n");
+    engine_statistics engine = e8086_engine_statistics(sim);
+    if (engine.icache)
+    {
+        uint64 lookups = engine.icache_hits + engine.icache_misses;
+        printf("    icache: %llu hits, %llu misses (%.2f%% hit rate), %llu invalidations\n",
+            engine.icache_hits, engine.icache_misses,
+            lookups ? 100.0 * engine.icache_hits / lookups : 0.0,
+            engine.icache_invalidations);
+    }
+    else
+    {
+        printf("    icache: disabled\n");
+    }
 
-    if (mod == MOD_00)
+    branch_counter *branches = e8086_branches(sim);
+    if (branches)
     {
-        // Direct address reading
-        if (r_m == 0b110)
+        uint64 taken = 0;
+        uint64 executed = 0;
+        for (uint32 address = 0; address < SEGMENT_SIZE; address++)
+        {
+            taken += branches[address].taken;
+            executed += branches[address].taken + branches[address].not_taken;
+        }
+        printf("    branches: %llu executed, %llu taken (%.2f%%)\n",
+            executed, taken, executed ? 100.0 * taken / executed : 0.0);
+
+        for (uint32 address = 0; address < SEGMENT_SIZE; address++)
         {
-            ea.displacement = *(int16 *) (sim->memory + sim->rs.ip);
-            sim->rs.ip += 2;
+            branch_counter *counter = branches + address;
+            if (!counter->taken && !counter->not_taken) continue;
+            instruction instr;
+            e8086_decode(e8086_code(sim), (uint16) address, &instr);
+            printf("        %04x %-6s %llu taken, %llu not taken\n",
+                address, e8086_instruction_names[instr.tag], counter->taken, counter->not_taken);
         }
     }
-    else if (mod == MOD_01)
+
+    if (engine.threaded)
     {
-        ea.displacement = *(int8 *) (sim->memory + sim->rs.ip);
-        sim->rs.ip += 1;
+        printf("    threaded: %llu blocks translated, %llu blocks executed, %llu chained, %llu flushes\n",
+            engine.blocks_translated, engine.blocks_executed,
+            engine.blocks_chained, engine.flushes);
     }
-    else if (mod == MOD_10)
+    if (engine.jit)
     {
-        ea.displacement = *(int16 *) (sim->memory + sim->rs.ip);
-        sim->rs.ip += 2;
+        printf("    jit: %llu blocks compiled, %llu rejected, %u bytes of code\n",
+            engine.blocks_compiled, engine.blocks_rejected, engine.jit_code_size);
     }
-
-    return ea;
 }
 
-int32 read_data_bytes(sim8086 *sim, int32 w, int32 s)
+void print_out_record_statistics(e8086_recording *recording)
 {
-    int32 data = (!s && w) ? *(int16 *) (sim->memory + sim->rs.ip)
-                           : *(int8 *)  (sim->memory + sim->rs.ip);
-    sim->rs.ip += (!s && w) ? 2 : 1;
-    return data;
+    recording_statistics stats = e8086_recording_statistics(recording);
+    printf("    recording: %llu instructions, %u checkpoints every %llu cycles, %llu pages, %.1f KiB\n"
+           "               thinned %u times, %llu instructions replayed\n",
+        stats.instructions, stats.checkpoint_count, stats.checkpoint_cycles, stats.pages,
+        stats.memory_used / 1024.0, stats.thinned, stats.replayed);
 }
 
-
-instruction instruction_type1(sim8086 *sim, opcode_info *info)
+double get_wall_clock(void)
 {
-    uint8 byte1 = sim->memory[sim->rs.ip++];
-    uint8 byte2 = sim->memory[sim->rs.ip++];
-
-    int32 d = 0b00000010 & byte1;
-    int32 w = 0b00000001 & byte1;
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-    int32 mod = (0b11000000 & byte2) >> 6;
-    int32 reg = (0b00111000 & byte2) >> 3;
-    int32 r_m = (0b00000111 & byte2);
+typedef uint32 (*decode_proc)(uint8 *code, uint16 ip, instruction *result);
 
-    instruction result =
-    {
-        .tag = info->instruction,
-        .source =
-        {
-            .tag = IOP_REG,
-            .reg = reg | (w << 3),
-        },
-    };
-
-    if (mod == MOD_RM)
+double measure_decode_rate(uint8 *code, uint32 size, decode_proc decode)
+{
+    uint64 decoded = 0;
+    double start = get_wall_clock();
+    double elapsed = 0;
+    do
     {
-        // INSTR rx, rx
-        result.destination = (instruction_operand)
+        // Decode-only pass over the whole image, nothing is executed.
+        // Bytes that are no instruction are skipped one at a time.
+        for (uint32 ip = 0; ip < size;)
         {
-            .tag = IOP_REG,
-            .reg = r_m | (w << 3)
-        };
-        switch (info->instruction)
-        {
-        case I_MOV: result.cycles = 2; break;
-        case I_ADD: result.cycles = 3; break;
-        case I_SUB: result.cycles = 3; break;
-        case I_CMP: result.cycles = 3; break;
-        default: break;
+            instruction instr;
+            uint32 length = decode(code, (uint16) ip, &instr);
+            ip += length ? length : 1;
+            decoded += 1;
         }
+        elapsed = get_wall_clock() - start;
     }
-    else
+    while (elapsed < 0.5);
+
+    return decoded / elapsed;
+}
+
+void benchmark_decode(sim8086 *sim, uint32 size)
+{
+    double linear = measure_decode_rate(e8086_code(sim), size, e8086_decode_linear);
+    double table = measure_decode_rate(e8086_code(sim), size, e8086_decode);
+    printf("Decode benchmark:\n"
+           "    linear scan:    %12.0f instructions/s\n"
+           "    dispatch table: %12.0f instructions/s (x%.2f)\n",
+           linear, table, table / linear);
+}
+
+double measure_cached_read_rate(instruction *plain, packed_instruction *packed, uint32 count)
+{
+    uint64 reads = 0;
+    uint64 checksum = 0;
+    uint32 index = 0;
+    double start = get_wall_clock();
+    double elapsed = 0;
+    do
     {
-        // if (d) INSTR [ea], rx
-        //        INSTR rx, [ea]
-        result.destination = (instruction_operand)
-        {
-            .tag = IOP_MEM,
-            .addr = read_ea(sim, mod, r_m),
-        };
-        switch (info->instruction)
+        for (uint32 read_index = 0; read_index < count; read_index++)
         {
-        case I_MOV: result.cycles = d ? 8 : 9; break;
-        case I_ADD: result.cycles = d ? 9 : 16; break;
-        case I_SUB: result.cycles = d ? 9 : 16; break;
-        case I_CMP: result.cycles = 9; break;
-        default: break;
+            instruction unpacked;
+            instruction *i = plain + index;
+            if (!plain)
+            {
+                e8086_unpack_instruction(packed + index, &unpacked);
+                i = &unpacked;
+            }
+            checksum += i->cycles + i->destination.imm + i->source.imm;
+
+            // Like an interpreter, where the next IP depends on the current
+            // instruction: the next read has to wait for this one, and the
+            // reads jump around the table too much for prefetching
+            index = (index * 5 + 1 + i->w + i->destination.tag) & (count - 1);
         }
+        reads += count;
+        elapsed = get_wall_clock() - start;
     }
+    while (elapsed < 0.5);
+
+    if (checksum == 1) printf("\n"); // keeps the reads
+    return reads / elapsed;
+}
 
-    if (d)
+void benchmark_instruction_cache(sim8086 *sim)
+{
+    // A cache that has seen every offset of the image
+    uint32 count = 1 << 16;
+    instruction *plain = calloc(count, sizeof(instruction));
+    packed_instruction *packed = calloc(count, sizeof(packed_instruction));
+    for (uint32 ip = 0; ip < count - MAX_INSTRUCTION_LENGTH; ip++)
     {
-        instruction_operand tmp = result.destination;
-        result.destination = result.source;
-        result.source = tmp;
+        instruction instr;
+        if (!e8086_decode(e8086_code(sim), (uint16) ip, &instr)) continue;
+        plain[ip] = instr;
+        if (!e8086_pack_instruction(plain[ip], packed + ip)) packed[ip] = (packed_instruction) {};
     }
 
-    return result;
+    double plain_rate = measure_cached_read_rate(plain, 0, count);
+    double packed_rate = measure_cached_read_rate(0, packed, count);
+    printf("Instruction cache benchmark (%u entries, dependent scattered reads):\n"
+           "    instruction:        %3zu bytes, %5zu KiB, %12.0f reads/s\n"
+           "    packed_instruction: %3zu bytes, %5zu KiB, %12.0f reads/s (x%.2f)\n",
+           count,
+           sizeof(instruction), count * sizeof(instruction) / 1024, plain_rate,
+           sizeof(packed_instruction), count * sizeof(packed_instruction) / 1024, packed_rate,
+           packed_rate / plain_rate);
+
+    free(plain);
+    free(packed);
 }
 
-instruction instruction_mov_imm_to_reg_mem(sim8086 *sim, opcode_info *info)
+typedef struct
 {
-    uint8 byte1 = sim->memory[sim->rs.ip++];
-    uint8 byte2 = sim->memory[sim->rs.ip++];
-
-    int32 w = (0b00000001 & byte1);
-    int32 mod = (0b11000000 & byte2) >> 6;
-    int32 opc = (0b00111000 & byte2) >> 3;
-    int32 r_m = (0b00000111 & byte2);
-
-    if (opc != 0) return (instruction){};
-
-    instruction result = { .tag = I_MOV };
+    instruction instr;
+    uint64 cycles; // overall cycles before the instruction
+} trace_step;
 
-    if (mod == MOD_RM)
+// Runs the program headless and keeps what a trace would print,
+// so both formatters below get the same lines.
+uint32 record_trace_steps(sim8086 *sim, trace_step *steps, uint32 max_steps)
+{
+    uint32 count = 0;
+    executed_step step;
+    while (count < max_steps && execute_step(sim, &step) == E8086_OK)
     {
-        result.destination = (instruction_operand)
-        {
-            .tag = IOP_REG,
-            .reg = r_m | (w << 3),
-        };
-        result.cycles = 4;
+        steps[count++] = (trace_step) { .instr = step.instr, .cycles = step.before.cycles };
     }
-    else
+    return count;
+}
+
+// Formats the steps over and over, with printf if `out` is 0
+double measure_trace_rate(trace_step *steps, uint32 count, output_buffer *out)
+{
+    uint64 lines = 0;
+    double start = get_wall_clock();
+    double elapsed = 0;
+    do
     {
-        result.destination = (instruction_operand)
+        for (uint32 step_index = 0; step_index < count; step_index++)
         {
-            .tag = IOP_MEM,
-            .addr = read_ea(sim, mod, r_m),
-        };
-        result.cycles = 10;
+            if (out) format_instruction(out, steps[step_index].cycles, steps[step_index].instr);
+            else print_instruction(steps[step_index].cycles, steps[step_index].instr);
+        }
+        lines += count;
+        elapsed = get_wall_clock() - start;
     }
+    while (elapsed < 0.5);
 
-    result.source = (instruction_operand)
-    {
-        .tag = IOP_IMM,
-        .imm = read_data_bytes(sim, w, 0),
-    };
-
-    return result;
+    if (out) flush_output(out);
+    else fflush(stdout);
+    return lines / elapsed;
 }
 
-instruction instruction_imm_to_reg(sim8086 *sim, opcode_info *info)
+// Lines per second the execute thread can hand to the trace thread,
+// including the time the trace thread needs to catch up at the end
+double measure_async_trace_rate(trace_step *steps, uint32 count, output_buffer *out)
 {
-    uint8 byte1 = sim->memory[sim->rs.ip++];
-
-    int32 w = (0b00001000 & byte1) >> 3;
-    int32 reg = 0b00000111 & byte1;
-
-    int32 data = read_data_bytes(sim, w, 0);
+    trace_output = out;
+    trace_pipeline *pipe = start_trace_pipeline(TRACE_CYCLES, TRACE_RING_SIZE);
+    if (!pipe)
+    {
+        trace_output = 0;
+        return 0;
+    }
 
-    instruction result =
+    uint64 lines = 0;
+    double start = get_wall_clock();
+    double elapsed = 0;
+    do
     {
-        .tag = info->instruction,
-        .source =
+        for (uint32 step_index = 0; step_index < count; step_index++)
         {
-            .tag = IOP_IMM,
-            .imm = data,
-        },
-        .destination =
-        {
-            .tag = IOP_REG,
-            .reg = reg | (w << 3),
+            queue_trace_instruction(pipe, steps[step_index].cycles, steps[step_index].instr, 0, 0);
         }
-    };
-    switch (info->instruction)
-    {
-    case I_MOV:
-    case I_ADD:
-    case I_SUB:
-    case I_CMP:
-        result.cycles = 4; break;
-    default: break;
+        lines += count;
+        elapsed = get_wall_clock() - start;
     }
+    while (elapsed < 0.5);
 
-    return result;
+    stop_trace_pipeline(pipe);
+    flush_output(out);
+    elapsed = get_wall_clock() - start;
+    trace_output = 0;
+    return lines / elapsed;
 }
 
+void benchmark_trace(sim8086 *sim)
+{
+    uint32 max_steps = 1 << 20;
+    trace_step *steps = malloc(max_steps * sizeof(trace_step));
+    uint32 count = record_trace_steps(sim, steps, max_steps);
+    if (!count)
+    {
+        printf("Nothing to trace\n");
+        return;
+    }
 
-// void mov_memory_and_accumulator(sim8086 *sim, opcode_info *info, bool reverse_order)
-// {
-//     uint8 byte1 = sim->memory[sim->rs.ip++];
+    // Both formatters write to /dev/null, so only formatting is measured
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+
+    double printf_rate = measure_trace_rate(steps, count, 0);
+    output_buffer *out = create_output_buffer(null_fd, TRACE_OUTPUT_SIZE);
+    double buffered_rate = measure_trace_rate(steps, count, out);
+    double async_rate = measure_async_trace_rate(steps, count, out);
+
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    close(null_fd);
+
+    printf("Trace benchmark (%u distinct lines):\n"
+           "    printf:   %12.0f lines/s\n"
+           "    buffered: %12.0f lines/s (x%.2f)\n"
+           "    async:    %12.0f lines/s (x%.2f)\n",
+           count, printf_rate, buffered_rate, buffered_rate / printf_rate,
+           async_rate, async_rate / printf_rate);
+}
 
-//     int32 w = 0b00000001 & byte1;
+// Re-runs the whole program without any output and reports simulated cycles per second.
+void benchmark_run(sim8086 *sim, uint8 *image, uint32 size)
+{
+    uint64 runs = 0;
+    uint64 cycles = 0;
+    double start = get_wall_clock();
+    double elapsed = 0;
+    do
+    {
+        e8086_reset(sim);
+        e8086_load(sim, image, size);
+        e8086_run_until(sim, (e8086_run_limits) { .stop_ip = -1 });
 
-//     int32 addr = read_data_bytes(sim, w, 0);
-//     (void) addr;
+        runs += 1;
+        cycles += e8086_get_state(sim).cycles;
+        elapsed = get_wall_clock() - start;
+    }
+    while (elapsed < 1.0);
 
-    // @todo:
-    // if (reverse_order)
-    //     printf("    %s [%d], ax\n", instruction_names[info->instruction], addr);
-    // else
-    //     printf("    %s ax, [%d]\n", instruction_names[info->instruction], addr);
-// }
+    printf("Run benchmark: %llu runs in %.2fs, %.0f simulated cycles/s\n",
+        runs, elapsed, cycles / elapsed);
+}
 
+#define LOCKSTEP_BENCH_STATES 4096
+#define LOCKSTEP_BENCH_DATA 1000 // random bytes go to [1000, 1256), where the samples keep their data
 
-instruction instruction_imm_to_reg_mem(sim8086 *sim, opcode_info *info)
+uint64 next_random(uint64 *state)
 {
-    uint8 byte1 = sim->memory[sim->rs.ip++];
-    uint8 byte2 = sim->memory[sim->rs.ip++];
-
-    int32 s = 0b00000010 & byte1;
-    int32 w = 0b00000001 & byte1;
-
-    int32 mod = (0b11000000 & byte2) >> 6;
-    int32 opc = (0b00111000 & byte2) >> 3;
-    int32 r_m = (0b00000111 & byte2);
+    // xorshift64
+    uint64 x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
 
-    instruction result = {};
+// memcmp of whole states would compare the padding in front of cycles too
+bool same_state(e8086_state const *a, e8086_state const *b)
+{
+    size_t words = offsetof(e8086_state, flags) + sizeof(a->flags);
+    return memcmp(a, b, words) == 0 && a->cycles == b->cycles;
+}
 
-    switch (opc)
+// Starting state number `index`: random registers, arithmetic flags and 256 bytes of data
+e8086_state random_start_state(uint32 index, uint8 *data)
+{
+    uint64 random = 0x9e3779b97f4a7c15ull * (index + 1);
+    next_random(&random);
+    uint16 words[8];
+    for (uint32 reg = 0; reg < 8; reg++) words[reg] = (uint16) next_random(&random);
+    for (uint32 offset = 0; offset < 256; offset++) data[offset] = (uint8) next_random(&random);
+
+    uint16 arithmetic = FLAG_CF | FLAG_PF | FLAG_AF | FLAG_ZF | FLAG_SF | FLAG_OF;
+    e8086_state state =
     {
-    case 0b000: result.tag = I_ADD; break;
-    case 0b101: result.tag = I_SUB; break;
-    case 0b111: result.tag = I_CMP; break;
-    default:
-        printf("unknown sub_opcode\n");
-        exit(1);
-    }
+        .ax = words[0], .cx = words[1], .dx = words[2], .bx = words[3],
+        .sp = words[4], .bp = words[5], .si = words[6], .di = words[7],
+        .flags = (uint16) next_random(&random) & arithmetic,
+    };
+    return state;
+}
 
-    if (mod == MOD_RM)
+// Runs the program from LOCKSTEP_BENCH_STATES random starting states, once
+// with a simulator per state and once in lockstep groups, and checks that
+// both end every state the same way.
+void benchmark_lockstep(sim8086 *sim, uint8 *image, uint32 size, uint64 max_cycles)
+{
+    e8086_run_limits limits = { .max_cycles = max_cycles ? max_cycles : 1000000, .stop_ip = -1 };
+    e8086_lockstep *group = e8086_lockstep_create(E8086_LOCKSTEP_LANES);
+    uint8 data[256];
+
+    double scalar_time = 0;
+    double lockstep_time = 0;
+    uint32 mismatches = 0;
+    for (uint32 first = 0; first < LOCKSTEP_BENCH_STATES; first += E8086_LOCKSTEP_LANES)
     {
-        result.destination = (instruction_operand)
-        {
-            .tag = IOP_REG,
-            .reg = r_m | (w << 3),
-        };
-        switch (result.tag)
+        double start = get_wall_clock();
+        e8086_lockstep_load(group, image, size);
+        for (uint32 lane = 0; lane < E8086_LOCKSTEP_LANES; lane++)
         {
-        case I_MOV:
-        case I_ADD:
-        case I_SUB:
-        case I_CMP:
-            result.cycles = 4; break;
-        default: break;
+            e8086_state state = random_start_state(first + lane, data);
+            e8086_lockstep_set_state(group, lane, &state);
+            memcpy(e8086_lockstep_memory(group, lane) + LOCKSTEP_BENCH_DATA, data, sizeof(data));
         }
-    }
-    else
-    {
-        result.destination = (instruction_operand)
-        {
-            .tag = IOP_MEM,
-            .addr = read_ea(sim, mod, r_m),
-        };
-        switch (info->instruction)
+        e8086_lockstep_run_until(group, limits);
+        lockstep_time += get_wall_clock() - start;
+
+        for (uint32 lane = 0; lane < E8086_LOCKSTEP_LANES; lane++)
         {
-        case I_MOV: result.cycles = 10; break;
-        case I_ADD: result.cycles = 17; break;
-        case I_SUB: result.cycles = 17; break;
-        case I_CMP: result.cycles = 10; break;
-        default: break;
+            start = get_wall_clock();
+            e8086_reset(sim);
+            e8086_load(sim, image, size);
+            e8086_state state = random_start_state(first + lane, data);
+            e8086_set_state(sim, &state);
+            e8086_write_memory(sim, LOCKSTEP_BENCH_DATA, data, sizeof(data));
+            e8086_status status = e8086_run_until(sim, limits);
+            scalar_time += get_wall_clock() - start;
+
+            e8086_state expected = e8086_get_state(sim);
+            e8086_state actual = e8086_lockstep_get_state(group, lane);
+            if (status != e8086_lockstep_status(group, lane) ||
+                !same_state(&expected, &actual) ||
+                memcmp(e8086_memory(sim), e8086_lockstep_memory(group, lane), SEGMENT_SIZE) != 0)
+            {
+                if (mismatches < 4) printf("State %u differs: %s/%s\n", first + lane,
+                    e8086_status_name(status), e8086_status_name(e8086_lockstep_status(group, lane)));
+                mismatches += 1;
+            }
         }
     }
-
-    result.source = (instruction_operand)
-    {
-        .tag = IOP_IMM,
-        .imm = read_data_bytes(sim, w, s),
-    };
-
-    return result;
+    lockstep_statistics counts = e8086_lockstep_statistics(group);
+    e8086_lockstep_destroy(group);
+
+    printf("Lockstep benchmark: %u starting states, %u differ\n"
+           "    scalar:   %12.0f states/s\n"
+           "    lockstep: %12.0f states/s (x%.2f), %.1f lanes per step, %llu instructions outside the group\n",
+           LOCKSTEP_BENCH_STATES, mismatches,
+           LOCKSTEP_BENCH_STATES / scalar_time,
+           LOCKSTEP_BENCH_STATES / lockstep_time, scalar_time / lockstep_time,
+           counts.steps ? (double) counts.lane_steps / counts.steps : 0.0, counts.scalar_steps);
 }
 
-
-instruction instruction_imm_to_acc(sim8086 *sim, opcode_info *info)
+// Goes back to the middle of the run over and over and runs on to the end
+// from there each time. Once the binary is read again and re-run up to the
+// middle, once a snapshot taken there is restored. Both have to end the
+// way the first run did.
+void benchmark_snapshot(sim8086 *sim, char const *filename, uint64 max_cycles)
 {
-    uint8 byte1 = sim->memory[sim->rs.ip++];
-
-    int32 w = 0b00000001 & byte1;
-    int32 data = read_data_bytes(sim, w, 0);
+    e8086_run_limits limits = { .max_cycles = max_cycles, .stop_ip = -1 };
+    uint8 *image = malloc(SEGMENT_SIZE);
+    uint8 *expected_memory = malloc(MEMORY_SIZE);
 
-    instruction result =
+    // The first run counts the instructions to find the middle
+    FILE *f = fopen(filename, "rb");
+    uint32 size = (uint32) fread(image, 1, SEGMENT_SIZE, f);
+    fclose(f);
+    e8086_reset(sim);
+    e8086_load(sim, image, size);
+    uint64 total = 0;
+    while (!max_cycles || e8086_get_state(sim).cycles < max_cycles)
     {
-        .tag = info->instruction,
-        .source =
-        {
-            .tag = IOP_IMM,
-            .imm = data,
-        },
-        .destination =
+        if (e8086_step(sim) != E8086_OK) break;
+        total += 1;
+    }
+    e8086_state expected = e8086_get_state(sim);
+    memcpy(expected_memory, e8086_memory(sim), MEMORY_SIZE);
+
+    e8086_run_limits to_middle = { .max_cycles = max_cycles, .max_instructions = total / 2, .stop_ip = -1 };
+    e8086_reset(sim);
+    e8086_load(sim, image, size);
+    e8086_run_until(sim, to_middle);
+    e8086_snapshot *middle = e8086_snapshot_create(sim);
+
+    double times[2] = {};
+    uint64 runs[2] = {};
+    uint64 pages_copied = 0;
+    uint32 mismatches = 0;
+    for (uint32 use_snapshot = 0; use_snapshot < 2; use_snapshot++)
+    {
+        double start = get_wall_clock();
+        do
         {
-            .tag = IOP_REG,
-            .reg = w << 3,
+            double restore_start = get_wall_clock();
+            if (use_snapshot)
+            {
+                pages_copied += e8086_snapshot_restore(sim, middle);
+            }
+            else
+            {
+                f = fopen(filename, "rb");
+                size = (uint32) fread(image, 1, SEGMENT_SIZE, f);
+                fclose(f);
+                e8086_reset(sim);
+                e8086_load(sim, image, size);
+                e8086_run_until(sim, to_middle);
+            }
+            times[use_snapshot] += get_wall_clock() - restore_start;
+            runs[use_snapshot] += 1;
+
+            e8086_run_until(sim, limits);
+            e8086_state actual = e8086_get_state(sim);
+            if (!same_state(&expected, &actual) ||
+                memcmp(expected_memory, e8086_memory(sim), MEMORY_SIZE) != 0)
+            {
+                mismatches += 1;
+            }
         }
-    };
-    switch (info->instruction)
-    {
-    case I_MOV:
-    case I_ADD:
-    case I_SUB:
-    case I_CMP:
-        result.cycles = 4; break;
-    default: break;
+        while (get_wall_clock() - start < 1.0);
     }
-    return result;
+    e8086_snapshot_destroy(middle);
+
+    double reload_rate = runs[0] / times[0];
+    double restore_rate = runs[1] / times[1];
+    printf("Snapshot benchmark: back to instruction %llu of %llu, %u runs differ\n"
+           "    reload and re-run: %12.0f/s\n"
+           "    restore:           %12.0f/s (x%.2f), %.1f pages copied\n",
+           total / 2, total, mismatches, reload_rate,
+           restore_rate, restore_rate / reload_rate, (double) pages_copied / runs[1]);
+    free(image);
+    free(expected_memory);
 }
 
-instruction instruction_jumps(sim8086 *sim, opcode_info *info)
-{
-    sim->rs.ip++; // first byte is fully opcode
-    int8 ip_inc8 = sim->memory[sim->rs.ip++];
+#include "batch.c"
 
-    instruction result =
-    {
-        .tag = info->instruction,
-        .destination =
-        {
-            .tag = IOP_IMM,
-            .imm = ip_inc8,
-        },
-    };
-    switch (info->instruction)
-    {
-    case I_JE:  result.cycles = (sim->rs.fz == 1) ? 16 : 4; break;
-    case I_JNE: result.cycles = (sim->rs.fz == 0) ? 16 : 4; break;
-    case I_JS:  result.cycles = (sim->rs.fs == 1) ? 16 : 4; break;
-    case I_JNS: result.cycles = (sim->rs.fs == 0) ? 16 : 4; break;
-    default: result.cycles = 4;
-    }
-    return result;
+// Prints the error of a failed step where the trace is and gives the exit code
+int report_error(sim8086 *sim)
+{
+    char message[80];
+    snprintf(message, sizeof(message), "%s\n", e8086_error(sim));
+    print_message(message);
+    return 1;
 }
 
-instruction decode_next_instruction(sim8086 *sim)
+// Maps up to max_size bytes of a file. The mapping is private and read
+// only, the file is never written through it, and pages are only read
+// from disk once the loader copies them. Empty files map to an empty image.
+uint8 *map_image(char const *path, uint32 max_size, uint32 *size)
 {
-    instruction result = { .tag = I_NOOP };
+    static uint8 empty_image[1];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
 
-    uint8 byte = sim->memory[sim->rs.ip];
-
-    opcode_info info = {};
-    bool found = false;
-    for (int opcode_index = 0; opcode_index < ARRAY_COUNT(opcode_table); opcode_index++)
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
     {
-        info = opcode_table[opcode_index];
-        int32 opcode = (byte & info.mask);
-        if (opcode == info.opcode)
-        {
-            found = true;
-            break;
-        }
-    }
-    if (!found)
-    {
-        printf("Can't find opcode for byte: 0b");
-        print_binary8(byte);
-        printf("\n");
-        exit(1);
+        close(fd);
+        return 0;
     }
+    *size = (info.st_size < max_size) ? (uint32) info.st_size : max_size;
 
-    switch (info.opcode)
+    uint8 *image = empty_image;
+    if (*size)
     {
-    case OPCODE_MOV1: result = instruction_type1(sim, &info); break;
-    case OPCODE_MOV2: result = instruction_mov_imm_to_reg_mem(sim, &info); break;
-    case OPCODE_MOV3: result = instruction_imm_to_reg(sim, &info); break;
-    // case OPCODE_MOV4: mov_memory_and_accumulator(sim, &info, false); break;
-    // case OPCODE_MOV5: mov_memory_and_accumulator(sim, &info, true); break;
-
-    case OPCODE_ADD1: result = instruction_type1(sim, &info); break;
-    case OPCODE_ADD3: result = instruction_imm_to_acc(sim, &info); break;
-
-    case OPCODE_SUB1: result = instruction_type1(sim, &info); break;
-    case OPCODE_SUB3: result = instruction_imm_to_acc(sim, &info); break;
-
-    case OPCODE_CMP1: result = instruction_type1(sim, &info); break;
-    case OPCODE_CMP3: result = instruction_imm_to_acc(sim, &info); break;
-
-    case OPCODE_JE:
-    case OPCODE_JL:
-    case OPCODE_JLE:
-    case OPCODE_JB:
-    case OPCODE_JBE:
-    case OPCODE_JP:
-    case OPCODE_JO:
-    case OPCODE_JS:
-    case OPCODE_JNE:
-    case OPCODE_JNL:
-    case OPCODE_JNLE:
-    case OPCODE_JNB:
-    case OPCODE_JNBE:
-    case OPCODE_JNP:
-    case OPCODE_JNO:
-    case OPCODE_JNS:
-    case OPCODE_LOOP:
-    case OPCODE_LOOPZ:
-    case OPCODE_LOOPNZ:
-    case OPCODE_JCXZ:
-        result = instruction_jumps(sim, &info);
-        break;
-
-    case OPCODE_IMM_TO_REG_MEM:
-        result = instruction_imm_to_reg_mem(sim, &info); break;
-
-    default:
-        printf("Don't know what to do!\n");
-        exit(1);
+        image = mmap(0, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (image == MAP_FAILED) image = 0;
     }
-
-    return result;
+    close(fd);
+    return image;
 }
 
-void choose_register(sim8086 *sim, int32 reg, void **d, int32 *w)
+void unmap_image(uint8 *image, uint32 size)
 {
-    switch (reg)
-    {
-    case R_AL: *d = &sim->rs.al; break;
-    case R_AH: *d = &sim->rs.ah; break;
-    case R_AX: *d = &sim->rs.ax; *w = 1; break;
-
-    case R_BL: *d = &sim->rs.bl; break;
-    case R_BH: *d = &sim->rs.bh; break;
-    case R_BX: *d = &sim->rs.bx; *w = 1; break;
-
-    case R_CL: *d = &sim->rs.cl; break;
-    case R_CH: *d = &sim->rs.ch; break;
-    case R_CX: *d = &sim->rs.cx; *w = 1; break;
-
-    case R_DL: *d = &sim->rs.dl; break;
-    case R_DH: *d = &sim->rs.dh; break;
-    case R_DX: *d = &sim->rs.dx; *w = 1; break;
-
-    case R_BP: *d = &sim->rs.bp; *w = 1; break;
-    case R_SP: *d = &sim->rs.sp; *w = 1; break;
-    case R_DI: *d = &sim->rs.di; *w = 1; break;
-    case R_SI: *d = &sim->rs.si; *w = 1; break;
-    }
+    if (size) munmap(image, size);
 }
 
-#define EXECUTE_INSTRUCTION(INSTR) do { \
-    if (w) { \
-        UPDATE_FLAGS(uint16); \
-        ASSIGN(INSTR, uint16); \
-    } else { \
-        UPDATE_FLAGS(uint8); \
-        ASSIGN(INSTR, uint8); \
-    }} while (false)
-
-void execute_mov(sim8086 *sim, void *d, void *s, int32 w)
+// Writes memory [low, high) as raw bytes, straight from the simulator
+bool dump_memory(sim8086 *sim, char const *path, uint32 low, uint32 high)
 {
-    if (w) *(uint16 *) d = *(uint16 *) s;
-    else   *(uint8  *) d = *(uint8  *) s;
-}
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
 
-#define execute_add_sub(INSTR) \
-    if (w) { \
-        *(uint16 *) d INSTR##= *(uint16 *) s; \
-        sim->rs.fs = ((*(uint16 *) d) >> 15); \
-        sim->rs.fz = ((*(uint16 *) d) == 0); \
-    } else { \
-        *(uint8 *) d INSTR##= *(uint8 *) s; \
-        sim->rs.fs = ((*(uint8 *) d) >> 7); \
-        sim->rs.fz = ((*(uint8 *) d) == 0); \
+    // write only stops early for signals or a full disk
+    uint8 const *at = e8086_memory(sim) + low;
+    uint32 remaining = high - low;
+    while (remaining)
+    {
+        ssize_t written = write(fd, at, remaining);
+        if (written <= 0) break;
+        at += written;
+        remaining -= (uint32) written;
     }
+    return close(fd) == 0 && remaining == 0;
+}
 
-void execute_cmp(sim8086 *sim, void *d, void *s, int32 w)
+#ifndef E8086_NO_MAIN
+int main(int argc, char **argv)
 {
-    if (w)
+    char const *filename = 0;
+    bool bench_decode = false;
+    bool bench_icache = false;
+    bool bench_run = false;
+    bool bench_trace = false;
+    bool bench_lockstep = false;
+    bool bench_snapshot = false;
+    bool use_icache = true;
+    bool print_stats = false;
+    uint32 profile_rows = 0; // 0 if not profiling
+    char const *stats_path = 0;
+    bool stats_csv = false;
+    uint64 stats_every = 0;
+    char const *call_graph_path = 0;
+    bool use_threaded = false;
+    bool use_jit = false;
+    uint32 jit_threshold = 16;
+    trace_level trace = TRACE_NONE;
+    char const *trace_path = 0;
+    bool trace_async = false;
+    uint32 trace_ring_size = TRACE_RING_SIZE;
+    int32 memory_ranges[16][2];
+    uint32 memory_range_count = 0;
+    char dump_path[4096] = {};
+    int32 dump_range[2] = { 0, MEMORY_SIZE };
+    bool batch = false;
+    char const *batch_list = 0;
+    uint32 batch_jobs = (uint32) sysconf(_SC_NPROCESSORS_ONLN);
+    uint64 max_cycles = 0;
+    uint64 goto_cycle = (uint64) -1;
+    uint32 step_back = 0;
+    e8086_record_options record_options = {};
+    char const **paths = malloc(argc * sizeof(char const *));
+    uint32 path_count = 0;
+
+    for (int arg_index = 1; arg_index < argc; arg_index++)
     {
-        uint16 r = *(uint16 *) d - *(uint16 *) s;
-        sim->rs.fs = (r >> 15);
-        sim->rs.fz = (r == 0);
+        char const *arg = argv[arg_index];
+        if (strcmp(arg, "--bench-decode") == 0) bench_decode = true;
+        else if (strcmp(arg, "--bench-icache") == 0) bench_icache = true;
+        else if (strcmp(arg, "--bench") == 0) bench_run = true;
+        else if (strcmp(arg, "--bench-trace") == 0) bench_trace = true;
+        else if (strcmp(arg, "--bench-lockstep") == 0) bench_lockstep = true;
+        else if (strcmp(arg, "--bench-snapshot") == 0) bench_snapshot = true;
+        else if (strcmp(arg, "--no-icache") == 0) use_icache = false;
+        else if (strcmp(arg, "--stats") == 0) print_stats = true;
+        else if (strcmp(arg, "--profile") == 0) profile_rows = PROFILE_DEFAULT_ROWS;
+        else if (strncmp(arg, "--stats-out=", 12) == 0) stats_path = arg + 12;
+        else if (strcmp(arg, "--stats-format=json") == 0) stats_csv = false;
+        else if (strcmp(arg, "--stats-format=csv") == 0) stats_csv = true;
+        else if (strncmp(arg, "--stats-every=", 14) == 0) stats_every = strtoull(arg + 14, 0, 0);
+        else if (strncmp(arg, "--call-graph=", 13) == 0) call_graph_path = arg + 13;
+        else if (strncmp(arg, "--profile=", 10) == 0)
+        {
+            profile_rows = atoi(arg + 10);
+            if (profile_rows == 0)
+            {
+                printf("Bad profile size \'%s\'\n", arg + 10);
+                return 1;
+            }
+        }
+        else if (strcmp(arg, "--batch") == 0) batch = true;
+        else if (strncmp(arg, "--batch-list=", 13) == 0) { batch = true; batch_list = arg + 13; }
+        else if (strncmp(arg, "--jobs=", 7) == 0) batch_jobs = atoi(arg + 7);
+        else if (strncmp(arg, "--max-cycles=", 13) == 0) max_cycles = strtoull(arg + 13, 0, 0);
+        else if (strncmp(arg, "--goto-cycle=", 13) == 0) goto_cycle = strtoull(arg + 13, 0, 0);
+        else if (strncmp(arg, "--step-back=", 12) == 0) step_back = atoi(arg + 12);
+        else if (strncmp(arg, "--checkpoint-cycles=", 20) == 0) record_options.checkpoint_cycles = strtoull(arg + 20, 0, 0);
+        else if (strncmp(arg, "--checkpoint-memory=", 20) == 0) record_options.memory_budget = strtoull(arg + 20, 0, 0);
+        else if (strcmp(arg, "--engine=interpreter") == 0) { use_threaded = false; use_jit = false; }
+        else if (strcmp(arg, "--engine=threaded") == 0) { use_threaded = true; use_jit = false; }
+        else if (strcmp(arg, "--engine=jit") == 0) { use_threaded = true; use_jit = true; }
+        else if (strncmp(arg, "--jit-threshold=", 16) == 0) jit_threshold = atoi(arg + 16);
+        else if (strcmp(arg, "--quiet") == 0) trace = TRACE_NONE;
+        else if (strncmp(arg, "--trace=", 8) == 0)
+        {
+            trace = ARRAY_COUNT(trace_level_names);
+            for (uint32 level = 0; level < ARRAY_COUNT(trace_level_names); level++)
+            {
+                if (strcmp(arg + 8, trace_level_names[level]) == 0) trace = level;
+            }
+            if (trace == ARRAY_COUNT(trace_level_names))
+            {
+                printf("Unknown trace level \'%s\'\n", arg + 8);
+                return 1;
+            }
+        }
+        else if (strncmp(arg, "--trace-out=", 12) == 0) trace_path = arg + 12;
+        else if (strcmp(arg, "--trace-async") == 0) trace_async = true;
+        else if (strncmp(arg, "--trace-ring=", 13) == 0)
+        {
+            trace_async = true;
+            trace_ring_size = atoi(arg + 13);
+            if (trace_ring_size < 2 || trace_ring_size > (1 << 24))
+            {
+                printf("Bad trace ring size \'%s\'\n", arg + 13);
+                return 1;
+            }
+        }
+        else if (strncmp(arg, "--memory=", 9) == 0)
+        {
+            int32 low = 0;
+            int32 high = 0;
+            if (memory_range_count == ARRAY_COUNT(memory_ranges) ||
+                sscanf(arg + 9, "%i:%i", &low, &high) != 2 ||
+                low < 0 || high > MEMORY_SIZE || low >= high)
+            {
+                printf("Bad memory range \'%s\'\n", arg + 9);
+                return 1;
+            }
+            memory_ranges[memory_range_count][0] = low;
+            memory_ranges[memory_range_count][1] = high;
+            memory_range_count += 1;
+        }
+        else if (strncmp(arg, "--dump-memory=", 14) == 0)
+        {
+            // The range is optional, the path ends at the first ':'
+            char const *range = strchr(arg + 14, ':');
+            uint32 length = range ? (uint32) (range - (arg + 14)) : (uint32) strlen(arg + 14);
+            if (length == 0 || length >= sizeof(dump_path) ||
+                (range && (sscanf(range + 1, "%i:%i", &dump_range[0], &dump_range[1]) != 2 ||
+                           dump_range[0] < 0 || dump_range[1] > MEMORY_SIZE || dump_range[0] >= dump_range[1])))
+            {
+                printf("Bad memory dump \'%s\'\n", arg + 14);
+                return 1;
+            }
+            memcpy(dump_path, arg + 14, length);
+            dump_path[length] = 0;
+        }
+        else
+        {
+            filename = arg;
+            paths[path_count++] = arg;
+        }
     }
-    else
+
+    stats_export *stats_out = 0;
+    if (stats_path)
     {
-        uint8 r = *(uint8 *) d - *(uint8 *) s;
-        sim->rs.fs = (r >> 7);
-        sim->rs.fz = (r == 0);
+        stats_out = open_stats_export(stats_path, stats_csv, stats_every);
+        if (!stats_out)
+        {
+            printf("Could not create stats file \'%s\'\n", stats_path);
+            return 1;
+        }
     }
-}
 
-void execute_instruction(sim8086 *sim, instruction i)
-{
-    void *s = 0;
-    void *d = 0;
-    int32 w = 0;
-
-    int32 ea_cycles = 0;
-
-    if (i.destination.tag == IOP_IMM) d = &i.destination.imm;
-    else if (i.destination.tag == IOP_REG) choose_register(sim, i.destination.reg, &d, &w);
-    else if (i.destination.tag == IOP_MEM)
+    if (batch && (path_count || batch_list))
     {
-        d = sim->memory + i.destination.addr.displacement;
-
-        int32 r1 = 0;
-        int32 r2 = 0;
-        if (i.destination.addr.reg_count > 0)
+        if (call_graph_path)
         {
-            void *reg = 0;
-            choose_register(sim, i.destination.addr.reg1, &reg, &w);
-
-            if (w) r1 = *(uint16 *) reg;
-            else r1 = *(uint8 *) reg;
+            printf("--call-graph does not work with --batch\n");
+            return 1;
         }
-        if (i.destination.addr.reg_count > 1)
-        {
-            void *reg = 0;
-            int32 w = 0;
-            choose_register(sim, i.destination.addr.reg2, &reg, &w);
+        return run_batch(paths, path_count, batch_list, batch_jobs, max_cycles, print_stats, profile_rows, stats_out);
+    }
 
-            if (w) r2 = *(uint16 *) reg;
-            else r2 = *(uint8 *) reg;
-        }
+    if (!filename)
+    {
+        printf("e8086 [--quiet] [--trace=none|instructions|cycles|registers] [--trace-out=FILE]\n"
+               "      [--trace-async] [--trace-ring=N] [--memory=LOW:HIGH]... [--dump-memory=FILE[:LOW:HIGH]]\n"
+               "      [--bench-decode] [--bench-icache] [--bench] [--bench-trace] [--no-icache] [--stats] [--profile[=ROWS]]\n"
+               "      [--stats-out=FILE [--stats-format=json|csv] [--stats-every=CYCLES]] [--call-graph=FILE]\n"
+               "      [--bench-lockstep|--bench-snapshot [--max-cycles=N]]\n"
+               "      [--goto-cycle=N] [--step-back=N] [--checkpoint-cycles=N] [--checkpoint-memory=BYTES]\n"
+               "      [--engine=interpreter|threaded|jit] [--jit-threshold=N] <binary_input>\n"
+               "e8086 --batch [--batch-list=FILE] [--jobs=N] [--max-cycles=N] [--stats] [--profile[=ROWS]]\n"
+               "      [--stats-out=FILE [--stats-format=json|csv]]\n"
+               "      <binary_or_directory>...\n");
+        return 1;
+    }
 
-        d += (r1 + r2);
-        ea_cycles = i.destination.addr.cycles;
+    uint32 n = 0;
+    uint8 *image = map_image(filename, SEGMENT_SIZE, &n);
+    if (!image) {
+        printf("Could not open file \'%s\'\n", filename);
+        return 1;
     }
-    else { printf("Error while executing instruction! (d)\n"); exit(1); }
 
-    if (i.source.tag == IOP_IMM) s = &i.source.imm;
-    else if (i.source.tag == IOP_REG) choose_register(sim, i.source.reg, &s, &w);
-    else if (i.source.tag == IOP_MEM)
+    sim8086 *sim = e8086_create();
+    if (!sim)
+    {
+        printf("Could not map memory for the simulator\n");
+        return 1;
+    }
+    e8086_load(sim, image, n);
+    // The simulator has its own copy, only benchmarks that load again need the image
+    if (!bench_lockstep && !bench_run)
     {
-        s = sim->memory + i.source.addr.displacement;
+        unmap_image(image, n);
+        image = 0;
+    }
+    if (!use_icache || use_threaded) e8086_set_instruction_cache(sim, false);
+    uint32 counters = 0;
+    if (print_stats) counters |= E8086_COUNT_BRANCHES;
+    if (profile_rows) counters |= E8086_COUNT_PROFILE;
+    if (stats_out) counters |= E8086_COUNT_STATS;
+    if (call_graph_path) counters |= E8086_COUNT_CALLS;
+    e8086_count(sim, counters);
+
+    if (bench_decode)
+    {
+        benchmark_decode(sim, n);
+        return 0;
+    }
+    if (bench_icache)
+    {
+        benchmark_instruction_cache(sim);
+        return 0;
+    }
+    if (bench_lockstep)
+    {
+        benchmark_lockstep(sim, image, n, max_cycles);
+        unmap_image(image, n);
+        return 0;
+    }
+    if (bench_snapshot)
+    {
+        benchmark_snapshot(sim, filename, max_cycles);
+        return 0;
+    }
+    if (bench_trace)
+    {
+        benchmark_trace(sim);
+        return 0;
+    }
 
-        int32 r1 = 0;
-        int32 r2 = 0;
-        if (i.source.addr.reg_count > 0)
+    if (trace_path)
+    {
+        if (use_threaded)
         {
-            void *reg = 0;
-            choose_register(sim, i.source.addr.reg1, &reg, &w);
-
-            if (w) r1 = *(uint16 *) reg;
-            else r1 = *(uint8 *) reg;
+            printf("--trace-out needs --engine=interpreter\n");
+            return 1;
         }
-        if (i.source.addr.reg_count > 1)
+        trace_file = create_trace_file_writer(trace_path, sim, n);
+        if (!trace_file)
         {
-            void *reg = 0;
-            int32 w = 0;
-            choose_register(sim, i.source.addr.reg2, &reg, &w);
-
-            if (w) r2 = *(uint16 *) reg;
-            else r2 = *(uint8 *) reg;
+            printf("Could not create trace file \'%s\'\n", trace_path);
+            return 1;
         }
-
-        s += (r1 + r2);
-        ea_cycles = i.source.addr.cycles;
+        trace_file_sim = sim;
+        atexit(close_trace_file);
     }
-    // else { printf("Error while executing instruction! (%d)\n", i.source.tag); exit(1); }
 
-    switch (i.tag)
+    // Going back in a run records it first
+    bool record = (goto_cycle != (uint64) -1 || step_back);
+    if (record && (use_threaded || trace != TRACE_NONE || trace_path))
     {
-    case I_MOV: execute_mov(sim, d, s, w);  break;
-    case I_ADD: execute_add_sub(+); break;
-    case I_SUB: execute_add_sub(-); break;
-    case I_CMP: execute_cmp(sim, d, s, w); break;
-    case I_JE:   // zf == 1
-        if (sim->rs.fz == 1) sim->rs.ip += i.destination.imm;
-        break;
-    // case I_JL:   // (sf xor of) == 1
-    // case I_JLE:  // ((sf xor of) or zf) == 1
-    // case I_JB:   // cf == 1
-    // case I_JBE:  // (cf or zf) == 1
-    // case I_JP:   // pf == 1
-    // case I_JO:   // of == 1
-    //     break;
-    case I_JS:   // sf == 1
-        if (sim->rs.fs == 1) sim->rs.ip += i.destination.imm;
-        break;
-
-    case I_JNE:  // zf == 0
-        if (sim->rs.fz == 0) sim->rs.ip += i.destination.imm;
-        break;
-    // case I_JNL:  // (sf xor of) == 0
-    // case I_JNLE: // ((sf xor of) or zf) == 0
-    // case I_JNB:  // cf == 0
-    // case I_JNBE: // (cf or zf) == 0
-    // case I_JNP:  // pf == 0
-    // case I_JNO:  // of == 0
-    case I_JNS:  // sf == 0
-        if (sim->rs.fs == 0) sim->rs.ip += i.destination.imm;
-        break;
-
-    default: printf("Cannot execute given instruction!\n");
+        printf("--goto-cycle and --step-back need --engine=interpreter and no trace\n");
+        return 1;
+    }
+    // Replays for seeking would count instructions again
+    if ((profile_rows || stats_out || call_graph_path) && (use_threaded || record))
+    {
+        printf("--profile, --stats-out and --call-graph need --engine=interpreter and no --goto-cycle or --step-back\n");
+        return 1;
     }
 
-    sim->cycles += i.cycles + ea_cycles;
-}
-
-void print_out_compound_register_state(uint16 rx)
-{
-    uint8 rl = rx >> 8;
-    uint8 rh = rx & (0xff);
-    print_binary8(rl);
-    printf(" ");
-    print_binary8(rh);
-    printf(" (%d|%d; %d)", rl, rh, rx);
-}
-
-void print_out_registers_state(registers *rs)
-{
-    printf("Registers:\n"
-           "    AX: ");
-    print_out_compound_register_state(rs->ax);
-    printf("\n");
-    printf("    BX: ");
-    print_out_compound_register_state(rs->bx);
-    printf("\n");
-    printf("    CX: ");
-    print_out_compound_register_state(rs->cx);
-    printf("\n");
-    printf("    DX: ");
-    print_out_compound_register_state(rs->dx);
-    printf("\n");
-    printf("    SP: ");
-    print_binary16(rs->sp);
-    printf(" (%d)\n", rs->sp);
-    printf("    BP: ");
-    print_binary16(rs->bp);
-    printf(" (%d)\n", rs->bp);
-    printf("    SI: ");
-    print_binary16(rs->si);
-    printf(" (%d)\n", rs->si);
-    printf("    DI: ");
-    print_binary16(rs->di);
-    printf(" (%d)\n", rs->di);
-    printf("    IP: ");
-    print_binary16(rs->ip);
-    printf(" (%d)\n", rs->ip);
-    printf("Flags:\n"
-           "       _ _ _ _ O D I T S Z _ A _ P _ C\n"
-           "                       %d %d\n",
-           rs->fs, rs->fz);
-}
+    if (use_threaded)
+    {
+        e8086_engine engine = e8086_set_engine(sim, use_jit ? E8086_ENGINE_JIT : E8086_ENGINE_THREADED, jit_threshold);
+        if (use_jit && engine != E8086_ENGINE_JIT) printf("JIT is not available, running the threaded engine only\n");
+    }
 
-void print_out_memory_state(sim8086 *sim, int32 low_addr, int32 high_addr)
-{
-    while (low_addr < high_addr)
+    if (bench_run)
     {
-        int32 reminder = low_addr % 16;
-        int32 print_address = low_addr - reminder;
+        benchmark_run(sim, image, n);
+        unmap_image(image, n);
+        return 0;
+    }
 
-        printf("0x%016x | ", print_address);
+    // decoding
 
-        // print reminder of bytes
+    fprintf(stdout, "; read %u bytes\nbits 16\n", n);
 
-        for (int i = 0; i < 16; i++)
+    trace_pipeline *async_trace = 0;
+    e8086_recording *recording = 0;
+    if (record)
+    {
+        // A run that fails can still be gone back in
+        recording = e8086_record_create(sim, record_options);
+        e8086_run_limits limits = { .max_cycles = max_cycles, .stop_ip = -1 };
+        if (e8086_record_run(recording, limits) >= E8086_ERROR_UNKNOWN_OPCODE) report_error(sim);
+
+        if (goto_cycle != (uint64) -1) e8086_seek_cycle(recording, goto_cycle);
+        for (uint32 step = 0; step < step_back && e8086_step_back(recording); step++) {}
+        printf("Instruction: %llu of %llu\n", e8086_record_position(recording), e8086_record_length(recording));
+    }
+    else if (use_threaded || (trace == TRACE_NONE && !trace_file))
+    {
+        // Blocks are not traced instruction by instruction. The run stops
+        // wherever --stats-every has a line due.
+        e8086_status status;
+        do
         {
-            printf("%02x ", sim->memory[print_address + i]);
+            e8086_run_limits limits = { .max_cycles = stats_every ? stats_out->next : 0, .stop_ip = -1 };
+            status = e8086_run_until(sim, limits);
+            if (stats_every) maybe_write_stats(stats_out, sim);
+        }
+        while (status == E8086_CYCLE_LIMIT);
+        if (status != E8086_HALTED) return report_error(sim);
+    }
+    else
+    {
+        if (trace != TRACE_NONE)
+        {
+            fflush(stdout);
+            trace_output = create_output_buffer(STDOUT_FILENO, TRACE_OUTPUT_SIZE);
+            atexit(flush_trace_output);
+            if (trace_async)
+            {
+                trace_pipe = start_trace_pipeline(trace, trace_ring_size);
+                if (!trace_pipe) printf("Could not start the trace thread, tracing synchronously\n");
+                atexit(stop_trace_thread);
+            }
         }
 
-        printf(" | ");
-
-        for (int i = 0; i < 16; i++)
+        for (;;)
         {
-            char c = sim->memory[print_address + i];
-            bool is_ascii = c > 31 && c < 127;
-            printf("%c", is_ascii ? c : '.');
+            executed_step step;
+            e8086_status status = execute_step(sim, &step);
+            if (status == E8086_HALTED) break;
+            if (status != E8086_OK) return report_error(sim);
+            if (stats_every) maybe_write_stats(stats_out, sim);
+            if (trace_file) record_trace_step(trace_file, step.before.ip, step.code, step.length, step.decoded, &step.after);
+            if (trace == TRACE_NONE) continue;
+
+            if (trace_pipe) queue_trace_instruction(trace_pipe, step.before.cycles, step.instr, &step.before, &step.after);
+            else trace_instruction(trace, step.before.cycles, step.instr, &step.before, &step.after);
         }
 
-        printf("\n");
-        low_addr = print_address + 16;
+        async_trace = trace_pipe;
+        stop_trace_thread();
+        flush_trace_output();
+        trace_output = 0;
+        if (trace_file) close_trace_file_writer(trace_file, sim);
     }
-}
 
-int main(int argc, char **argv)
-{
-    if (argc < 2)
+    e8086_state state = e8086_get_state(sim);
+    printf("Cycles: %llu\n", state.cycles);
+    print_out_registers_state(&state);
+    if (memory_range_count == 0)
     {
-        printf("e8086 <binary_input> \n");
-        return 1;
+        print_out_memory_state(e8086_memory(sim), 999, 1024);
     }
-    char const *filename = argv[1];
-
-    FILE *f = fopen(filename, "r");
-    if (!f) {
-        printf("Could not open file \'%s\'\n", filename);
+    for (uint32 range_index = 0; range_index < memory_range_count; range_index++)
+    {
+        print_out_memory_state(e8086_memory(sim), memory_ranges[range_index][0], memory_ranges[range_index][1]);
+    }
+    if (dump_path[0] && !dump_memory(sim, dump_path, dump_range[0], dump_range[1]))
+    {
+        printf("Could not write memory dump \'%s\'\n", dump_path);
         return 1;
     }
 
-    sim8086 sim =
+    if (print_stats)
     {
-        .size = 1 << 16,
-        .memory = malloc(1 << 16),
-    };
-    memset(sim.memory, 0, sim.size);
-
-    size_t n = fread(sim.memory, 1, sim.size, f);
-    fclose(f);
-
-    // decoding
-
-    fprintf(stdout, "; read %zu bytes\nbits 16\n", n);
-
-    while (sim.rs.ip < n)
+        print_out_statistics(sim);
+        if (async_trace) print_out_trace_pipeline_statistics(async_trace);
+        if (recording) print_out_record_statistics(recording);
+    }
+    if (profile_rows) print_out_profile(sim, profile_rows);
+    if (call_graph_path)
     {
-        instruction instr = decode_next_instruction(&sim);
-        print_instruction(sim.cycles, instr);
-        execute_instruction(&sim, instr);
+        print_out_call_graph(e8086_call_graph(sim));
+        if (!write_collapsed_stacks(e8086_call_graph(sim), call_graph_path))
+        {
+            printf("Could not write call graph '%s'\n", call_graph_path);
+            return 1;
+        }
+    }
+    if (stats_out)
+    {
+        write_stats(stats_out, e8086_instruction_stats(sim));
+        if (!close_stats_export(stats_out))
+        {
+            printf("Could not write stats file \'%s\'\n", stats_path);
+            return 1;
+        }
     }
 
-    print_out_registers_state(&sim.rs);
-    print_out_memory_state(&sim, 999, 1024);
-
+    e8086_destroy(sim);
     return 0;
 }
-
+#endif
@@ -0,0 +1,168 @@
+/*
+    Profiles (--profile): where a run spends its cycles.
+
+    With E8086_COUNT_PROFILE (e8086_count), the interpreter adds every
+    instruction it runs to the entry of its IP: how often it ran, its
+    cycles and the effective address cycles among them (count_instruction
+    in e8086.c). That is an add to three counters next to each other, and
+    a branch on a pointer that is 0 when nothing is profiled. The threaded
+    engine and the JIT are not profiled.
+
+    The report sorts IPs by cycles and disassembles them from the code as
+    it is when the run ends. Basic blocks are put together from the
+    profile afterwards: a block starts at an IP a branch or call goes to or
+    falls through to, or where the executed instructions are not next to
+    each other, and ends after a branch, call or return.
+*/
+
+#define PROFILE_DEFAULT_ROWS 20
+
+typedef struct
+{
+    uint16 start;
+    uint16 end; // after the last instruction
+    uint32 instructions;
+    uint64 count; // runs of the first instruction
+    uint64 cycles;
+    uint64 ea_cycles;
+} profile_block;
+
+// Most cycles first, then lower IPs
+bool is_hotter(cycle_counter *profile, uint16 a, uint16 b)
+{
+    uint64 a_cycles = profile[a].cycles + profile[a].ea_cycles;
+    uint64 b_cycles = profile[b].cycles + profile[b].ea_cycles;
+    return a_cycles > b_cycles || (a_cycles == b_cycles && a < b);
+}
+
+int compare_profile_blocks(void const *a, void const *b)
+{
+    profile_block const *x = a;
+    profile_block const *y = b;
+    uint64 x_cycles = x->cycles + x->ea_cycles;
+    uint64 y_cycles = y->cycles + y->ea_cycles;
+    if (x_cycles != y_cycles) return (x_cycles < y_cycles) ? 1 : -1;
+    return x->start - y->start;
+}
+
+// The up to max_count hottest IPs, hottest first. Gives how many there are.
+// An insertion into a short list, so batch workers can call it at the same time.
+uint32 find_hotspots(sim8086 *sim, uint16 *ips, uint32 max_count)
+{
+    cycle_counter *profile = e8086_profile(sim);
+    uint32 image_size = e8086_image_size(sim);
+    uint32 count = 0;
+    for (uint32 ip = 0; ip < image_size; ip++)
+    {
+        if (!profile[ip].count) continue;
+        if (count == max_count && (!count || !is_hotter(profile, (uint16) ip, ips[count - 1]))) continue;
+
+        uint32 at = (count < max_count) ? count++ : count - 1;
+        while (at > 0 && is_hotter(profile, (uint16) ip, ips[at - 1]))
+        {
+            ips[at] = ips[at - 1];
+            at -= 1;
+        }
+        ips[at] = (uint16) ip;
+    }
+    return count;
+}
+
+// Groups the executed instructions into basic blocks, gives how many there are
+uint32 find_profile_blocks(sim8086 *sim, profile_block *blocks)
+{
+    cycle_counter *profile = e8086_profile(sim);
+    uint32 image_size = e8086_image_size(sim);
+    uint8 *code = e8086_code(sim);
+
+    // Branch and call targets and the instructions after branches, calls and returns
+    uint8 *leaders = calloc(SEGMENT_SIZE, 1);
+    for (uint32 ip = 0; ip < image_size; ip++)
+    {
+        instruction instr;
+        uint32 length;
+        if (!profile[ip].count || !(length = e8086_decode(code, (uint16) ip, &instr))) continue;
+        if (!e8086_is_jump(instr.tag) && !e8086_is_call_or_return(instr.tag)) continue;
+        leaders[(uint16) (ip + length)] = 1;
+        if (instr.destination.tag == IOP_IMM && instr.tag != I_RET)
+        {
+            leaders[(uint16) (ip + length + instr.destination.imm)] = 1;
+        }
+    }
+
+    uint32 count = 0;
+    profile_block *current = 0;
+    for (uint32 ip = 0; ip < image_size; ip++)
+    {
+        if (!profile[ip].count) continue;
+        instruction instr;
+        uint32 length = e8086_decode(code, (uint16) ip, &instr);
+
+        if (!current || leaders[ip] || current->end != ip)
+        {
+            current = blocks + count++;
+            *current = (profile_block) { .start = (uint16) ip, .count = profile[ip].count };
+        }
+        current->end = (uint16) (ip + (length ? length : 1));
+        current->instructions += 1;
+        current->cycles += profile[ip].cycles;
+        current->ea_cycles += profile[ip].ea_cycles;
+
+        // Code that changed since is its own block
+        if (!length || e8086_is_jump(instr.tag) || e8086_is_call_or_return(instr.tag)) current = 0;
+    }
+    free(leaders);
+
+    qsort(blocks, count, sizeof(profile_block), compare_profile_blocks);
+    return count;
+}
+
+void print_out_profile(sim8086 *sim, uint32 rows)
+{
+    cycle_counter *profile = e8086_profile(sim);
+    uint32 image_size = e8086_image_size(sim);
+    uint64 instructions = 0;
+    uint64 cycles = 0;
+    uint64 ea_cycles = 0;
+    for (uint32 ip = 0; ip < image_size; ip++)
+    {
+        instructions += profile[ip].count;
+        cycles += profile[ip].cycles;
+        ea_cycles += profile[ip].ea_cycles;
+    }
+    uint64 total = cycles + ea_cycles;
+    printf("Profile: %llu instructions, %llu cycles (%llu + %llu ea)\n", instructions, total, cycles, ea_cycles);
+
+    uint16 *ips = malloc(rows * sizeof(uint16));
+    uint32 ip_count = find_hotspots(sim, ips, rows);
+    printf("    hotspots:\n"
+           "          ip        count       cycles    ea cycles       %%\n");
+    for (uint32 index = 0; index < ip_count; index++)
+    {
+        uint16 ip = ips[index];
+        cycle_counter *entry = profile + ip;
+        uint64 ip_cycles = entry->cycles + entry->ea_cycles;
+        printf("        %04x %12llu %12llu %12llu %6.2f%%",
+            ip, entry->count, ip_cycles, entry->ea_cycles, total ? 100.0 * ip_cycles / total : 0.0);
+
+        instruction instr;
+        if (e8086_decode(e8086_code(sim), ip, &instr)) print_instruction_text(instr);
+        else printf("    (code changed)");
+        printf("\n");
+    }
+    free(ips);
+
+    profile_block *blocks = malloc(SEGMENT_SIZE * sizeof(profile_block));
+    uint32 block_count = find_profile_blocks(sim, blocks);
+    printf("    basic blocks:\n"
+           "          start-end        count       cycles    ea cycles       %%  instructions\n");
+    for (uint32 index = 0; index < block_count && index < rows; index++)
+    {
+        profile_block *b = blocks + index;
+        uint64 block_cycles = b->cycles + b->ea_cycles;
+        printf("        %04x-%04x %12llu %12llu %12llu %6.2f%%  %u\n",
+            b->start, b->end, b->count, block_cycles, b->ea_cycles,
+            total ? 100.0 * block_cycles / total : 0.0, b->instructions);
+    }
+    free(blocks);
+}
@@ -0,0 +1,315 @@
+/*
+    Recordings: checkpoints of a run, to go back to any point of it.
+
+    e8086_record_run runs the simulator and takes a checkpoint every
+    checkpoint_cycles cycles, and one where it stops. A checkpoint holds the
+    registers and the pages written since the one before it, which
+    sim->dirty_pages tells (see snapshot.c). The first checkpoint holds
+    every page that held data then.
+
+    Going to instruction N restores the last checkpoint at or before it and
+    replays from there. Restoring takes every page from the latest
+    checkpoint up to that one that has it, pages none of them has were
+    zero. The simulator has no input,
+    so a replay always ends in the state the recorded run was in. Once
+    there is I/O, its input will have to be recorded next to the
+    checkpoints.
+
+    When the checkpoints need more than memory_budget bytes, every other
+    one is merged into the one after it and the interval doubles. Seeking
+    then replays up to twice as far, but the memory a recording needs
+    stays bounded however long the run is.
+*/
+
+#define CHECKPOINT_SLOT_SIZE MEMORY_PAGE_SIZE
+
+typedef struct
+{
+    uint64 instructions; // executed since the recording started
+    registers rs;
+    uint64 cycles;
+
+    uint32 page_count;
+    uint16 *pages; // which page each slot of data holds
+    uint8 *data;   // page_count slots of CHECKPOINT_SLOT_SIZE
+} checkpoint;
+
+struct e8086_recording
+{
+    sim8086 *sim;
+    uint64 checkpoint_cycles;
+    uint64 memory_budget; // 0 for no limit
+    uint64 memory_used;
+
+    checkpoint *checkpoints;
+    uint32 checkpoint_count;
+    uint32 checkpoint_capacity;
+
+    uint64 position; // instructions from the start to where the simulator is
+    uint64 end;      // instructions recorded
+    e8086_status end_status;
+
+    uint64 replayed; // instructions run again to seek
+    uint32 thinned;  // times every other checkpoint was merged away
+};
+
+static uint64 checkpoint_size(checkpoint *c)
+{
+    return sizeof(checkpoint) + (uint64) c->page_count * (sizeof(uint16) + CHECKPOINT_SLOT_SIZE);
+}
+
+static void free_checkpoint(checkpoint *c)
+{
+    free(c->pages);
+    free(c->data);
+}
+
+// `into` gets the pages of the checkpoint before it that it does not have.
+// Those were not written in between, so they still hold the older bytes.
+static void merge_checkpoint(checkpoint *from, checkpoint *into)
+{
+    bool present[MEMORY_PAGE_COUNT] = {};
+    for (uint32 slot = 0; slot < into->page_count; slot++) present[into->pages[slot]] = true;
+
+    uint32 count = into->page_count;
+    for (uint32 slot = 0; slot < from->page_count; slot++) count += !present[from->pages[slot]];
+    into->pages = realloc(into->pages, count * sizeof(uint16));
+    into->data = realloc(into->data, (uint64) count * CHECKPOINT_SLOT_SIZE);
+
+    for (uint32 slot = 0; slot < from->page_count; slot++)
+    {
+        uint16 page = from->pages[slot];
+        if (present[page]) continue;
+        into->pages[into->page_count] = page;
+        memcpy(into->data + (uint64) into->page_count * CHECKPOINT_SLOT_SIZE,
+            from->data + (uint64) slot * CHECKPOINT_SLOT_SIZE, CHECKPOINT_SLOT_SIZE);
+        into->page_count += 1;
+    }
+    free_checkpoint(from);
+}
+
+// Merges checkpoints 1, 3, 5 and so on into the ones after them. The
+// first one and the last one always stay.
+static void thin_checkpoints(e8086_recording *recording)
+{
+    uint32 kept = 1;
+    for (uint32 index = 1; index < recording->checkpoint_count; index++)
+    {
+        checkpoint *c = recording->checkpoints + index;
+        if ((index & 1) && index + 1 < recording->checkpoint_count) merge_checkpoint(c, c + 1);
+        else recording->checkpoints[kept++] = *c;
+    }
+    recording->checkpoint_count = kept;
+    recording->checkpoint_cycles *= 2;
+    recording->thinned += 1;
+
+    recording->memory_used = 0;
+    for (uint32 index = 0; index < kept; index++) recording->memory_used += checkpoint_size(recording->checkpoints + index);
+}
+
+// Saves the state of the simulator at `position`, with the pages written since the last checkpoint
+static void take_checkpoint(e8086_recording *recording, bool all_pages)
+{
+    sim8086 *sim = recording->sim;
+    if (recording->checkpoint_count == recording->checkpoint_capacity)
+    {
+        recording->checkpoint_capacity = recording->checkpoint_capacity ? recording->checkpoint_capacity * 2 : 64;
+        recording->checkpoints = realloc(recording->checkpoints, recording->checkpoint_capacity * sizeof(checkpoint));
+    }
+
+    checkpoint *c = recording->checkpoints + recording->checkpoint_count++;
+    *c = (checkpoint) { .instructions = recording->position, .rs = sim->rs, .cycles = sim->cycles };
+    for (uint32 page = 0; page < MEMORY_PAGE_COUNT; page++)
+    {
+        c->page_count += sim->dirty_pages[page] || (all_pages && sim->used_pages[page]);
+    }
+    c->pages = malloc(c->page_count * sizeof(uint16));
+    c->data = malloc((uint64) c->page_count * CHECKPOINT_SLOT_SIZE);
+
+    uint32 slot = 0;
+    for (uint32 page = 0; page < MEMORY_PAGE_COUNT; page++)
+    {
+        if (!sim->dirty_pages[page] && !(all_pages && sim->used_pages[page])) continue;
+        c->pages[slot] = (uint16) page;
+        memcpy(c->data + (uint64) slot * CHECKPOINT_SLOT_SIZE, sim->memory + (page << MEMORY_PAGE_SHIFT),
+            CHECKPOINT_SLOT_SIZE);
+        slot += 1;
+    }
+
+    // The dirty pages belong to the recording now, no snapshot can rely on them
+    fold_dirty_pages(sim);
+    sim->snapshot_base = 0;
+
+    recording->memory_used += checkpoint_size(c);
+    while (recording->memory_budget && recording->memory_used > recording->memory_budget &&
+           recording->checkpoint_count > 2)
+    {
+        thin_checkpoints(recording);
+    }
+}
+
+// Puts the simulator where checkpoint `index` was taken
+static void restore_checkpoint(e8086_recording *recording, uint32 index)
+{
+    sim8086 *sim = recording->sim;
+    bool restored[MEMORY_PAGE_COUNT] = {};
+
+    for (uint32 older = index + 1; older-- > 0;)
+    {
+        checkpoint *c = recording->checkpoints + older;
+        for (uint32 slot = 0; slot < c->page_count; slot++)
+        {
+            uint16 page = c->pages[slot];
+            if (restored[page]) continue;
+            restore_page(sim, page, c->data + (uint64) slot * CHECKPOINT_SLOT_SIZE);
+            restored[page] = true;
+        }
+    }
+    for (uint32 page = 0; page < MEMORY_PAGE_COUNT; page++)
+    {
+        bool has_data = sim->used_pages[page] || sim->dirty_pages[page];
+        if (has_data && !restored[page]) restore_page(sim, page, zero_page);
+    }
+
+    checkpoint *c = recording->checkpoints + index;
+    sim->rs = c->rs;
+    sim->cycles = c->cycles;
+    set_error(sim, E8086_OK, "");
+    set_code_segment(sim);
+    fold_dirty_pages(sim);
+    sim->snapshot_base = 0;
+    recording->position = c->instructions;
+}
+
+// Goes to the state after `instructions` instructions, or the first one
+// with at least `cycles` cycles, whichever comes first. Stays at the end
+// of the recording.
+static void seek_recording(e8086_recording *recording, uint64 instructions, uint64 cycles)
+{
+    if (instructions > recording->end) instructions = recording->end;
+
+    // Last checkpoint that is not past either
+    uint32 low = 0;
+    uint32 high = recording->checkpoint_count;
+    while (high - low > 1)
+    {
+        uint32 middle = (low + high) / 2;
+        checkpoint *c = recording->checkpoints + middle;
+        if (c->instructions <= instructions && c->cycles <= cycles) low = middle;
+        else high = middle;
+    }
+    restore_checkpoint(recording, low);
+
+    uint64 count = instructions - recording->position;
+    if (count == 0 || recording->sim->cycles >= cycles) return;
+    e8086_run_limits limits = { .max_instructions = count, .max_cycles = cycles, .stop_ip = -1 };
+
+    uint64 executed;
+    run_until(recording->sim, limits, &executed);
+    recording->position += executed;
+    recording->replayed += executed;
+}
+
+e8086_recording *e8086_record_create(sim8086 *sim, e8086_record_options options)
+{
+    e8086_recording *recording = calloc(1, sizeof(e8086_recording));
+    recording->sim = sim;
+    recording->checkpoint_cycles = options.checkpoint_cycles ? options.checkpoint_cycles : 1000000;
+    recording->memory_budget = options.memory_budget;
+    take_checkpoint(recording, true);
+    return recording;
+}
+
+void e8086_record_destroy(e8086_recording *recording)
+{
+    if (!recording) return;
+    for (uint32 index = 0; index < recording->checkpoint_count; index++)
+    {
+        free_checkpoint(recording->checkpoints + index);
+    }
+    free(recording->checkpoints);
+    free(recording);
+}
+
+e8086_status e8086_record_run(e8086_recording *recording, e8086_run_limits limits)
+{
+    sim8086 *sim = recording->sim;
+
+    // A recording only grows at its end, where its last checkpoint is
+    if (recording->position != recording->end) seek_recording(recording, recording->end, (uint64) -1);
+
+    uint64 max_cycles = limits.max_cycles ? limits.max_cycles : (uint64) -1;
+    uint64 remaining = limits.max_instructions ? limits.max_instructions : (uint64) -1;
+    e8086_status status = E8086_INSTRUCTION_LIMIT;
+    while (remaining)
+    {
+        checkpoint *last = recording->checkpoints + recording->checkpoint_count - 1;
+        uint64 next_checkpoint = last->cycles + recording->checkpoint_cycles;
+        e8086_run_limits part = limits;
+        part.max_cycles = (next_checkpoint < max_cycles) ? next_checkpoint : max_cycles;
+        part.max_instructions = (remaining == (uint64) -1) ? 0 : remaining;
+
+        uint64 executed;
+        status = run_until(sim, part, &executed);
+        recording->position += executed;
+        if (remaining != (uint64) -1) remaining -= executed;
+
+        bool at_checkpoint = (status == E8086_CYCLE_LIMIT && sim->cycles < max_cycles);
+        if (!at_checkpoint) break;
+        take_checkpoint(recording, false);
+    }
+
+    // Seeking to the end should not have to replay
+    if (recording->position != recording->checkpoints[recording->checkpoint_count - 1].instructions)
+    {
+        take_checkpoint(recording, false);
+    }
+    recording->end = recording->position;
+    recording->end_status = status;
+    return status;
+}
+
+unsigned long long e8086_record_position(e8086_recording *recording)
+{
+    return recording->position;
+}
+
+unsigned long long e8086_record_length(e8086_recording *recording)
+{
+    return recording->end;
+}
+
+void e8086_seek_instruction(e8086_recording *recording, unsigned long long instruction)
+{
+    seek_recording(recording, instruction, (uint64) -1);
+}
+
+void e8086_seek_cycle(e8086_recording *recording, unsigned long long cycle)
+{
+    seek_recording(recording, recording->end, cycle);
+}
+
+int e8086_step_back(e8086_recording *recording)
+{
+    if (recording->position == 0) return false;
+    seek_recording(recording, recording->position - 1, (uint64) -1);
+    return true;
+}
+
+recording_statistics e8086_recording_statistics(e8086_recording *recording)
+{
+    recording_statistics result =
+    {
+        .instructions = recording->end,
+        .checkpoint_count = recording->checkpoint_count,
+        .checkpoint_cycles = recording->checkpoint_cycles,
+        .memory_used = recording->memory_used,
+        .thinned = recording->thinned,
+        .replayed = recording->replayed,
+    };
+    for (uint32 index = 0; index < recording->checkpoint_count; index++)
+    {
+        result.pages += recording->checkpoints[index].page_count;
+    }
+    return result;
+}
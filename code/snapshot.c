@@ -0,0 +1,103 @@
+/*
+    Snapshots: registers, cycles and memory of a simulator, to go back to.
+
+    memory_written marks the MEMORY_PAGE_SIZE pages a write touches in
+    sim->dirty_pages. Taking or restoring a snapshot moves the marks to
+    sim->used_pages and makes it the snapshot_base of the simulator, so
+    restoring the base again only has to look at the pages written since.
+    Of those, pages that still hold the saved bytes are left alone, which
+    keeps their cached instructions. Taking a snapshot into the base copies
+    the dirty pages only as well.
+
+    Any other snapshot is restored or taken by going over all pages that
+    hold data, sim->used_pages and dirty_pages. The others are zero and
+    the snapshot keeps nothing for them. Each snapshot gets an id no other
+    snapshot of any simulator has, so a stale base is never mistaken for
+    the right one.
+*/
+
+#include <stdatomic.h>
+
+struct e8086_snapshot
+{
+    uint64 id;
+    registers rs;
+    uint64 cycles;
+    uint32 image_size;
+    uint8 *memory;                       // MEMORY_SIZE bytes, only the saved pages are touched
+    uint8 saved_pages[MEMORY_PAGE_COUNT]; // the others were zero
+};
+
+static atomic_ullong snapshot_ids = 1;
+
+// Puts a saved page back. That is not a guest write, nothing is logged or
+// marked dirty. Returns false if the page already held the saved bytes.
+static bool restore_page(sim8086 *sim, uint32 page, uint8 const *saved)
+{
+    uint32 address = page << MEMORY_PAGE_SHIFT;
+    if (memcmp(sim->memory + address, saved, MEMORY_PAGE_SIZE) == 0) return false;
+    memcpy(sim->memory + address, saved, MEMORY_PAGE_SIZE);
+    invalidate_code(sim, address, MEMORY_PAGE_SIZE);
+    sim->used_pages[page] = 1;
+    return true;
+}
+
+e8086_snapshot *e8086_snapshot_create(sim8086 *sim)
+{
+    e8086_snapshot *snapshot = calloc(1, sizeof(e8086_snapshot));
+    snapshot->memory = malloc(MEMORY_SIZE);
+    e8086_snapshot_take(sim, snapshot);
+    return snapshot;
+}
+
+void e8086_snapshot_destroy(e8086_snapshot *snapshot)
+{
+    if (!snapshot) return;
+    free(snapshot->memory);
+    free(snapshot);
+}
+
+void e8086_snapshot_take(sim8086 *sim, e8086_snapshot *snapshot)
+{
+    bool all = (snapshot->id == 0 || snapshot->id != sim->snapshot_base);
+    for (uint32 page = 0; page < MEMORY_PAGE_COUNT; page++)
+    {
+        bool changed = sim->dirty_pages[page] || (all && sim->used_pages[page]);
+        if (all) snapshot->saved_pages[page] = changed;
+        if (!changed) continue;
+        uint32 address = page << MEMORY_PAGE_SHIFT;
+        memcpy(snapshot->memory + address, sim->memory + address, MEMORY_PAGE_SIZE);
+        snapshot->saved_pages[page] = 1;
+    }
+
+    snapshot->id = atomic_fetch_add(&snapshot_ids, 1);
+    snapshot->rs = sim->rs;
+    snapshot->cycles = sim->cycles;
+    snapshot->image_size = sim->image_size;
+
+    fold_dirty_pages(sim);
+    sim->snapshot_base = snapshot->id;
+}
+
+unsigned int e8086_snapshot_restore(sim8086 *sim, e8086_snapshot const *snapshot)
+{
+    bool all = (snapshot->id != sim->snapshot_base);
+    uint32 copied = 0;
+    for (uint32 page = 0; page < MEMORY_PAGE_COUNT; page++)
+    {
+        bool saved = snapshot->saved_pages[page];
+        if (!sim->dirty_pages[page] && !(all && (saved || sim->used_pages[page]))) continue;
+        uint8 const *bytes = saved ? snapshot->memory + (page << MEMORY_PAGE_SHIFT) : zero_page;
+        if (restore_page(sim, page, bytes)) copied += 1;
+    }
+
+    sim->rs = snapshot->rs;
+    sim->cycles = snapshot->cycles;
+    sim->image_size = snapshot->image_size;
+    set_error(sim, E8086_OK, "");
+    set_code_segment(sim);
+
+    fold_dirty_pages(sim);
+    sim->snapshot_base = snapshot->id;
+    return copied;
+}
@@ -0,0 +1,239 @@
+/*
+    String instructions: MOVS, CMPS, SCAS, LODS and STOS, alone and with a
+    repeat prefix.
+
+    An element is a byte or a word. The source is at DS:SI, or in the
+    segment of a prefix; the destination, and what CMPS and SCAS compare
+    with, is at ES:DI. After an element SI and DI step past it, down with
+    DF set. A repeated instruction runs CX times and counts CX down to 0,
+    CMPS and SCAS stop early after an element that differs (REPE) or is
+    equal (REPNE). It is a single instruction of REP_START_CYCLES plus the
+    cycles of its repetitions; nothing can interrupt it half way.
+
+    step_string runs one element the way the 8086 does. A repeat first
+    gives the host whatever it can do in one go without any difference
+    showing, which needs the addresses to stay inside their segments:
+
+    - REP MOVS is a memmove, unless the ranges overlap so that copying
+      element by element reads bytes it wrote. Going up with the
+      destination at least an element past the source that repeats the
+      bytes in between, so they are copied in doubling runs instead.
+    - REP STOS is a memset, or a fill of words.
+    - REP LODS skips to its last element.
+    - REPE/REPNE SCASB and CMPSB going up look for the byte that stops
+      them with memchr or 16 bytes at a time with SSE2, and skip the
+      bytes before it.
+
+    What is left goes through step_string: the element that stops a scan
+    and sets the flags, the last one, and whatever the host could not do.
+    Registers, flags, memory and cycles end up as if every element had run
+    by itself.
+*/
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Runs one element and steps SI and DI past it. `source_segment` is the
+// segment SI is in.
+static void step_string(sim8086 *sim, instruction *i, uint16 source_segment, int32 step)
+{
+    registers *rs = &sim->rs;
+    int32 w = i->w;
+    uint16 source_split = 0; // words at offset FFFF, see memory_operand
+    uint16 destination_split = 0;
+    uint8 *source = memory_operand(sim, source_segment, rs->si, w, &source_split);
+    uint8 *destination = memory_operand(sim, rs->es, rs->di, w, &destination_split);
+
+    switch (i->tag)
+    {
+    case I_MOVS:
+        execute_mov(sim, destination, source, w);
+        memory_operand_written(sim, destination, rs->es, rs->di, w, &destination_split);
+        rs->si += step;
+        rs->di += step;
+        break;
+    case I_CMPS:
+        execute_cmp(sim, source, destination, w);
+        rs->si += step;
+        rs->di += step;
+        break;
+    case I_SCAS:
+        execute_cmp(sim, &rs->ax, destination, w);
+        rs->di += step;
+        break;
+    case I_LODS:
+        execute_mov(sim, &rs->ax, source, w);
+        rs->si += step;
+        break;
+    case I_STOS:
+        execute_mov(sim, destination, &rs->ax, w);
+        memory_operand_written(sim, destination, rs->es, rs->di, w, &destination_split);
+        rs->di += step;
+        break;
+    default: break;
+    }
+}
+
+// Whether `count` elements from `offset` on stay inside their segment
+static bool string_fits_segment(uint16 offset, uint32 count, int32 step)
+{
+    uint32 size = (step < 0) ? (uint32) -step : (uint32) step;
+    if (step > 0) return offset + count * size <= SEGMENT_SIZE;
+    return offset >= (count - 1) * size && offset + size <= SEGMENT_SIZE;
+}
+
+// Physical address of the lowest of `count` elements from `offset` on,
+// which stay inside their segment
+static uint32 string_low_address(uint16 segment, uint16 offset, uint32 count, int32 step)
+{
+    return segment_address(segment, offset - ((step < 0) ? (count - 1) * (uint32) -step : 0));
+}
+
+// Copies `bytes` from `source` to `destination` as a REP MOVS of `size`
+// byte elements would. Gives false if the overlap does not allow that.
+static bool copy_string(uint8 *memory, uint32 destination, uint32 source, uint32 bytes, uint32 size, int32 step)
+{
+    // A range that runs past 1 MiB can overlap the other one at the start of memory
+    if (destination + bytes > MEMORY_SIZE || source + bytes > MEMORY_SIZE) return false;
+
+    bool overlaps = destination < source + bytes && source < destination + bytes;
+    if (!overlaps || destination == source || (step > 0) == (destination < source))
+    {
+        memmove(memory + destination, memory + source, bytes);
+        return true;
+    }
+
+    // Every element reads bytes the ones before it wrote, a pattern of `distance` bytes
+    uint32 distance = destination - source;
+    if (step < 0 || distance < size) return false;
+    memcpy(memory + destination, memory + source, distance);
+    for (uint32 done = distance; done < bytes; done *= 2)
+    {
+        uint32 run = (done < bytes - done) ? done : bytes - done;
+        memcpy(memory + destination + done, memory + destination, run);
+    }
+    return true;
+}
+
+// Stores `count` copies of AL (AX for words) from `destination` up
+static void fill_string(uint8 *memory, uint32 destination, uint16 value, uint32 count, int32 w)
+{
+    if (!w || (value & 0xff) == (value >> 8))
+    {
+        memset(memory + destination, value & 0xff, w ? 2 * count : count);
+        return;
+    }
+    for (uint32 index = 0; index < count; index++) memcpy(memory + destination + 2 * index, &value, 2);
+}
+
+// Index of the first of `count` bytes at `a` that is equal to (`equal`) or
+// differs from its byte at `b`, or `value` if `b` is 0. `count` if none is.
+static uint32 find_string_stop(uint8 const *a, uint8 const *b, uint8 value, uint32 count, bool equal)
+{
+    uint32 index = 0;
+#if defined(__SSE2__)
+    __m128i values = _mm_set1_epi8((char) value);
+    for (; index + 16 <= count; index += 16)
+    {
+        __m128i x = _mm_loadu_si128((__m128i const *) (a + index));
+        __m128i y = b ? _mm_loadu_si128((__m128i const *) (b + index)) : values;
+        uint32 mask = (uint32) _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+        if (!equal) mask ^= 0xffff;
+        if (mask) return index + (uint32) __builtin_ctz(mask);
+    }
+#endif
+    for (; index < count; index++)
+    {
+        if ((a[index] == (b ? b[index] : value)) == equal) return index;
+    }
+    return count;
+}
+
+// Runs the elements of a repeat the host can do in one go, gives how many
+// that were. SI, DI and memory are as step_string leaves them; the flags of
+// compares are not, the element after the skipped ones sets them.
+static uint32 repeat_string_on_host(sim8086 *sim, instruction *i, uint16 source_segment, int32 step, uint32 count)
+{
+    registers *rs = &sim->rs;
+
+    if (i->tag == I_LODS)
+    {
+        rs->si += (count - 1) * step;
+        return count - 1;
+    }
+
+    bool uses_source = (i->tag == I_MOVS || i->tag == I_CMPS);
+    if (uses_source && !string_fits_segment(rs->si, count, step)) return 0;
+    if (!string_fits_segment(rs->di, count, step)) return 0;
+
+    uint32 size = i->w ? 2 : 1;
+    uint32 source = uses_source ? string_low_address(source_segment, rs->si, count, step) : 0;
+    uint32 destination = string_low_address(rs->es, rs->di, count, step);
+    uint32 done = 0;
+
+    switch (i->tag)
+    {
+    case I_MOVS:
+        if (!copy_string(sim->memory, destination, source, count * size, size, step)) return 0;
+        memory_written(sim, destination, count * size);
+        done = count;
+        break;
+    case I_STOS:
+        fill_string(sim->memory, destination, rs->ax, count, i->w);
+        memory_written(sim, destination, count * size);
+        done = count;
+        break;
+    case I_SCAS:
+    case I_CMPS:
+    {
+        if (i->w || step < 0) return 0;
+        uint8 const *bytes = sim->memory + destination;
+        uint32 stop;
+        if (i->tag == I_SCAS && i->rep == REP_NE)
+        {
+            uint8 const *found = memchr(bytes, rs->al, count);
+            stop = found ? (uint32) (found - bytes) : count;
+        }
+        else
+        {
+            uint8 const *other = (i->tag == I_CMPS) ? sim->memory + source : 0;
+            stop = find_string_stop(bytes, other, rs->al, count, i->rep == REP_NE);
+        }
+        done = (stop < count) ? stop : count - 1;
+    } break;
+    default: break;
+    }
+
+    if (uses_source) rs->si += done * step;
+    rs->di += done * step;
+    return done;
+}
+
+static void execute_string(sim8086 *sim, instruction *i)
+{
+    registers *rs = &sim->rs;
+    effective_address *ea = overridable_ea(i);
+    uint16 source_segment = ea ? rs->segments[ea->segment] : 0;
+    int32 size = i->w ? 2 : 1;
+    int32 step = (rs->flags & FLAG_DF) ? -size : size;
+
+    if (i->rep == REP_NONE)
+    {
+        step_string(sim, i, source_segment, step);
+        sim->cycles += i->cycles;
+        return;
+    }
+
+    uint32 count = rs->cx;
+    uint32 done = count ? repeat_string_on_host(sim, i, source_segment, step, count) : 0;
+    bool compares = (i->tag == I_CMPS || i->tag == I_SCAS);
+    while (done < count)
+    {
+        step_string(sim, i, source_segment, step);
+        done += 1;
+        if (compares && flag_zf(rs) != (i->rep == REP_E)) break;
+    }
+    rs->cx -= done;
+    sim->cycles += i->cycles + done * string_cycles[i->tag - I_MOVS].repeated;
+}
@@ -0,0 +1,549 @@
+/*
+    Threaded-code engine.
+
+    Code is split into basic blocks that end at a jump, loop, call or
+    return instruction.
+    Every instruction of a block is translated once into a micro-op with its
+    operands already resolved: register operands become pointers into
+    sim->rs, effective addresses become two base register pointers plus a
+    displacement and a segment register pointer, and cycles are summed up
+    with the EA cycles. Micro-ops are
+    run with computed goto where the compiler supports it.
+
+    Blocks remember their successors, so a hot loop goes from block to block
+    without looking anything up.
+*/
+
+#if defined(__GNUC__) || defined(__clang__)
+#define THREADED_COMPUTED_GOTO 1
+#else
+#define THREADED_COMPUTED_GOTO 0
+#endif
+
+#define MAX_BLOCK_OPS 64
+
+#define FOR_EACH_SHAPE(X, OP, W) X(OP, W, RR) X(OP, W, RI) X(OP, W, RM) X(OP, W, MR) X(OP, W, MI)
+#define FOR_EACH_WIDTH(X, OP) FOR_EACH_SHAPE(X, OP, 8) FOR_EACH_SHAPE(X, OP, 16)
+#define FOR_EACH_ALU_OP(X) \
+    FOR_EACH_WIDTH(X, MOV) \
+    FOR_EACH_WIDTH(X, ADD) \
+    FOR_EACH_WIDTH(X, SUB) \
+    FOR_EACH_WIDTH(X, CMP)
+
+enum
+{
+    OPERAND_SHAPE_RR, // reg, reg
+    OPERAND_SHAPE_RI, // reg, imm
+    OPERAND_SHAPE_RM, // reg, [ea]
+    OPERAND_SHAPE_MR, // [ea], reg
+    OPERAND_SHAPE_MI, // [ea], imm
+    OPERAND_SHAPE_COUNT,
+};
+
+#define MICRO_OP_ENUM(OP, W, SHAPE) MOP_##OP##W##_##SHAPE,
+
+// Same order as the jumps in instruction_tag
+#define FOR_EACH_BRANCH(X) \
+    X(JE)  X(JL)  X(JLE)  X(JB)  X(JBE)  X(JP)  X(JO)  X(JS) \
+    X(JNE) X(JNL) X(JNLE) X(JNB) X(JNBE) X(JNP) X(JNO) X(JNS) \
+    X(LOOP) X(LOOPZ) X(LOOPNZ) X(JCXZ)
+
+#define BRANCH_ENUM(NAME) MOP_##NAME,
+
+typedef enum
+{
+    // Order of ALU micro-ops is [op][width][shape], see alu_micro_op_kind
+    FOR_EACH_ALU_OP(MICRO_OP_ENUM)
+
+    FOR_EACH_BRANCH(BRANCH_ENUM)
+    MOP_INTERPRET, // run the instruction with execute_instruction
+    MOP_END,       // block ended without a jump
+
+    MOP_COUNT,
+} micro_op_kind;
+
+typedef struct
+{
+    void *handler; // label address, filled on the first run of the block
+    micro_op_kind kind;
+
+    void *dst; // register operands
+    void *src;
+    uint16 *base1; // effective address is *base1 + *base2 + displacement
+    uint16 *base2;
+    uint16 displacement;
+    uint16 *segment;
+    int32 imm;
+
+    int32 cycles; // instruction cycles plus EA cycles
+    uint16 next_ip;
+    uint16 target_ip; // jumps only
+
+    instruction instr; // what the micro-op was translated from
+} micro_op;
+
+typedef struct block block;
+// Gives true when it stopped in front of an instruction it cannot run,
+// with IP at that instruction
+typedef bool (*native_block_proc)(sim8086 *sim, uint8 *memory, uint8 *code_map);
+
+struct block
+{
+    uint32 code_base; // CS * 16 when it was translated
+    uint16 start_ip;
+    uint16 end_ip;
+    bool threaded; // handlers are resolved
+
+    uint32 run_count;
+    bool native_rejected;
+    native_block_proc native; // compiled by the JIT tier, see jit.c
+
+    // Direct links to the blocks that ran after this one
+    uint16 successor_ip[2];
+    block *successor[2];
+
+    uint32 op_count;
+    micro_op ops[];
+};
+
+typedef struct jit_state jit_state;
+static native_block_proc jit_compile_block(jit_state *jit, sim8086 *sim, block *b);
+static void jit_reset(jit_state *jit);
+static void destroy_jit(jit_state *jit);
+
+struct threaded_engine
+{
+    block **blocks; // by start IP
+    uint8 *code_map; // by physical address
+
+    uint16 zero; // base register for effective addresses with less than two registers
+
+    jit_state *jit; // 0 if the JIT tier is off
+    uint32 jit_threshold; // runs of a block before it is compiled
+
+    uint64 blocks_translated;
+    uint64 blocks_executed;
+    uint64 blocks_chained;
+    uint64 flushes;
+};
+
+static threaded_engine *create_threaded_engine(sim8086 *sim)
+{
+    threaded_engine *engine = calloc(1, sizeof(threaded_engine));
+    engine->blocks = calloc(SEGMENT_SIZE, sizeof(block *));
+    engine->code_map = calloc(MEMORY_SIZE, sizeof(uint8));
+    sim->code_map = engine->code_map;
+    sim->threaded = engine;
+    return engine;
+}
+
+static void flush_threaded_engine(threaded_engine *engine)
+{
+    for (uint32 ip = 0; ip < SEGMENT_SIZE; ip++)
+    {
+        block *b = engine->blocks[ip];
+        if (!b) continue;
+        for (uint16 at = b->start_ip; at != b->end_ip; at++)
+        {
+            engine->code_map[(b->code_base + at) & MEMORY_ADDRESS_MASK] = 0;
+        }
+        free(b);
+        engine->blocks[ip] = 0;
+    }
+    if (engine->jit) jit_reset(engine->jit);
+    engine->flushes += 1;
+}
+
+static void destroy_threaded_engine(threaded_engine *engine)
+{
+    for (uint32 ip = 0; ip < SEGMENT_SIZE; ip++) free(engine->blocks[ip]);
+    if (engine->jit) destroy_jit(engine->jit);
+    free(engine->code_map);
+    free(engine->blocks);
+    free(engine);
+}
+
+static bool is_branch_kind(micro_op_kind kind)
+{
+    return (MOP_JE <= kind) && (kind <= MOP_JCXZ);
+}
+
+static void resolve_effective_address(sim8086 *sim, threaded_engine *engine, micro_op *op, effective_address ea)
+{
+    op->base1 = (ea.reg_count > 0) ? choose_register(sim, ea.reg1) : &engine->zero;
+    op->base2 = (ea.reg_count > 1) ? choose_register(sim, ea.reg2) : &engine->zero;
+    op->displacement = (uint16) ea.displacement;
+    op->segment = sim->rs.segments + ea.segment;
+    op->cycles += ea.cycles;
+}
+
+static int32 operand_shape(instruction *i)
+{
+    instruction_operand_tag d = i->destination.tag;
+    instruction_operand_tag s = i->source.tag;
+    if (d == IOP_REG && s == IOP_REG) return OPERAND_SHAPE_RR;
+    if (d == IOP_REG && s == IOP_IMM) return OPERAND_SHAPE_RI;
+    if (d == IOP_REG && s == IOP_MEM) return OPERAND_SHAPE_RM;
+    if (d == IOP_MEM && s == IOP_REG) return OPERAND_SHAPE_MR;
+    if (d == IOP_MEM && s == IOP_IMM) return OPERAND_SHAPE_MI;
+    return -1;
+}
+
+static micro_op_kind alu_micro_op_kind(instruction_tag tag, int32 w, int32 shape)
+{
+    int32 op_index = 0;
+    switch (tag)
+    {
+    case I_MOV: op_index = 0; break;
+    case I_ADD: op_index = 1; break;
+    case I_SUB: op_index = 2; break;
+    case I_CMP: op_index = 3; break;
+    default: return MOP_INTERPRET;
+    }
+    return MOP_MOV8_RR + (op_index * 2 + w) * OPERAND_SHAPE_COUNT + shape;
+}
+
+static micro_op translate_instruction(sim8086 *sim, threaded_engine *engine, instruction i, uint16 next_ip)
+{
+    micro_op op = { .kind = MOP_INTERPRET, .next_ip = next_ip, .cycles = i.cycles, .instr = i };
+
+    int32 shape = operand_shape(&i);
+    if ((i.tag == I_MOV || i.tag == I_ADD || i.tag == I_SUB || i.tag == I_CMP) && shape >= 0)
+    {
+        op.kind = alu_micro_op_kind(i.tag, i.w, shape);
+
+        if (i.destination.tag == IOP_REG) op.dst = choose_register(sim, i.destination.reg);
+        else resolve_effective_address(sim, engine, &op, i.destination.addr);
+
+        if (i.source.tag == IOP_REG) op.src = choose_register(sim, i.source.reg);
+        else if (i.source.tag == IOP_IMM) op.imm = i.source.imm;
+        else resolve_effective_address(sim, engine, &op, i.source.addr);
+    }
+    else if (is_jump(i.tag))
+    {
+        op.kind = MOP_JE + (i.tag - I_JE);
+        op.target_ip = (uint16) (next_ip + i.destination.imm);
+    }
+
+    return op;
+}
+
+// Translation must not stop the program on bytes that are never executed,
+// so blocks end in front of anything the decoder would reject.
+static bool can_decode_at(sim8086 *sim, uint16 ip)
+{
+    opcode_dispatch *entry = opcode_dispatch_table + sim->code[ip];
+
+    // Prefixes go with the instruction after them. More than two may make
+    // it too long, the interpreter reports that.
+    for (uint32 prefixes = 0; entry->decode == instruction_segment_prefix || entry->decode == instruction_rep_prefix; prefixes++)
+    {
+        if (prefixes == 2) return false;
+        ip += 1;
+        entry = opcode_dispatch_table + sim->code[ip];
+    }
+
+    if (!entry->decode || entry->decode == instruction_unsupported) return false;
+    if (entry->decode == instruction_imm_to_reg_mem)
+    {
+        int32 opc = (0b00111000 & sim->code[(uint16) (ip + 1)]) >> 3;
+        return imm_to_reg_mem_group[opc] != I_NOOP;
+    }
+    if (entry->decode == instruction_mov_imm_to_reg_mem) return (0b00111000 & sim->code[(uint16) (ip + 1)]) == 0;
+    if (entry->decode == instruction_segment_mov)
+    {
+        int32 sr = (0b00111000 & sim->code[(uint16) (ip + 1)]) >> 3;
+        return sr <= SEG_DS && !((entry->info.opcode & 0b10) && sr == SEG_CS);
+    }
+    if (entry->decode == instruction_group_ff)
+    {
+        int32 opc = (0b00111000 & sim->code[(uint16) (ip + 1)]) >> 3;
+        return group_ff[opc] != I_NOOP;
+    }
+    if (entry->decode == instruction_pop_reg_mem) return (0b00111000 & sim->code[(uint16) (ip + 1)]) == 0;
+    if (entry->decode == instruction_push_pop_segment)
+    {
+        int32 sr = (0b00011000 & sim->code[ip]) >> 3;
+        return !(entry->info.instruction == I_POP && sr == SEG_CS);
+    }
+    return true;
+}
+
+static block *translate_block(sim8086 *sim, threaded_engine *engine, uint16 start_ip, uint32 end_ip)
+{
+    if (!can_decode_at(sim, start_ip)) return 0;
+
+    micro_op ops[MAX_BLOCK_OPS];
+    uint32 op_count = 0;
+
+    uint16 saved_ip = sim->rs.ip;
+    sim->rs.ip = start_ip;
+    while (op_count < MAX_BLOCK_OPS)
+    {
+        instruction i = decode_next_instruction(sim);
+        ops[op_count++] = translate_instruction(sim, engine, i, sim->rs.ip);
+
+        if (is_jump(i.tag) || is_call_or_return(i.tag)) break;
+        if (sim->rs.ip >= end_ip || sim->rs.ip < start_ip) break;
+        if (!can_decode_at(sim, sim->rs.ip)) break;
+    }
+    uint16 block_end_ip = sim->rs.ip;
+    sim->rs.ip = saved_ip;
+
+    micro_op *last = ops + op_count - 1;
+    bool ends_with_jump = is_branch_kind(last->kind);
+    uint32 total_count = op_count + (ends_with_jump ? 0 : 1);
+
+    block *result = calloc(1, sizeof(block) + total_count * sizeof(micro_op));
+    result->start_ip = start_ip;
+    result->end_ip = block_end_ip;
+    result->op_count = total_count;
+    memcpy(result->ops, ops, op_count * sizeof(micro_op));
+    if (!ends_with_jump)
+    {
+        result->ops[op_count] = (micro_op) { .kind = MOP_END, .next_ip = block_end_ip };
+    }
+
+    result->code_base = (uint32) (sim->code - sim->memory);
+    for (uint16 ip = start_ip; ip != block_end_ip; ip++)
+    {
+        engine->code_map[(result->code_base + ip) & MEMORY_ADDRESS_MASK] = 1;
+    }
+
+    engine->blocks[start_ip] = result;
+    engine->blocks_translated += 1;
+    return result;
+}
+
+static block *get_block(sim8086 *sim, threaded_engine *engine, uint16 ip, uint32 end_ip)
+{
+    block *result = engine->blocks[ip];
+    if (!result) result = translate_block(sim, engine, ip, end_ip);
+    return result;
+}
+
+#define EA_OFFSET(OP) ((uint16) ((OP)->displacement + *(OP)->base1 + *(OP)->base2))
+#define EA_ADDRESS(OP) segment_address(*(OP)->segment, EA_OFFSET(OP))
+
+#define ADDRESS_RR 0
+#define ADDRESS_RI 0
+#define ADDRESS_RM EA_ADDRESS(op)
+#define ADDRESS_MR EA_ADDRESS(op)
+#define ADDRESS_MI EA_ADDRESS(op)
+
+// A word at offset FFFF is not in one piece, execute_instruction takes it
+#define SPLIT_RR 0
+#define SPLIT_RI 0
+#define SPLIT_RM (EA_OFFSET(op) == 0xFFFF)
+#define SPLIT_MR (EA_OFFSET(op) == 0xFFFF)
+#define SPLIT_MI (EA_OFFSET(op) == 0xFFFF)
+
+#define DST_RR(TYPE) ((TYPE *) op->dst)
+#define DST_RI(TYPE) ((TYPE *) op->dst)
+#define DST_RM(TYPE) ((TYPE *) op->dst)
+#define DST_MR(TYPE) ((TYPE *) (sim->memory + address))
+#define DST_MI(TYPE) ((TYPE *) (sim->memory + address))
+
+#define SRC_RR(TYPE) (*(TYPE *) op->src)
+#define SRC_RI(TYPE) ((TYPE) op->imm)
+#define SRC_RM(TYPE) (*(TYPE *) (sim->memory + address))
+#define SRC_MR(TYPE) (*(TYPE *) op->src)
+#define SRC_MI(TYPE) ((TYPE) op->imm)
+
+#define DST_IS_MEMORY_RR 0
+#define DST_IS_MEMORY_RI 0
+#define DST_IS_MEMORY_RM 0
+#define DST_IS_MEMORY_MR 1
+#define DST_IS_MEMORY_MI 1
+
+#define WRITES_MOV 1
+#define WRITES_ADD 1
+#define WRITES_SUB 1
+#define WRITES_CMP 0
+
+#define ALU_MOV(W, D, S) *(D) = (S);
+#define RECORD_FLAGS(FLAGS_OP, W, D, S, R) \
+    sim->rs.lazy = (lazy_flags) { .op = FLAGS_OP, .w = (W == 16), .dst = D, .src = S, .result = R };
+
+#define ALU_ADD(W, D, S) { uint##W d = *(D); uint##W s = (S); uint##W r = d + s; *(D) = r; RECORD_FLAGS(FLAGS_OP_ADD, W, d, s, r) }
+#define ALU_SUB(W, D, S) { uint##W d = *(D); uint##W s = (S); uint##W r = d - s; *(D) = r; RECORD_FLAGS(FLAGS_OP_SUB, W, d, s, r) }
+#define ALU_CMP(W, D, S) { uint##W d = *(D); uint##W s = (S); uint##W r = d - s; RECORD_FLAGS(FLAGS_OP_SUB, W, d, s, r) }
+
+#if THREADED_COMPUTED_GOTO
+#define HANDLER(KIND) KIND##_handler:
+#define DISPATCH() goto *op->handler
+#define MICRO_OP_LABEL(OP, W, SHAPE) [MOP_##OP##W##_##SHAPE] = &&MOP_##OP##W##_##SHAPE##_handler,
+#define BRANCH_LABEL(NAME) [MOP_##NAME] = &&MOP_##NAME##_handler,
+#else
+#define HANDLER(KIND) case KIND:
+#define DISPATCH() goto dispatch
+#endif
+
+#define NEXT() op++; DISPATCH()
+
+#define ALU_HANDLER(OP, W, SHAPE) \
+    HANDLER(MOP_##OP##W##_##SHAPE) \
+    { \
+        if (W == 16 && SPLIT_##SHAPE) goto interpret; \
+        uint32 address = ADDRESS_##SHAPE; \
+        (void) address; \
+        ALU_##OP(W, DST_##SHAPE(uint##W), SRC_##SHAPE(uint##W)) \
+        sim->cycles += op->cycles; \
+        if (WRITES_##OP && DST_IS_MEMORY_##SHAPE) \
+        { \
+            memory_written(sim, address, W / 8); \
+            if (sim->code_modified) { sim->rs.ip = op->next_ip; goto block_exit; } \
+        } \
+        NEXT(); \
+    }
+
+#define BRANCH_HANDLER(NAME) \
+    HANDLER(MOP_##NAME) \
+    { \
+        bool taken = evaluate_branch(&sim->rs, I_##NAME); \
+        sim->rs.ip = taken ? op->target_ip : op->next_ip; \
+        sim->cycles += branch_cycles(I_##NAME, taken); \
+        count_branch(sim, op->next_ip - 2, taken); \
+        goto block_exit; \
+    }
+
+// Runs the program until IP leaves [0, end_ip), same as the interpreter loop.
+// Returns E8086_HALTED then, or the error of the instruction that failed.
+static e8086_status run_threaded(sim8086 *sim, threaded_engine *engine, uint32 end_ip)
+{
+#if THREADED_COMPUTED_GOTO
+    static void *labels[MOP_COUNT] =
+    {
+        FOR_EACH_ALU_OP(MICRO_OP_LABEL)
+        FOR_EACH_BRANCH(BRANCH_LABEL)
+        [MOP_INTERPRET] = &&MOP_INTERPRET_handler,
+        [MOP_END] = &&MOP_END_handler,
+    };
+#endif
+
+    // CS may have moved since the last run
+    if (sim->code_modified)
+    {
+        flush_threaded_engine(engine);
+        sim->code_modified = false;
+    }
+
+    block *current = 0;
+    while (sim->rs.ip < end_ip)
+    {
+        uint16 ip = sim->rs.ip;
+
+        block *next = 0;
+        if (current && current->successor_ip[0] == ip) next = current->successor[0];
+        else if (current && current->successor_ip[1] == ip) next = current->successor[1];
+
+        if (next)
+        {
+            engine->blocks_chained += 1;
+        }
+        else
+        {
+            next = get_block(sim, engine, ip, end_ip);
+            if (!next)
+            {
+                // Not decodable, let the interpreter report it
+                instruction instr = decode_next_instruction(sim);
+                execute_instruction(sim, &instr);
+                if (sim->error)
+                {
+                    sim->rs.ip = ip;
+                    return sim->error;
+                }
+                current = 0;
+                continue;
+            }
+            if (current)
+            {
+                // First successor seen keeps slot 0, the other path takes slot 1.
+                int32 slot = current->successor[0] ? 1 : 0;
+                current->successor_ip[slot] = ip;
+                current->successor[slot] = next;
+            }
+        }
+
+        current = next;
+        engine->blocks_executed += 1;
+
+        if (engine->jit && !current->native && !current->native_rejected)
+        {
+            current->run_count += 1;
+            if (current->run_count >= engine->jit_threshold)
+            {
+                current->native = jit_compile_block(engine->jit, sim, current);
+                current->native_rejected = (current->native == 0);
+            }
+        }
+        micro_op *op = current->ops;
+        if (current->native)
+        {
+            if (!current->native(sim, sim->memory, sim->code_map)) goto block_exit;
+            // The micro-ops go on from where native code stopped
+            for (uint16 at = current->start_ip; at != sim->rs.ip; op++) at = op->next_ip;
+        }
+
+#if THREADED_COMPUTED_GOTO
+        if (!current->threaded)
+        {
+            for (uint32 op_index = 0; op_index < current->op_count; op_index++)
+            {
+                current->ops[op_index].handler = labels[current->ops[op_index].kind];
+            }
+            current->threaded = true;
+        }
+#endif
+
+#if THREADED_COMPUTED_GOTO
+        DISPATCH();
+#else
+    dispatch:
+        switch (op->kind)
+        {
+#endif
+
+        FOR_EACH_ALU_OP(ALU_HANDLER)
+
+        FOR_EACH_BRANCH(BRANCH_HANDLER)
+
+        HANDLER(MOP_INTERPRET)
+        interpret:
+        {
+            sim->rs.ip = op->next_ip;
+            execute_instruction(sim, &op->instr);
+            if (sim->error)
+            {
+                // Back to the start of the instruction, as e8086_step leaves it
+                sim->rs.ip = (op == current->ops) ? current->start_ip : op[-1].next_ip;
+                return sim->error;
+            }
+            // CALL and RET leave the block, they are the last instruction of one
+            if (sim->code_modified || sim->rs.ip != op->next_ip) goto block_exit;
+            NEXT();
+        }
+
+        HANDLER(MOP_END)
+        {
+            sim->rs.ip = op->next_ip;
+            goto block_exit;
+        }
+
+#if !THREADED_COMPUTED_GOTO
+        default: break;
+        }
+#endif
+
+    block_exit:
+        if (sim->code_modified)
+        {
+            // Translated code is stale, successor links included.
+            flush_threaded_engine(engine);
+            sim->code_modified = false;
+            current = 0;
+        }
+    }
+    return E8086_HALTED;
+}
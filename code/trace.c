@@ -0,0 +1,324 @@
+/*
+    Trace output.
+
+    Trace lines are formatted straight into a large buffer that is written
+    out with write(2) when it fills up. Integers are converted by hand,
+    mnemonics and registers are copied from strings prepared once, so a
+    trace line costs a few memcpy's instead of a chain of printf calls.
+    The text is the same as print_instruction produces.
+
+    While a trace is being written, everything else the emulator prints
+    during the run has to go through print_message, otherwise it would
+    overtake the buffered lines.
+*/
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define TRACE_OUTPUT_SIZE (1 << 20)
+#define TRACE_LINE_MAX 256 // longer than any trace line
+
+typedef struct
+{
+    char *data;
+    uint32 used;
+    uint32 size;
+    int fd;
+} output_buffer;
+
+output_buffer *trace_output; // 0 unless a trace is being written
+
+typedef struct
+{
+    char text[16];
+    uint32 length;
+} short_string;
+
+short_string instruction_prefixes[INSTRUCTION_TAG_COUNT]; // "    MOV "
+
+typedef enum
+{
+    TRACE_NONE,
+    TRACE_INSTRUCTIONS,
+    TRACE_CYCLES,    // instructions with their cycles
+    TRACE_REGISTERS, // instructions with the registers and flags they changed
+} trace_level;
+
+char const *trace_level_names[] = { "none", "instructions", "cycles", "registers" };
+
+output_buffer *create_output_buffer(int fd, uint32 size)
+{
+    output_buffer *out = calloc(1, sizeof(output_buffer));
+    out->data = malloc(size);
+    out->size = size;
+    out->fd = fd;
+
+    for (uint32 tag = 0; tag < INSTRUCTION_TAG_COUNT; tag++)
+    {
+        short_string *prefix = instruction_prefixes + tag;
+        prefix->length = snprintf(prefix->text, sizeof(prefix->text), "    %s ", e8086_instruction_names[tag]);
+    }
+    return out;
+}
+
+void flush_output(output_buffer *out)
+{
+    uint32 written = 0;
+    while (written < out->used)
+    {
+        ssize_t count = write(out->fd, out->data + written, out->used - written);
+        if (count <= 0) break;
+        written += (uint32) count;
+    }
+    out->used = 0;
+}
+
+// Called on exit, so lines in front of a fatal error are not lost
+void flush_trace_output(void)
+{
+    if (trace_output) flush_output(trace_output);
+}
+
+// Makes room for a whole line, so the formatters below need no checks
+char *output_reserve(output_buffer *out, uint32 count)
+{
+    if (out->used + count > out->size) flush_output(out);
+    return out->data + out->used;
+}
+
+void output_bytes(output_buffer *out, char const *bytes, uint32 count)
+{
+    memcpy(out->data + out->used, bytes, count);
+    out->used += count;
+}
+
+void output_string(output_buffer *out, char const *string)
+{
+    output_bytes(out, string, (uint32) strlen(string));
+}
+
+void output_char(output_buffer *out, char c)
+{
+    out->data[out->used++] = c;
+}
+
+// Same text as printf("%d")
+void output_int(output_buffer *out, int32 value)
+{
+    char digits[12];
+    uint32 count = 0;
+    uint32 magnitude = (value < 0) ? 0u - (uint32) value : (uint32) value;
+    do
+    {
+        digits[count++] = '0' + (magnitude % 10);
+        magnitude /= 10;
+    }
+    while (magnitude);
+
+    if (value < 0) output_char(out, '-');
+    while (count) output_char(out, digits[--count]);
+}
+
+// Same text as printf("0x%04x")
+void output_uint64(output_buffer *out, uint64 value)
+{
+    char digits[20];
+    uint32 count = 0;
+    do
+    {
+        digits[count++] = '0' + (value % 10);
+        value /= 10;
+    }
+    while (value);
+
+    while (count) output_char(out, digits[--count]);
+}
+
+void output_hex16(output_buffer *out, uint16 value)
+{
+    char const *hex_digits = "0123456789abcdef";
+    char *at = out->data + out->used;
+    at[0] = '0';
+    at[1] = 'x';
+    at[2] = hex_digits[(value >> 12) & 0xf];
+    at[3] = hex_digits[(value >> 8) & 0xf];
+    at[4] = hex_digits[(value >> 4) & 0xf];
+    at[5] = hex_digits[value & 0xf];
+    out->used += 6;
+}
+
+bool queue_trace_message(char const *message); // trace_thread.c
+
+void print_message(char const *message)
+{
+    if (queue_trace_message(message)) return;
+    if (!trace_output)
+    {
+        printf("%s", message);
+        return;
+    }
+    output_reserve(trace_output, (uint32) strlen(message));
+    output_string(trace_output, message);
+}
+
+void format_ea(output_buffer *out, effective_address ea)
+{
+    if (ea.segment_prefix)
+    {
+        output_bytes(out, e8086_register_names[R_ES + ea.segment], 2);
+        output_char(out, ':');
+    }
+    output_char(out, '[');
+    if (ea.reg_count == 0)
+    {
+        output_int(out, (int32) ea.displacement);
+        output_char(out, ']');
+        return;
+    }
+
+    output_bytes(out, e8086_register_names[ea.reg1 | 0b1000], 2);
+    if (ea.reg_count == 2)
+    {
+        output_bytes(out, " + ", 3);
+        output_bytes(out, e8086_register_names[ea.reg2 | 0b1000], 2);
+    }
+    if (ea.displacement != 0)
+    {
+        output_bytes(out, " + ", 3);
+        output_int(out, (int32) ea.displacement);
+    }
+    output_char(out, ']');
+}
+
+void format_instruction_operand(output_buffer *out, instruction_operand iop)
+{
+    switch (iop.tag)
+    {
+    case IOPERAND_NONE: break;
+    case IOP_IMM: output_int(out, iop.imm); break;
+    case IOP_REG: output_bytes(out, e8086_register_names[iop.reg], 2); break;
+    case IOP_MEM: format_ea(out, iop.addr); break;
+    }
+}
+
+// Returns the length of the text, for the padding in front of cycles
+uint32 format_instruction_text(output_buffer *out, instruction i)
+{
+    uint32 start = out->used;
+    short_string *prefix = instruction_prefixes + i.tag;
+    if (i.rep != REP_NONE)
+    {
+        // "    REPNE " and the name without its indent
+        output_bytes(out, prefix->text, 4);
+        output_string(out, e8086_rep_prefix_name(&i));
+        output_bytes(out, prefix->text + 4, prefix->length - 4);
+    }
+    else output_bytes(out, prefix->text, prefix->length);
+    format_instruction_operand(out, i.destination);
+    if (i.source.tag != IOPERAND_NONE)
+    {
+        output_bytes(out, ", ", 2);
+        format_instruction_operand(out, i.source);
+    }
+    return out->used - start;
+}
+
+// Same text as print_instruction
+void format_instruction(output_buffer *out, uint64 cycles, instruction i)
+{
+    output_reserve(out, TRACE_LINE_MAX);
+    uint32 n = format_instruction_text(out, i);
+
+    // printf("%.*s") with a negative precision prints all of `spaces`
+    uint32 padding = (n <= 30) ? 30 - n : (uint32) strlen(spaces);
+    output_bytes(out, spaces, padding);
+
+    int32 ea_cycles = (i.destination.tag == IOP_MEM) ? i.destination.addr.cycles
+                    : (i.source.tag == IOP_MEM) ? i.source.addr.cycles
+                    : 0;
+    if (ea_cycles > 0)
+    {
+        output_int(out, i.cycles + ea_cycles);
+        output_bytes(out, " = ", 3);
+        output_int(out, i.cycles);
+        output_bytes(out, " + ", 3);
+        output_int(out, ea_cycles);
+        output_string(out, "ea cycles (overall: ");
+    }
+    else
+    {
+        output_int(out, i.cycles);
+        output_string(out, " (overall: ");
+    }
+    output_uint64(out, cycles + i.cycles + ea_cycles);
+    output_bytes(out, ")\n", 2);
+}
+
+void format_flag_letters(output_buffer *out, uint16 flags)
+{
+    if (flags & FLAG_CF) output_char(out, 'C');
+    if (flags & FLAG_PF) output_char(out, 'P');
+    if (flags & FLAG_AF) output_char(out, 'A');
+    if (flags & FLAG_ZF) output_char(out, 'Z');
+    if (flags & FLAG_SF) output_char(out, 'S');
+    if (flags & FLAG_DF) output_char(out, 'D');
+    if (flags & FLAG_OF) output_char(out, 'O');
+}
+
+void format_register_deltas(output_buffer *out, e8086_state *before, e8086_state *after)
+{
+    uint16 *old_values[] = { &before->ax, &before->bx, &before->cx, &before->dx,
+                             &before->sp, &before->bp, &before->si, &before->di,
+                             &before->es, &before->cs, &before->ss, &before->ds };
+    uint16 *new_values[] = { &after->ax, &after->bx, &after->cx, &after->dx,
+                             &after->sp, &after->bp, &after->si, &after->di,
+                             &after->es, &after->cs, &after->ss, &after->ds };
+    char const *names[] = { "ax", "bx", "cx", "dx", "sp", "bp", "si", "di", "es", "cs", "ss", "ds" };
+
+    char const *separator = " ;"; // only printed when something changed
+    for (uint32 index = 0; index < ARRAY_COUNT(names); index++)
+    {
+        if (*old_values[index] == *new_values[index]) continue;
+        output_string(out, separator);
+        output_char(out, ' ');
+        output_bytes(out, names[index], 2);
+        output_char(out, ':');
+        output_hex16(out, *old_values[index]);
+        output_bytes(out, "->", 2);
+        output_hex16(out, *new_values[index]);
+        separator = "";
+    }
+    uint16 old_flags = before->flags;
+    uint16 new_flags = after->flags;
+    if (old_flags != new_flags)
+    {
+        output_string(out, separator);
+        output_string(out, " flags:");
+        format_flag_letters(out, old_flags);
+        output_bytes(out, "->", 2);
+        format_flag_letters(out, new_flags);
+    }
+}
+
+void trace_instruction(trace_level trace, uint64 cycles, instruction i, e8086_state *before, e8086_state *after)
+{
+    output_buffer *out = trace_output;
+    switch (trace)
+    {
+    case TRACE_INSTRUCTIONS:
+        output_reserve(out, TRACE_LINE_MAX);
+        format_instruction_text(out, i);
+        output_char(out, '\n');
+        break;
+    case TRACE_CYCLES:
+        format_instruction(out, cycles, i);
+        break;
+    case TRACE_REGISTERS:
+        output_reserve(out, TRACE_LINE_MAX);
+        format_instruction_text(out, i);
+        format_register_deltas(out, before, after);
+        output_char(out, '\n');
+        break;
+    default: break;
+    }
+}
@@ -0,0 +1,650 @@
+/*
+    Binary trace files (.e86t).
+
+    --trace-out writes one record per executed instruction, usually a few
+    bytes, and e8086-trace turns the file back into the text trace. All
+    numbers are little-endian.
+
+        file:    header, chunks, index, trailer
+        header:  "E86T", uint16 version, uint16 load segment, uint32 image
+                 size, the program image (at load segment:0)
+        chunk:   "E86C", uint32 body size, uint32 step count,
+                 uint64 first step, state before the first step, records
+        index:   "E86I", uint32 chunk count, for every chunk its uint64 file
+                 offset and uint64 first step, then the state after the
+                 last step
+        trailer: uint64 index offset, "E86E"
+        state:   uint64 cycles, uint16 ax bx cx dx sp bp si di ip flags
+                 es cs ss ds
+
+    Records only hold what changed against the previous record, and every
+    chunk starts from a full state, so a chunk can be decoded without the
+    ones before it. Readers find chunks through the index.
+
+    A record is a flags byte followed by the fields it selects, in order:
+
+        RECORD_IP         zigzag varint IP delta against the end of the
+                          previous instruction, when execution jumped
+        RECORD_CODE       uint8 length and the instruction bytes. They are
+                          stored the first time an address runs in a chunk
+                          and when the code there changes, otherwise the
+                          instruction is the one stored for its address.
+        RECORD_REGISTERS  uint8 mask of changed registers (ax bx cx dx sp
+                          bp si di), then a zigzag varint delta for each
+        RECORD_FLAGS      uint16 FLAGS word
+        RECORD_WRITES     varint write count, then for each write a varint
+                          physical address, varint length and the bytes
+                          written
+        RECORD_CYCLES     varint cycles, when they differ from the cost of
+                          the decoded instruction (branches, repeats)
+        RECORD_SEGMENTS   uint8 mask of changed segment registers (es cs
+                          ss ds), then the uint16 value of each
+
+    Only version 3 files are read. Version 2 had int32 cycles in states,
+    version 1 no segment registers and uint16 write addresses.
+
+    Messages printed while the program runs are not recorded.
+*/
+
+#define TRACE_FILE_VERSION 3
+#define TRACE_CHUNK_STEPS (1 << 14)
+
+enum
+{
+    RECORD_IP        = (1 << 0),
+    RECORD_CODE      = (1 << 1),
+    RECORD_REGISTERS = (1 << 2),
+    RECORD_FLAGS     = (1 << 3),
+    RECORD_WRITES    = (1 << 4),
+    RECORD_CYCLES    = (1 << 5),
+    RECORD_SEGMENTS  = (1 << 6),
+};
+
+#define TRACE_STATE_SIZE (8 + 14 * 2)
+
+typedef struct
+{
+    uint64 cycles;
+    uint16 regs[8]; // ax bx cx dx sp bp si di
+    uint16 ip;
+    uint16 flags;
+    uint16 segments[4]; // es cs ss ds
+} trace_state;
+
+typedef struct
+{
+    uint8 length; // 0 if nothing is stored for the address in this chunk
+    uint8 bytes[MAX_INSTRUCTION_LENGTH];
+} recorded_code;
+
+typedef struct
+{
+    uint8 *data;
+    uint32 used;
+    uint32 capacity;
+} byte_buffer;
+
+void put_byte(byte_buffer *buffer, uint8 value)
+{
+    if (buffer->used == buffer->capacity)
+    {
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    buffer->data[buffer->used++] = value;
+}
+
+void put_bytes(byte_buffer *buffer, void const *bytes, uint32 count)
+{
+    for (uint32 index = 0; index < count; index++) put_byte(buffer, ((uint8 const *) bytes)[index]);
+}
+
+void put_u16(byte_buffer *buffer, uint16 value) { put_bytes(buffer, &value, 2); }
+void put_u32(byte_buffer *buffer, uint32 value) { put_bytes(buffer, &value, 4); }
+void put_u64(byte_buffer *buffer, uint64 value) { put_bytes(buffer, &value, 8); }
+
+void put_varint(byte_buffer *buffer, uint32 value)
+{
+    while (value >= 0x80)
+    {
+        put_byte(buffer, (uint8) (value | 0x80));
+        value >>= 7;
+    }
+    put_byte(buffer, (uint8) value);
+}
+
+void put_signed_varint(byte_buffer *buffer, int32 value)
+{
+    put_varint(buffer, ((uint32) value << 1) ^ (uint32) (value >> 31));
+}
+
+void put_trace_state(byte_buffer *buffer, trace_state *state)
+{
+    put_u64(buffer, state->cycles);
+    for (uint32 index = 0; index < 8; index++) put_u16(buffer, state->regs[index]);
+    put_u16(buffer, state->ip);
+    put_u16(buffer, state->flags);
+    for (uint32 index = 0; index < 4; index++) put_u16(buffer, state->segments[index]);
+}
+
+trace_state capture_trace_state(e8086_state *state)
+{
+    trace_state result =
+    {
+        .cycles = state->cycles,
+        .regs = { state->ax, state->bx, state->cx, state->dx, state->sp, state->bp, state->si, state->di },
+        .ip = state->ip,
+        .flags = state->flags,
+        .segments = { state->es, state->cs, state->ss, state->ds },
+    };
+    return result;
+}
+
+e8086_state state_from_trace_state(trace_state *state)
+{
+    e8086_state result =
+    {
+        .ax = state->regs[0], .bx = state->regs[1], .cx = state->regs[2], .dx = state->regs[3],
+        .sp = state->regs[4], .bp = state->regs[5], .si = state->regs[6], .di = state->regs[7],
+        .es = state->segments[0], .cs = state->segments[1], .ss = state->segments[2], .ds = state->segments[3],
+        .ip = state->ip,
+        .flags = state->flags,
+        .cycles = state->cycles,
+    };
+    return result;
+}
+
+// What an instruction costs when its timing does not depend on the outcome
+int32 instruction_cost(instruction i)
+{
+    if (i.destination.tag == IOP_MEM) return i.cycles + i.destination.addr.cycles;
+    if (i.source.tag == IOP_MEM) return i.cycles + i.source.addr.cycles;
+    return i.cycles;
+}
+
+
+typedef struct
+{
+    FILE *file;
+    uint64 offset;
+
+    byte_buffer chunk;   // records of the current chunk
+    trace_state chunk_start;
+    uint64 chunk_first_step;
+    uint32 chunk_steps;
+    recorded_code *code; // by address, cleared for every chunk
+
+    trace_state last;    // state after the previous step
+    uint64 steps;
+
+    memory_write_log *writes; // of the recorded simulation, see e8086_log_writes
+    uint8 const *memory;
+
+    byte_buffer index;   // chunk offsets and first steps
+    uint32 chunk_count;
+} trace_file_writer;
+
+trace_file_writer *trace_file; // 0 unless --trace-out is given
+
+trace_file_writer *create_trace_file_writer(char const *path, sim8086 *sim, uint32 image_size)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) return 0;
+
+    trace_file_writer *writer = calloc(1, sizeof(trace_file_writer));
+    writer->file = file;
+    writer->code = calloc(1 << 16, sizeof(recorded_code));
+    e8086_state state = e8086_get_state(sim);
+    writer->last = capture_trace_state(&state);
+
+    byte_buffer header = {};
+    put_bytes(&header, "E86T", 4);
+    put_u16(&header, TRACE_FILE_VERSION);
+    put_u16(&header, state.cs);
+    put_u32(&header, image_size);
+    put_bytes(&header, e8086_code(sim), image_size);
+    fwrite(header.data, 1, header.used, file);
+    writer->offset = header.used;
+    free(header.data);
+
+    writer->writes = e8086_log_writes(sim);
+    writer->memory = e8086_memory(sim);
+    return writer;
+}
+
+void flush_trace_chunk(trace_file_writer *writer)
+{
+    if (!writer->chunk_steps) return;
+
+    put_u64(&writer->index, writer->offset);
+    put_u64(&writer->index, writer->chunk_first_step);
+    writer->chunk_count += 1;
+
+    byte_buffer header = {};
+    put_bytes(&header, "E86C", 4);
+    put_u32(&header, writer->chunk.used);
+    put_u32(&header, writer->chunk_steps);
+    put_u64(&header, writer->chunk_first_step);
+    put_trace_state(&header, &writer->chunk_start);
+    fwrite(header.data, 1, header.used, writer->file);
+    fwrite(writer->chunk.data, 1, writer->chunk.used, writer->file);
+    writer->offset += header.used + writer->chunk.used;
+    free(header.data);
+
+    writer->chunk.used = 0;
+    writer->chunk_steps = 0;
+}
+
+// `code` holds the bytes of `instr` as they were before it ran, `state` is
+// the state after it
+void record_trace_step(trace_file_writer *writer, uint16 ip, uint8 *code, uint32 length,
+                       instruction instr, e8086_state *state)
+{
+    if (writer->chunk_steps == TRACE_CHUNK_STEPS) flush_trace_chunk(writer);
+    if (writer->chunk_steps == 0)
+    {
+        writer->chunk_start = writer->last;
+        writer->chunk_start.ip = ip;
+        writer->chunk_first_step = writer->steps;
+        memset(writer->code, 0, (1 << 16) * sizeof(recorded_code));
+    }
+
+    trace_state *last = &writer->last;
+    trace_state now = capture_trace_state(state);
+    int32 cycles = (int32) (now.cycles - last->cycles);
+    bool jumped = (writer->chunk_steps > 0) && (ip != last->ip);
+
+    recorded_code *recorded = writer->code + ip;
+    bool new_code = (recorded->length != length) || memcmp(recorded->bytes, code, length) != 0;
+
+    uint8 changed_registers = 0;
+    for (uint32 index = 0; index < 8; index++)
+    {
+        if (now.regs[index] != last->regs[index]) changed_registers |= (1 << index);
+    }
+    uint8 changed_segments = 0;
+    for (uint32 index = 0; index < 4; index++)
+    {
+        if (now.segments[index] != last->segments[index]) changed_segments |= (1 << index);
+    }
+    memory_write_log *writes = writer->writes;
+
+    uint8 flags = 0;
+    if (jumped) flags |= RECORD_IP;
+    if (new_code) flags |= RECORD_CODE;
+    if (changed_registers) flags |= RECORD_REGISTERS;
+    if (now.flags != last->flags) flags |= RECORD_FLAGS;
+    if (writes->count) flags |= RECORD_WRITES;
+    if (cycles != instruction_cost(instr)) flags |= RECORD_CYCLES;
+    if (changed_segments) flags |= RECORD_SEGMENTS;
+
+    byte_buffer *out = &writer->chunk;
+    put_byte(out, flags);
+    if (jumped) put_signed_varint(out, (int16) (ip - last->ip));
+    if (new_code)
+    {
+        recorded->length = (uint8) length;
+        memcpy(recorded->bytes, code, length);
+        put_byte(out, (uint8) length);
+        put_bytes(out, code, length);
+    }
+    if (changed_registers)
+    {
+        put_byte(out, changed_registers);
+        for (uint32 index = 0; index < 8; index++)
+        {
+            if (changed_registers & (1 << index)) put_signed_varint(out, (int16) (now.regs[index] - last->regs[index]));
+        }
+    }
+    if (now.flags != last->flags) put_u16(out, now.flags);
+    if (writes->count)
+    {
+        put_varint(out, writes->count);
+        for (uint32 write_index = 0; write_index < writes->count; write_index++)
+        {
+            memory_write *write = writes->writes + write_index;
+            put_varint(out, write->address);
+            put_varint(out, write->count);
+            put_bytes(out, writer->memory + write->address, write->count);
+        }
+        writes->count = 0;
+    }
+    if (cycles != instruction_cost(instr)) put_varint(out, (uint32) cycles);
+    if (changed_segments)
+    {
+        put_byte(out, changed_segments);
+        for (uint32 index = 0; index < 4; index++)
+        {
+            if (changed_segments & (1 << index)) put_u16(out, now.segments[index]);
+        }
+    }
+
+    // The next record's IP is compared against the end of this instruction
+    now.ip = (uint16) (ip + length);
+    *last = now;
+    writer->chunk_steps += 1;
+    writer->steps += 1;
+}
+
+void close_trace_file_writer(trace_file_writer *writer, sim8086 *sim)
+{
+    flush_trace_chunk(writer);
+
+    uint64 index_offset = writer->offset;
+    e8086_state state = e8086_get_state(sim);
+    trace_state final = capture_trace_state(&state);
+
+    byte_buffer tail = {};
+    put_bytes(&tail, "E86I", 4);
+    put_u32(&tail, writer->chunk_count);
+    put_bytes(&tail, writer->index.data, writer->index.used);
+    put_trace_state(&tail, &final);
+    put_u64(&tail, index_offset);
+    put_bytes(&tail, "E86E", 4);
+    fwrite(tail.data, 1, tail.used, writer->file);
+    free(tail.data);
+
+    fclose(writer->file);
+    writer->file = 0;
+}
+
+sim8086 *trace_file_sim; // the simulation trace_file records
+
+// Called on exit, so a run that stops on an error still leaves a readable file
+void close_trace_file(void)
+{
+    if (trace_file && trace_file->file) close_trace_file_writer(trace_file, trace_file_sim);
+}
+
+
+typedef struct
+{
+    uint8 const *at;
+    uint8 const *end;
+} byte_reader;
+
+uint8 get_byte(byte_reader *reader)
+{
+    return (reader->at < reader->end) ? *reader->at++ : 0;
+}
+
+void get_bytes(byte_reader *reader, void *bytes, uint32 count)
+{
+    for (uint32 index = 0; index < count; index++) ((uint8 *) bytes)[index] = get_byte(reader);
+}
+
+uint16 get_u16(byte_reader *reader) { uint16 value = 0; get_bytes(reader, &value, 2); return value; }
+uint32 get_u32(byte_reader *reader) { uint32 value = 0; get_bytes(reader, &value, 4); return value; }
+uint64 get_u64(byte_reader *reader) { uint64 value = 0; get_bytes(reader, &value, 8); return value; }
+
+uint32 get_varint(byte_reader *reader)
+{
+    uint32 value = 0;
+    for (uint32 shift = 0; shift < 35; shift += 7)
+    {
+        uint8 byte = get_byte(reader);
+        value |= (uint32) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) break;
+    }
+    return value;
+}
+
+int32 get_signed_varint(byte_reader *reader)
+{
+    uint32 value = get_varint(reader);
+    return (int32) (value >> 1) ^ -(int32) (value & 1);
+}
+
+trace_state get_trace_state(byte_reader *reader)
+{
+    trace_state result = {};
+    result.cycles = get_u64(reader);
+    for (uint32 index = 0; index < 8; index++) result.regs[index] = get_u16(reader);
+    result.ip = get_u16(reader);
+    result.flags = get_u16(reader);
+    for (uint32 index = 0; index < 4; index++) result.segments[index] = get_u16(reader);
+    return result;
+}
+
+typedef struct
+{
+    uint64 number;
+    uint16 ip;
+    uint8 code[MAX_INSTRUCTION_LENGTH];
+    uint32 length;
+    instruction instr;  // cycles of branches and repeats are what they cost
+    int32 cycles;       // what the step cost
+    trace_state before;
+    trace_state after;  // IP is the end of the instruction unless the next step says otherwise
+} trace_file_step;
+
+typedef struct
+{
+    FILE *file;
+
+    uint32 image_size;
+    sim8086 *sim;   // never runs, only holds the guest memory
+    uint8 *memory;  // of sim: image with the writes of all steps read so far applied
+
+    uint32 chunk_count;
+    uint64 *chunk_offsets;
+    uint64 *chunk_first_steps;
+    trace_state final;
+
+    uint32 next_chunk;
+    uint8 *body;
+    byte_reader records;
+    uint32 steps_left;  // in the current chunk
+    uint64 step;        // number of the next step
+    trace_state state;  // before the next step
+    recorded_code *code;
+} trace_file_reader;
+
+bool load_trace_chunk(trace_file_reader *reader, uint32 chunk_index)
+{
+    if (chunk_index >= reader->chunk_count) return false;
+
+    uint8 header_bytes[4 + 4 + 4 + 8 + TRACE_STATE_SIZE];
+    fseeko(reader->file, (off_t) reader->chunk_offsets[chunk_index], SEEK_SET);
+    if (fread(header_bytes, 1, sizeof(header_bytes), reader->file) != sizeof(header_bytes)) return false;
+
+    byte_reader header = { header_bytes, header_bytes + sizeof(header_bytes) };
+    char magic[4];
+    get_bytes(&header, magic, 4);
+    if (memcmp(magic, "E86C", 4) != 0) return false;
+    uint32 body_size = get_u32(&header);
+    reader->steps_left = get_u32(&header);
+    reader->step = get_u64(&header);
+    reader->state = get_trace_state(&header);
+
+    free(reader->body);
+    reader->body = malloc(body_size ? body_size : 1);
+    if (fread(reader->body, 1, body_size, reader->file) != body_size) return false;
+    reader->records = (byte_reader) { reader->body, reader->body + body_size };
+
+    memset(reader->code, 0, (1 << 16) * sizeof(recorded_code));
+    reader->next_chunk = chunk_index + 1;
+    return true;
+}
+
+void close_trace_file_reader(trace_file_reader *reader)
+{
+    fclose(reader->file);
+    if (reader->sim) e8086_destroy(reader->sim);
+    free(reader->chunk_offsets);
+    free(reader->chunk_first_steps);
+    free(reader->body);
+    free(reader->code);
+    free(reader);
+}
+
+trace_file_reader *open_trace_file(char const *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) return 0;
+
+    uint8 header_bytes[12];
+    uint8 trailer_bytes[12];
+    bool valid = fread(header_bytes, 1, sizeof(header_bytes), file) == sizeof(header_bytes) &&
+                 memcmp(header_bytes, "E86T", 4) == 0 &&
+                 fseeko(file, -(off_t) sizeof(trailer_bytes), SEEK_END) == 0 &&
+                 fread(trailer_bytes, 1, sizeof(trailer_bytes), file) == sizeof(trailer_bytes) &&
+                 memcmp(trailer_bytes + 8, "E86E", 4) == 0;
+    if (!valid)
+    {
+        fclose(file);
+        return 0;
+    }
+
+    trace_file_reader *reader = calloc(1, sizeof(trace_file_reader));
+    reader->file = file;
+    reader->code = calloc(1 << 16, sizeof(recorded_code));
+    reader->sim = e8086_create();
+    if (reader->sim) reader->memory = e8086_memory(reader->sim);
+    else valid = false;
+
+    byte_reader header = { header_bytes + 4, header_bytes + sizeof(header_bytes) };
+    if (get_u16(&header) != TRACE_FILE_VERSION) valid = false;
+    uint32 load_address = (uint32) get_u16(&header) << 4;
+    reader->image_size = get_u32(&header);
+    if (reader->image_size > SEGMENT_SIZE) valid = false;
+    fseeko(file, sizeof(header_bytes), SEEK_SET);
+    if (valid && fread(reader->memory + load_address, 1, reader->image_size, file) != reader->image_size) valid = false;
+
+    // Index and final state
+    byte_reader trailer = { trailer_bytes, trailer_bytes + 8 };
+    uint64 index_offset = get_u64(&trailer);
+    // An offset past the index end is a broken file, not a huge index
+    fseeko(file, 0, SEEK_END);
+    uint64 index_end = (uint64) ftello(file) - sizeof(trailer_bytes);
+    uint64 index_size = index_end - index_offset;
+    uint8 *index_bytes = (valid && index_offset <= index_end) ? malloc(index_size ? index_size : 1) : 0;
+    if (!index_bytes ||
+        fseeko(file, (off_t) index_offset, SEEK_SET) != 0 ||
+        fread(index_bytes, 1, index_size, file) != index_size)
+    {
+        free(index_bytes);
+        close_trace_file_reader(reader);
+        return 0;
+    }
+
+    byte_reader index = { index_bytes, index_bytes + index_size };
+    char magic[4];
+    get_bytes(&index, magic, 4);
+    if (memcmp(magic, "E86I", 4) != 0) valid = false;
+    reader->chunk_count = get_u32(&index);
+    // Every chunk has 16 bytes in the index
+    if (!valid || (uint64) reader->chunk_count * 16 > index_size)
+    {
+        free(index_bytes);
+        close_trace_file_reader(reader);
+        return 0;
+    }
+    reader->chunk_offsets = calloc(reader->chunk_count + 1, sizeof(uint64));
+    reader->chunk_first_steps = calloc(reader->chunk_count + 1, sizeof(uint64));
+    for (uint32 chunk_index = 0; chunk_index < reader->chunk_count; chunk_index++)
+    {
+        reader->chunk_offsets[chunk_index] = get_u64(&index);
+        reader->chunk_first_steps[chunk_index] = get_u64(&index);
+    }
+    reader->final = get_trace_state(&index);
+    free(index_bytes);
+    return reader;
+}
+
+// Positions the reader on the chunk that holds `step`. Memory contents are
+// only tracked for reads that start at the beginning of the trace.
+bool seek_trace_file(trace_file_reader *reader, uint64 step)
+{
+    uint32 chunk_index = 0;
+    while (chunk_index + 1 < reader->chunk_count && reader->chunk_first_steps[chunk_index + 1] <= step)
+    {
+        chunk_index += 1;
+    }
+    return load_trace_chunk(reader, chunk_index);
+}
+
+bool read_trace_step(trace_file_reader *reader, trace_file_step *step)
+{
+    while (!reader->steps_left)
+    {
+        if (!load_trace_chunk(reader, reader->next_chunk)) return false;
+    }
+
+    byte_reader *records = &reader->records;
+    trace_state *state = &reader->state;
+    uint8 flags = get_byte(records);
+
+    if (flags & RECORD_IP) state->ip += (uint16) get_signed_varint(records);
+    recorded_code *recorded = reader->code + state->ip;
+    if (flags & RECORD_CODE)
+    {
+        recorded->length = get_byte(records);
+        if (recorded->length > MAX_INSTRUCTION_LENGTH) recorded->length = MAX_INSTRUCTION_LENGTH;
+        get_bytes(records, recorded->bytes, recorded->length);
+    }
+
+    step->number = reader->step;
+    step->ip = state->ip;
+    step->length = recorded->length;
+    memcpy(step->code, recorded->bytes, recorded->length);
+    step->before = *state;
+
+    if (flags & RECORD_REGISTERS)
+    {
+        uint8 changed_registers = get_byte(records);
+        for (uint32 index = 0; index < 8; index++)
+        {
+            if (changed_registers & (1 << index)) state->regs[index] += (uint16) get_signed_varint(records);
+        }
+    }
+    if (flags & RECORD_FLAGS) state->flags = get_u16(records);
+    if (flags & RECORD_WRITES)
+    {
+        uint32 count = get_varint(records);
+        for (uint32 write_index = 0; write_index < count; write_index++)
+        {
+            uint32 address = get_varint(records);
+            uint32 length = get_varint(records);
+            for (uint32 offset = 0; offset < length; offset++)
+            {
+                uint8 byte = get_byte(records);
+                reader->memory[(address + offset) & MEMORY_ADDRESS_MASK] = byte;
+            }
+        }
+    }
+
+    // Cost of the decoded instruction unless the record says otherwise
+    uint8 *code = reader->memory + ((uint32) state->segments[1] << 4);
+    uint8 saved[MAX_INSTRUCTION_LENGTH];
+    for (uint32 offset = 0; offset < step->length; offset++)
+    {
+        saved[offset] = code[(uint16) (step->ip + offset)];
+        code[(uint16) (step->ip + offset)] = step->code[offset];
+    }
+    instruction instr = {};
+    e8086_decode(code, step->ip, &instr);
+    for (uint32 offset = 0; offset < step->length; offset++)
+    {
+        code[(uint16) (step->ip + offset)] = saved[offset];
+    }
+    step->cycles = (flags & RECORD_CYCLES) ? (int32) get_varint(records) : instruction_cost(instr);
+    if (flags & RECORD_SEGMENTS)
+    {
+        uint8 changed_segments = get_byte(records);
+        for (uint32 index = 0; index < 4; index++)
+        {
+            if (changed_segments & (1 << index)) state->segments[index] = get_u16(records);
+        }
+    }
+    if (e8086_has_variable_cycles(&instr)) instr.cycles = step->cycles;
+    step->instr = instr;
+
+    state->cycles += step->cycles;
+    state->ip = (uint16) (step->ip + step->length);
+    step->after = *state;
+
+    reader->steps_left -= 1;
+    reader->step += 1;
+    return true;
+}
@@ -0,0 +1,193 @@
+/*
+    Asynchronous tracing.
+
+    With --trace-async the execute loop only copies every step into a ring
+    buffer and a second thread formats and writes it, so a trace costs the
+    simulation little more than a copy per instruction.
+
+    The ring has one producer (the execute loop) and one consumer (the
+    trace thread). Each side owns one index, publishes it with a release
+    store and only reads the other one. A full ring makes the producer wait
+    for the trace thread, so no line is dropped and memory stays bounded.
+
+    Messages printed during the run are queued as well, so they end up in
+    the same place among the trace lines as in the synchronous mode.
+*/
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+
+#define TRACE_RING_SIZE 4096 // records, a power of two
+#define TRACE_SPINS 64       // polls before giving up the core
+
+typedef struct
+{
+    char *message; // 0 for instructions, otherwise printed and freed by the trace thread
+    uint64 cycles;
+    instruction instr;
+    e8086_state before;
+    e8086_state after;
+} trace_record;
+
+typedef struct
+{
+    trace_record *records;
+    uint32 mask;
+    trace_level level;
+    pthread_t thread;
+
+    // Producer side
+    alignas(64) _Atomic uint32 head;
+    uint32 cached_tail;
+    atomic_bool done;
+    uint64 records_queued;
+    uint64 full_waits; // pushes that found the ring full
+
+    // Consumer side
+    alignas(64) _Atomic uint32 tail;
+} trace_pipeline;
+
+trace_pipeline *trace_pipe; // 0 unless a trace thread runs
+
+void wait_for_other_side(uint32 *spins)
+{
+    if (*spins < TRACE_SPINS) *spins += 1;
+    else sched_yield();
+}
+
+void *run_trace_thread(void *data)
+{
+    trace_pipeline *pipe = data;
+    uint32 tail = atomic_load_explicit(&pipe->tail, memory_order_relaxed);
+    uint32 spins = 0;
+    for (;;)
+    {
+        uint32 head = atomic_load_explicit(&pipe->head, memory_order_acquire);
+        if (head == tail)
+        {
+            // done is set after the last record was published
+            if (atomic_load_explicit(&pipe->done, memory_order_acquire) &&
+                atomic_load_explicit(&pipe->head, memory_order_acquire) == tail) break;
+            wait_for_other_side(&spins);
+            continue;
+        }
+
+        spins = 0;
+        while (tail != head)
+        {
+            trace_record *record = pipe->records + (tail & pipe->mask);
+            if (record->message)
+            {
+                output_reserve(trace_output, (uint32) strlen(record->message));
+                output_string(trace_output, record->message);
+                free(record->message);
+            }
+            else
+            {
+                trace_instruction(pipe->level, record->cycles, record->instr, &record->before, &record->after);
+            }
+            tail += 1;
+
+            // Hand slots back during long batches, a waiting producer can go on sooner
+            if ((tail & 63) == 0) atomic_store_explicit(&pipe->tail, tail, memory_order_release);
+        }
+        atomic_store_explicit(&pipe->tail, tail, memory_order_release);
+    }
+    return 0;
+}
+
+// Formats into trace_output, which belongs to the trace thread until stop_trace_pipeline
+trace_pipeline *start_trace_pipeline(trace_level level, uint32 size)
+{
+    uint32 count = 2;
+    while (count < size) count *= 2;
+
+    trace_pipeline *pipe = aligned_alloc(alignof(trace_pipeline), sizeof(trace_pipeline));
+    memset(pipe, 0, sizeof(trace_pipeline));
+    pipe->records = malloc(count * sizeof(trace_record));
+    pipe->mask = count - 1;
+    pipe->level = level;
+
+    if (pthread_create(&pipe->thread, 0, run_trace_thread, pipe) != 0)
+    {
+        free(pipe->records);
+        free(pipe);
+        return 0;
+    }
+    return pipe;
+}
+
+trace_record *begin_trace_record(trace_pipeline *pipe)
+{
+    uint32 head = atomic_load_explicit(&pipe->head, memory_order_relaxed);
+    if (head - pipe->cached_tail > pipe->mask)
+    {
+        pipe->cached_tail = atomic_load_explicit(&pipe->tail, memory_order_acquire);
+        if (head - pipe->cached_tail > pipe->mask)
+        {
+            pipe->full_waits += 1;
+            uint32 spins = 0;
+            do
+            {
+                wait_for_other_side(&spins);
+                pipe->cached_tail = atomic_load_explicit(&pipe->tail, memory_order_acquire);
+            }
+            while (head - pipe->cached_tail > pipe->mask);
+        }
+    }
+    return pipe->records + (head & pipe->mask);
+}
+
+void end_trace_record(trace_pipeline *pipe)
+{
+    uint32 head = atomic_load_explicit(&pipe->head, memory_order_relaxed);
+    atomic_store_explicit(&pipe->head, head + 1, memory_order_release);
+    pipe->records_queued += 1;
+}
+
+void queue_trace_instruction(trace_pipeline *pipe, uint64 cycles, instruction i, e8086_state *before, e8086_state *after)
+{
+    trace_record *record = begin_trace_record(pipe);
+    record->message = 0;
+    record->cycles = cycles;
+    record->instr = i;
+    if (pipe->level == TRACE_REGISTERS)
+    {
+        record->before = *before;
+        record->after = *after;
+    }
+    end_trace_record(pipe);
+}
+
+bool queue_trace_message(char const *message)
+{
+    if (!trace_pipe) return false;
+
+    trace_record *record = begin_trace_record(trace_pipe);
+    record->message = strdup(message);
+    end_trace_record(trace_pipe);
+    return true;
+}
+
+// Waits until every queued record is written to trace_output
+void stop_trace_pipeline(trace_pipeline *pipe)
+{
+    atomic_store_explicit(&pipe->done, true, memory_order_release);
+    pthread_join(pipe->thread, 0);
+}
+
+// Called on exit before flush_trace_output, so an error does not lose queued lines
+void stop_trace_thread(void)
+{
+    if (!trace_pipe) return;
+    stop_trace_pipeline(trace_pipe);
+    trace_pipe = 0;
+}
+
+void print_out_trace_pipeline_statistics(trace_pipeline *pipe)
+{
+    printf("    trace thread: %llu records through a ring of %u, the ring was full %llu times\n",
+        pipe->records_queued, pipe->mask + 1, pipe->full_waits);
+}
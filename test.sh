@@ -0,0 +1,59 @@
+#!/bin/bash
+
+# Run from the build directory after build.sh
+
+E8086=./e8086
+TEMP=$(mktemp -d)
+FAILED=0
+
+trap 'rm -rf "$TEMP"' EXIT
+
+# expect <name> <output file> <text the output must contain>
+expect()
+{
+    if grep -qF "$3" "$2"; then
+        echo "ok      $1"
+    else
+        echo "FAILED  $1: no '$3' in"
+        cat "$2"
+        FAILED=1
+    fi
+}
+
+# Immediate to memory takes the cycles of its own instruction plus the EA
+#     add word [bx], 5
+printf '\x81\x07\x05\x00' > "$TEMP/add_memory_imm.bin"
+$E8086 --trace=cycles "$TEMP/add_memory_imm.bin" > "$TEMP/add_memory_imm.txt"
+expect "add word [bx], 5 cycles" "$TEMP/add_memory_imm.txt" "ADD [bx], 5               22 = 17 + 5ea cycles"
+for engine in threaded jit; do
+    $E8086 --engine=$engine "$TEMP/add_memory_imm.bin" > "$TEMP/add_memory_imm_$engine.txt"
+    expect "add word [bx], 5 cycles ($engine)" "$TEMP/add_memory_imm_$engine.txt" "Cycles: 22"
+done
+
+# Words at offset FFFF wrap around to offset 0 of their segment, physical addresses at 1 MiB
+#     mov ax, 0x2000; mov ds, ax; mov word [0xffff], 0x1234; mov cx, [0]
+#     mov ax, 0xffff; mov ds, ax; mov byte [0x110], 0x5a; mov ax, 0; mov ds, ax; mov bx, [0x100]
+printf '\xb8\x00\x20\x8e\xd8\xc7\x06\xff\xff\x34\x12\x8b\x0e\x00\x00\xb8\xff\xff\x8e\xd8' > "$TEMP/wrap.bin"
+printf '\xc6\x06\x10\x01\x5a\xb8\x00\x00\x8e\xd8\x8b\x1e\x00\x01' >> "$TEMP/wrap.bin"
+for engine in interpreter threaded jit; do
+    $E8086 --engine=$engine "$TEMP/wrap.bin" > "$TEMP/wrap_$engine.txt"
+    expect "word at offset ffff ($engine)" "$TEMP/wrap_$engine.txt" "CX: 00000000 00010010"
+    expect "address past 1 MiB ($engine)" "$TEMP/wrap_$engine.txt" "BX: 00000000 01011010"
+done
+
+# 3000 times REP MOVSW of 65535 words, 3342408000 cycles, more than an int32 holds
+#     mov ax, 0x2000; mov ds, ax; mov es, ax; mov dx, 3000
+# top:
+#     mov si, 0; mov di, 0; mov cx, 0xffff; rep movsw; sub dx, 1; jne top
+printf '\xb8\x00\x20\x8e\xd8\x8e\xc0\xba\xb8\x0b\xbe\x00\x00\xbf\x00\x00' > "$TEMP/long_run.bin"
+printf '\xb9\xff\xff\xf3\xa5\x83\xea\x01\x75\xf0' >> "$TEMP/long_run.bin"
+
+(cd "$TEMP" && "$OLDPWD/$E8086" --batch long_run.bin) > "$TEMP/batch.txt"
+expect "batch past 2^31 cycles" "$TEMP/batch.txt" '"status":"halted","cycles":3342408000,'
+
+# Stops after the REP MOVSW that crosses the limit, with 308 rounds left
+(cd "$TEMP" && "$OLDPWD/$E8086" --batch --max-cycles=3000000000 long_run.bin) > "$TEMP/batch_limit.txt"
+expect "batch cycle limit past 2^31" "$TEMP/batch_limit.txt" '"status":"cycle_limit","cycles":3000368240,'
+expect "batch cycle limit registers" "$TEMP/batch_limit.txt" '"dx":308,'
+
+exit $FAILED